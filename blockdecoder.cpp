@@ -0,0 +1,527 @@
+/*
+Copyright 2013 Jared Wiltshire
+
+This file is part of VAG Blocks.
+
+VAG Blocks is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+VAG Blocks is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with VAG Blocks.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "blockdecoder.h"
+
+#include <QString>
+#include <QChar>
+#include <QElapsedTimer>
+
+// UTF-8, in blockUnits order
+static const char* const unitsTable[numBlockUnits] = {
+    "",
+    "Raw",
+    "Binary",
+    "ASCII",
+    "rpm",
+    "\xC2\xB0 BTDC",
+    "\xC2\xB0 ATDC",
+    "km/h",
+    "mbar",
+    "%",
+    "V",
+    "ms",
+    "\xC2\xB0 C",
+    "kW",
+    "l/h",
+    "mg/stk",
+    "mg/stk \xCE\x94",
+    "Count",
+    "s",
+    "\xC2\xB0 CF",
+    "Nm",
+    "\xC2\xB0",
+    "Ohm",
+    "mm",
+    "bar",
+    "l",
+    "A",
+    "g/s",
+    "\xC2\xB0 k/w",
+    "km",
+    "Ah",
+    "WSC",
+    "\xC2\xB0/s",
+    "m/s\xC2\xB2",
+    "/s"
+};
+
+#define RAW {formulaRaw, unitsRaw, unitsRaw, 0, 0, 0, 0, 0}
+#define BINARY {formulaBinary, unitsBinary, unitsBinary, 0, 0, 0, 0, 0}
+
+// Every formula ID, the ones marked RAW aren't known and are shown as the raw word.
+// 0x01 to 0x46 follow the published lists, past that only 0x51 and 0x5E are known.
+// A plain array of constants rather than anything built at run time, so it's ready
+// before any static constructor runs and safe to read from the dissector threads.
+static const formulaDef formulaTable[256] = {
+    /* 00 */ RAW,
+    /* 01 */ {formulaProduct, unitsRpm, unitsRpm, 0.2, 0, 0, 0, 0},
+    /* 02 */ {formulaProduct, unitsPercent, unitsPercent, 0.002, 0, 0, 0, 0},
+    /* 03 */ {formulaProduct, unitsDeg, unitsDeg, 0.002, 0, 0, 0, 0},
+    /* 04 */ {formulaTiming, unitsBTDC, unitsATDC, 0.01, 127, 0, 0, 0},
+    /* 05 */ {formulaProduct, unitsDegC, unitsDegC, 0.1, -100, 0, 0, 0},
+    /* 06 */ {formulaProduct, unitsVolts, unitsVolts, 0.001, 0, 0, 0, 0},
+    /* 07 */ {formulaProduct, unitsKmh, unitsKmh, 0.01, 0, 0, 0, 0},
+    /* 08 */ BINARY, // kept as it was, some lists give 0.1 * a * b
+    /* 09 */ {formulaProduct, unitsDeg, unitsDeg, 0.02, -127, 0, 0, 0},
+    /* 0A */ {formulaSwitch, unitsNone, unitsNone, 0, 0, 0, "COLD", "WARM"},
+    /* 0B */ {formulaProduct, unitsNone, unitsNone, 0.0001, -128, 1, 0, 0},
+    /* 0C */ {formulaProduct, unitsOhm, unitsOhm, 0.001, 0, 0, 0, 0},
+    /* 0D */ {formulaProduct, unitsMm, unitsMm, 0.001, -127, 0, 0, 0},
+    /* 0E */ {formulaProduct, unitsBar, unitsBar, 0.005, 0, 0, 0, 0},
+    /* 0F */ {formulaProduct, unitsMs, unitsMs, 0.01, 0, 0, 0, 0},
+    /* 10 */ BINARY,
+    /* 11 */ {formulaText, unitsASCII, unitsASCII, 0, 0, 0, 0, 0},
+    /* 12 */ {formulaProduct, unitsMbar, unitsMbar, 0.04, 0, 0, 0, 0},
+    /* 13 */ {formulaProduct, unitsLitres, unitsLitres, 0.01, 0, 0, 0, 0},
+    /* 14 */ {formulaProduct, unitsPercent, unitsPercent, 1 / 128.0, 0, -1, 0, 0}, // kept as it was, some lists give a * (b - 128) / 128
+    /* 15 */ {formulaProduct, unitsVolts, unitsVolts, 0.001, 0, 0, 0, 0},
+    /* 16 */ {formulaProduct, unitsMs, unitsMs, 0.001, 0, 0, 0, 0},
+    /* 17 */ {formulaProduct, unitsPercent, unitsPercent, 1 / 256.0, 0, 0, 0, 0},
+    /* 18 */ {formulaProduct, unitsAmps, unitsAmps, 0.001, 0, 0, 0, 0},
+    /* 19 */ {formulaLinear, unitsGramsPerSec, unitsGramsPerSec, 1 / 182.0, 1.421, 0, 0, 0},
+    /* 1A */ {formulaLinear, unitsDegC, unitsDegC, -1, 1, 0, 0, 0},
+    /* 1B */ {formulaTiming, unitsBTDC, unitsATDC, 0.01, 128, 0, 0, 0},
+    /* 1C */ {formulaLinear, unitsNone, unitsNone, -1, 1, 0, 0, 0},
+    /* 1D */ {formulaCompare, unitsNone, unitsNone, 0, 0, 0, "1st map", "2nd map"},
+    /* 1E */ {formulaProduct, unitsDegKw, unitsDegKw, 1 / 12.0, 0, 0, 0, 0},
+    /* 1F */ {formulaProduct, unitsDegC, unitsDegC, 1 / 2560.0, 0, 0, 0, 0},
+    /* 20 */ {formulaSigned, unitsNone, unitsNone, 1, 0, 0, 0, 0},
+    /* 21 */ {formulaRatio, unitsPercent, unitsPercent, 100, 0, 0, 0, 0},
+    /* 22 */ {formulaProduct, unitsKW, unitsKW, 0.01, -128, 0, 0, 0},
+    /* 23 */ {formulaProduct, unitsLph, unitsLph, 0.01, 0, 0, 0, 0},
+    /* 24 */ {formulaLinear, unitsKm, unitsKm, 2560, 10, 0, 0, 0},
+    /* 25 */ BINARY,
+    /* 26 */ {formulaProduct, unitsDegKw, unitsDegKw, 0.001, -128, 0, 0, 0},
+    /* 27 */ {formulaProduct, unitsMgStk, unitsMgStk, 1 / 256.0, 0, 0, 0, 0}, // fuel
+    /* 28 */ {formulaLinear, unitsAmps, unitsAmps, 25.5, 0.1, -400, 0, 0},
+    /* 29 */ {formulaLinear, unitsAh, unitsAh, 255, 1, 0, 0, 0},
+    /* 2A */ {formulaLinear, unitsKW, unitsKW, 25.5, 0.1, -400, 0, 0},
+    /* 2B */ {formulaLinear, unitsVolts, unitsVolts, 25.5, 0.1, 0, 0, 0},
+    /* 2C */ {formulaClock, unitsNone, unitsNone, 0, 0, 0, 0, 0},
+    /* 2D */ {formulaProduct, unitsNone, unitsNone, 0.001, 0, 0, 0, 0},
+    /* 2E */ {formulaProduct, unitsDegKw, unitsDegKw, 0.0027, 0, -8.64, 0, 0},
+    /* 2F */ {formulaProduct, unitsMs, unitsMs, 1, -128, 0, 0, 0},
+    /* 30 */ {formulaLinear, unitsNone, unitsNone, 255, 1, 0, 0, 0},
+    /* 31 */ {formulaProduct, unitsMgStk, unitsMgStk, 1 / 40.0, 0, 0, 0, 0}, // air, same as (b / 4) * a * 0.1
+    /* 32 */ {formulaRatio, unitsMbar, unitsMbar, 100, -128, 0, 0, 0},
+    /* 33 */ {formulaProduct, unitsMgStkDelta, unitsMgStkDelta, 1 / 255.0, -128, 0, 0, 0},
+    /* 34 */ {formulaProduct, unitsNm, unitsNm, 0.02, -50, 0, 0, 0},
+    /* 35 */ {formulaLinear, unitsGramsPerSec, unitsGramsPerSec, 0.006, 1.4222, -182.0416, 0, 0},
+    /* 36 */ {formulaLinear, unitsCount, unitsCount, 256, 1, 0, 0, 0},
+    /* 37 */ {formulaProduct, unitsSecs, unitsSecs, 1 / 200.0, 0, 0, 0, 0},
+    /* 38 */ {formulaLinear, unitsWSC, unitsWSC, 256, 1, 0, 0, 0},
+    /* 39 */ {formulaLinear, unitsWSC, unitsWSC, 256, 1, 65536, 0, 0},
+    /* 3A */ {formulaMagnitude, unitsPerSec, unitsPerSec, 1.0225, 0, 0, 0, 0},
+    /* 3B */ {formulaLinear, unitsNone, unitsNone, 256 / 32768.0, 1 / 32768.0, 0, 0, 0},
+    /* 3C */ {formulaLinear, unitsSecs, unitsSecs, 2.56, 0.01, 0, 0, 0},
+    /* 3D */ {formulaRatio, unitsNone, unitsNone, 1, -128, 0, 0, 0},
+    /* 3E */ {formulaProduct, unitsSecs, unitsSecs, 0.256, 0, 0, 0, 0},
+    /* 3F */ {formulaText, unitsASCII, unitsASCII, 0, 0, 0, 0, 0},
+    /* 40 */ {formulaLinear, unitsOhm, unitsOhm, 1, 1, 0, 0, 0},
+    /* 41 */ {formulaProduct, unitsMm, unitsMm, 0.01, -127, 0, 0, 0},
+    /* 42 */ {formulaProduct, unitsVolts, unitsVolts, 1 / 511.12, 0, 0, 0, 0},
+    /* 43 */ {formulaLinear, unitsDeg, unitsDeg, 640, 2.5, 0, 0, 0},
+    /* 44 */ {formulaLinear, unitsDegPerSec, unitsDegPerSec, 256 / 7.365, 1 / 7.365, 0, 0, 0},
+    /* 45 */ {formulaLinear, unitsBar, unitsBar, 256 * 0.3254, 0.3254, 0, 0, 0},
+    /* 46 */ {formulaLinear, unitsAccel, unitsAccel, 256 * 0.192, 0.192, 0, 0, 0},
+    /* 47 */ RAW,
+    /* 48 */ RAW,
+    /* 49 */ RAW,
+    /* 4A */ RAW,
+    /* 4B */ RAW,
+    /* 4C */ RAW,
+    /* 4D */ RAW,
+    /* 4E */ RAW,
+    /* 4F */ RAW,
+    /* 50 */ RAW,
+    /* 51 */ {formulaLinear, unitsDegCF, unitsDegCF, 112, 0.436, 0, 0, 0}, // torsion, check formula
+    /* 52 */ RAW,
+    /* 53 */ RAW,
+    /* 54 */ RAW,
+    /* 55 */ RAW,
+    /* 56 */ RAW,
+    /* 57 */ RAW,
+    /* 58 */ RAW,
+    /* 59 */ RAW,
+    /* 5A */ RAW,
+    /* 5B */ RAW,
+    /* 5C */ RAW,
+    /* 5D */ RAW,
+    /* 5E */ {formulaProduct, unitsNm, unitsNm, 1 / 50.0, -50, 0, 0, 0}, // torque, same shape as 0x34
+    /* 5F */ RAW,
+    /* 60 */ RAW,
+    /* 61 */ RAW,
+    /* 62 */ RAW,
+    /* 63 */ RAW,
+    /* 64 */ RAW,
+    /* 65 */ RAW,
+    /* 66 */ RAW,
+    /* 67 */ RAW,
+    /* 68 */ RAW,
+    /* 69 */ RAW,
+    /* 6A */ RAW,
+    /* 6B */ RAW,
+    /* 6C */ RAW,
+    /* 6D */ RAW,
+    /* 6E */ RAW,
+    /* 6F */ RAW,
+    /* 70 */ RAW,
+    /* 71 */ RAW,
+    /* 72 */ RAW,
+    /* 73 */ RAW,
+    /* 74 */ RAW,
+    /* 75 */ RAW,
+    /* 76 */ RAW,
+    /* 77 */ RAW,
+    /* 78 */ RAW,
+    /* 79 */ RAW,
+    /* 7A */ RAW,
+    /* 7B */ RAW,
+    /* 7C */ RAW,
+    /* 7D */ RAW,
+    /* 7E */ RAW,
+    /* 7F */ RAW,
+    /* 80 */ RAW,
+    /* 81 */ RAW,
+    /* 82 */ RAW,
+    /* 83 */ RAW,
+    /* 84 */ RAW,
+    /* 85 */ RAW,
+    /* 86 */ RAW,
+    /* 87 */ RAW,
+    /* 88 */ RAW,
+    /* 89 */ RAW,
+    /* 8A */ RAW,
+    /* 8B */ RAW,
+    /* 8C */ RAW,
+    /* 8D */ RAW,
+    /* 8E */ RAW,
+    /* 8F */ RAW,
+    /* 90 */ RAW,
+    /* 91 */ RAW,
+    /* 92 */ RAW,
+    /* 93 */ RAW,
+    /* 94 */ RAW,
+    /* 95 */ RAW,
+    /* 96 */ RAW,
+    /* 97 */ RAW,
+    /* 98 */ RAW,
+    /* 99 */ RAW,
+    /* 9A */ RAW,
+    /* 9B */ RAW,
+    /* 9C */ RAW,
+    /* 9D */ RAW,
+    /* 9E */ RAW,
+    /* 9F */ RAW,
+    /* A0 */ RAW,
+    /* A1 */ RAW,
+    /* A2 */ RAW,
+    /* A3 */ RAW,
+    /* A4 */ RAW,
+    /* A5 */ RAW,
+    /* A6 */ RAW,
+    /* A7 */ RAW,
+    /* A8 */ RAW,
+    /* A9 */ RAW,
+    /* AA */ RAW,
+    /* AB */ RAW,
+    /* AC */ RAW,
+    /* AD */ RAW,
+    /* AE */ RAW,
+    /* AF */ RAW,
+    /* B0 */ RAW,
+    /* B1 */ RAW,
+    /* B2 */ RAW,
+    /* B3 */ RAW,
+    /* B4 */ RAW,
+    /* B5 */ RAW,
+    /* B6 */ RAW,
+    /* B7 */ RAW,
+    /* B8 */ RAW,
+    /* B9 */ RAW,
+    /* BA */ RAW,
+    /* BB */ RAW,
+    /* BC */ RAW,
+    /* BD */ RAW,
+    /* BE */ RAW,
+    /* BF */ RAW,
+    /* C0 */ RAW,
+    /* C1 */ RAW,
+    /* C2 */ RAW,
+    /* C3 */ RAW,
+    /* C4 */ RAW,
+    /* C5 */ RAW,
+    /* C6 */ RAW,
+    /* C7 */ RAW,
+    /* C8 */ RAW,
+    /* C9 */ RAW,
+    /* CA */ RAW,
+    /* CB */ RAW,
+    /* CC */ RAW,
+    /* CD */ RAW,
+    /* CE */ RAW,
+    /* CF */ RAW,
+    /* D0 */ RAW,
+    /* D1 */ RAW,
+    /* D2 */ RAW,
+    /* D3 */ RAW,
+    /* D4 */ RAW,
+    /* D5 */ RAW,
+    /* D6 */ RAW,
+    /* D7 */ RAW,
+    /* D8 */ RAW,
+    /* D9 */ RAW,
+    /* DA */ RAW,
+    /* DB */ RAW,
+    /* DC */ RAW,
+    /* DD */ RAW,
+    /* DE */ RAW,
+    /* DF */ RAW,
+    /* E0 */ RAW,
+    /* E1 */ RAW,
+    /* E2 */ RAW,
+    /* E3 */ RAW,
+    /* E4 */ RAW,
+    /* E5 */ RAW,
+    /* E6 */ RAW,
+    /* E7 */ RAW,
+    /* E8 */ RAW,
+    /* E9 */ RAW,
+    /* EA */ RAW,
+    /* EB */ RAW,
+    /* EC */ RAW,
+    /* ED */ RAW,
+    /* EE */ RAW,
+    /* EF */ RAW,
+    /* F0 */ RAW,
+    /* F1 */ RAW,
+    /* F2 */ RAW,
+    /* F3 */ RAW,
+    /* F4 */ RAW,
+    /* F5 */ RAW,
+    /* F6 */ RAW,
+    /* F7 */ RAW,
+    /* F8 */ RAW,
+    /* F9 */ RAW,
+    /* FA */ RAW,
+    /* FB */ RAW,
+    /* FC */ RAW,
+    /* FD */ RAW,
+    /* FE */ RAW,
+    /* FF */ RAW
+};
+
+#undef RAW
+#undef BINARY
+
+void blockDecoder::decode(quint8 id, quint8 a, quint8 b, typedValue &out)
+{
+    const formulaDef &f = formulaTable[id];
+    out.kind = numberValue;
+    out.units = f.units;
+
+    switch (f.kind) {
+    case formulaProduct:
+        out.val = a * (b + f.param) * f.scale + f.offset;
+        break;
+    case formulaLinear:
+        out.val = a * f.scale + b * f.param + f.offset;
+        break;
+    case formulaRatio:
+        out.val = (a == 0) ? (b + f.param) * f.scale : (b + f.param) * f.scale / a;
+        break;
+    case formulaTiming:
+        out.val = qAbs(b - f.param) * a * f.scale;
+        if (b > f.param) {
+            out.units = f.altUnits;
+        }
+        break;
+    case formulaSigned:
+        out.val = (b > 128 ? b - 256 : b) * f.scale;
+        break;
+    case formulaMagnitude:
+        out.val = (b > 128 ? 256 - b : b) * f.scale;
+        break;
+    case formulaSwitch:
+    case formulaCompare:
+        out.kind = textValue;
+        out.val = 0;
+        if (f.kind == formulaSwitch ? b == 0 : b < a) {
+            out.text = QString::fromAscii(f.text);
+        }
+        else {
+            out.text = QString::fromAscii(f.altText);
+        }
+        break;
+    case formulaClock:
+        out.kind = textValue;
+        out.val = 0;
+        out.text = QString("%1:%2").arg(static_cast<int>(a), 2, 10, QChar('0')).arg(static_cast<int>(b), 2, 10, QChar('0'));
+        break;
+    case formulaText:
+        out.kind = textValue;
+        out.val = 0;
+        out.text.resize(2);
+        out.text[0] = QChar::fromAscii(a);
+        out.text[1] = QChar::fromAscii(b);
+        break;
+    default:
+        out.kind = rawValue;
+        out.val = (a << 8 | b);
+        break;
+    }
+}
+
+// Decodes count consecutive triplets (ID, a, b), eg. the 4 values of a block or
+// every value of a dynamic identifier, returns the number decoded
+int blockDecoder::decodeTriplets(const char *data, int count, typedValue *out)
+{
+    const quint8 *p = reinterpret_cast<const quint8*>(data);
+    for (int i = 0; i < count; i++, p += 3) {
+        decode(p[0], p[1], p[2], out[i]);
+    }
+    return count;
+}
+
+const formulaDef& blockDecoder::formula(quint8 id)
+{
+    return formulaTable[id];
+}
+
+bool blockDecoder::isKnown(quint8 id)
+{
+    return formulaTable[id].kind != formulaRaw;
+}
+
+const char* blockDecoder::unitsText(int units)
+{
+    if (units < 0 || units >= numBlockUnits) {
+        return "";
+    }
+    return unitsTable[units];
+}
+
+typedef struct {
+    quint8 id;
+    quint8 a;
+    quint8 b;
+    int kind;
+    double val;
+    int units;
+    const char *text;
+} goldenVector;
+
+// worked out by hand from the formulas, not from the table
+static const goldenVector goldenVectors[] = {
+    {0x01, 200, 50, numberValue, 2000, unitsRpm, 0},
+    {0x04, 100, 137, numberValue, 10, unitsATDC, 0},
+    {0x04, 100, 117, numberValue, 10, unitsBTDC, 0},
+    {0x05, 10, 150, numberValue, 50, unitsDegC, 0},
+    {0x07, 100, 50, numberValue, 50, unitsKmh, 0},
+    {0x08, 0x12, 0x34, rawValue, 0x1234, unitsBinary, 0},
+    {0x0A, 1, 0, textValue, 0, unitsNone, "COLD"},
+    {0x0A, 1, 1, textValue, 0, unitsNone, "WARM"},
+    {0x0B, 100, 228, numberValue, 2, unitsNone, 0},
+    {0x11, 'A', 'B', textValue, 0, unitsASCII, "AB"},
+    {0x12, 25, 40, numberValue, 40, unitsMbar, 0},
+    {0x14, 128, 192, numberValue, 191, unitsPercent, 0},
+    {0x15, 10, 150, numberValue, 1.5, unitsVolts, 0},
+    {0x1A, 40, 130, numberValue, 90, unitsDegC, 0},
+    {0x1D, 5, 3, textValue, 0, unitsNone, "1st map"},
+    {0x1D, 3, 5, textValue, 0, unitsNone, "2nd map"},
+    {0x20, 0, 200, numberValue, -56, unitsNone, 0},
+    {0x20, 0, 128, numberValue, 128, unitsNone, 0},
+    {0x3A, 0, 200, numberValue, 57.26, unitsPerSec, 0},
+    {0x3A, 0, 100, numberValue, 102.25, unitsPerSec, 0},
+    {0x3E, 10, 100, numberValue, 256, unitsSecs, 0},
+    {0x21, 0, 5, numberValue, 500, unitsPercent, 0},
+    {0x21, 200, 100, numberValue, 50, unitsPercent, 0},
+    {0x22, 100, 138, numberValue, 10, unitsKW, 0},
+    {0x24, 1, 2, numberValue, 2580, unitsKm, 0},
+    {0x2C, 13, 5, textValue, 0, unitsNone, "13:05"},
+    {0x32, 10, 138, numberValue, 100, unitsMbar, 0},
+    {0x34, 100, 100, numberValue, 100, unitsNm, 0},
+    {0x36, 1, 2, numberValue, 258, unitsCount, 0},
+    {0x39, 0, 1, numberValue, 65537, unitsWSC, 0},
+    {0x5E, 100, 100, numberValue, 100, unitsNm, 0},
+    {0x99, 0xAB, 0xCD, rawValue, 0xABCD, unitsRaw, 0},
+    {0xFF, 0, 1, rawValue, 1, unitsRaw, 0}
+};
+
+// Checks the golden vectors then times decoding a mix of every formula ID,
+// a line for each failure and the throughput go in report
+bool blockDecoder::selfTest(QStringList &report)
+{
+    int failures = 0;
+    int numVectors = sizeof(goldenVectors) / sizeof(goldenVector);
+    for (int i = 0; i < numVectors; i++) {
+        const goldenVector &v = goldenVectors[i];
+        typedValue out;
+        decode(v.id, v.a, v.b, out);
+
+        bool ok = out.kind == v.kind && out.units == v.units;
+        if (ok && v.kind == textValue) {
+            ok = out.text == QString::fromAscii(v.text);
+        }
+        else if (ok) {
+            ok = qAbs(out.val - v.val) <= 1e-9 * qMax(1.0, qAbs(v.val));
+        }
+
+        if (!ok) {
+            failures++;
+            report << "Formula " + QString::number(v.id, 16) + " with " + QString::number(v.a) + ", " +
+                      QString::number(v.b) + " gave " + (out.kind == textValue ? out.text : QString::number(out.val)) +
+                      " " + QString::fromUtf8(unitsText(out.units));
+        }
+    }
+
+    int known = 0;
+    for (int id = 0; id < 256; id++) {
+        known += isKnown(id) ? 1 : 0;
+    }
+    report << QString::number(numVectors - failures) + " of " + QString::number(numVectors) +
+              " golden vectors passed, " + QString::number(known) + " of 256 formulas defined";
+
+    // a block's worth of triplets for every formula ID, decoded over and over
+    QByteArray data;
+    for (int i = 0; i < 1024; i++) {
+        data.append(static_cast<char>(i & 0xFF));
+        data.append(static_cast<char>((i * 7 + 3) & 0xFF));
+        data.append(static_cast<char>((i * 13 + 1) & 0xFF));
+    }
+    QVector<typedValue> values(1024);
+
+    static const int passes = 1000;
+    double sum = 0; // so the work can't be thrown away
+    QElapsedTimer timer;
+    timer.start();
+    for (int pass = 0; pass < passes; pass++) {
+        decodeTriplets(data.constData(), values.size(), values.data());
+        sum += values.at(pass & 1023).val;
+    }
+    qint64 msecs = qMax(timer.elapsed(), Q_INT64_C(1));
+
+    report << "Decoded " + QString::number(passes * values.size()) + " values in " + QString::number(msecs) +
+              "ms, " + QString::number(passes * values.size() / (msecs / 1000.0), 'f', 0) + " values/s (" +
+              QString::number(sum, 'g', 3) + ")";
+
+    return failures == 0;
+}
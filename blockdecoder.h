@@ -0,0 +1,108 @@
+/*
+Copyright 2013 Jared Wiltshire
+
+This file is part of VAG Blocks.
+
+VAG Blocks is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+VAG Blocks is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with VAG Blocks.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef BLOCKDECODER_H
+#define BLOCKDECODER_H
+
+#include <QtGlobal>
+#include <QStringList>
+#include "samplestore.h"
+
+// Units the formulas can give, their IDs are the first ones in sampleStore
+enum blockUnits {
+    unitsNone,
+    unitsRaw,
+    unitsBinary,
+    unitsASCII,
+    unitsRpm,
+    unitsBTDC,
+    unitsATDC,
+    unitsKmh,
+    unitsMbar,
+    unitsPercent,
+    unitsVolts,
+    unitsMs,
+    unitsDegC,
+    unitsKW,
+    unitsLph,
+    unitsMgStk,
+    unitsMgStkDelta,
+    unitsCount,
+    unitsSecs,
+    unitsDegCF,
+    unitsNm,
+    unitsDeg,
+    unitsOhm,
+    unitsMm,
+    unitsBar,
+    unitsLitres,
+    unitsAmps,
+    unitsGramsPerSec,
+    unitsDegKw,
+    unitsKm,
+    unitsAh,
+    unitsWSC,
+    unitsDegPerSec,
+    unitsAccel,
+    unitsPerSec,
+    numBlockUnits
+};
+
+// how the two data bytes a and b of a measuring value become its value
+enum formulaKind {
+    formulaRaw, // (a << 8 | b), the formula isn't known
+    formulaBinary, // (a << 8 | b), bit flags
+    formulaText, // a and b are ASCII characters
+    formulaProduct, // a * (b + param) * scale + offset
+    formulaLinear, // a * scale + b * param + offset
+    formulaRatio, // (b + param) * scale / a, not divided if a is 0
+    formulaTiming, // |b - param| * a * scale, altUnits when b > param
+    formulaSigned, // b * scale, b over 128 is negative
+    formulaMagnitude, // |b| * scale, b as in formulaSigned
+    formulaSwitch, // text when b is 0, altText otherwise
+    formulaCompare, // text when b < a, altText otherwise
+    formulaClock // a:b as hours and minutes
+};
+
+typedef struct {
+    quint8 kind;
+    quint8 units;
+    quint8 altUnits;
+    double scale;
+    double param;
+    double offset;
+    const char *text; // for the lookups
+    const char *altText;
+} formulaDef;
+
+// Decodes measuring values (formula ID and two data bytes, as in a 0x61 response)
+// from a table indexed by formula ID. Nothing is allocated except for text values.
+class blockDecoder
+{
+public:
+    static void decode(quint8 id, quint8 a, quint8 b, typedValue &out);
+    static int decodeTriplets(const char *data, int count, typedValue *out);
+    static const formulaDef& formula(quint8 id);
+    static bool isKnown(quint8 id);
+    static const char* unitsText(int units);
+    static bool selfTest(QStringList &report);
+};
+
+#endif // BLOCKDECODER_H
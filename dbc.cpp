@@ -0,0 +1,211 @@
+/*
+Copyright 2013 Jared Wiltshire
+
+This file is part of VAG Blocks.
+
+VAG Blocks is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+VAG Blocks is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with VAG Blocks.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "dbc.h"
+
+#include <QFile>
+#include <QTextStream>
+#include <QRegExp>
+
+dbc::dbc()
+{
+}
+
+void dbc::clear()
+{
+    fileName.clear();
+    error.clear();
+    sigs.clear();
+    idToSignals.clear();
+}
+
+// Only messages (BO_) and signals (SG_) are used, multiplexed signals are skipped.
+// If selected is not empty only the named signals are kept.
+bool dbc::load(const QString &fileName, const QStringList &selected)
+{
+    clear();
+
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        error = "Could not open " + fileName;
+        return false;
+    }
+
+    QRegExp message("^BO_\\s+(\\d+)\\s+(\\w+)\\s*:");
+    QRegExp sig("^SG_\\s+(\\w+)\\s*(\\w*)\\s*:\\s*(\\d+)\\|(\\d+)@([01])([+-])\\s*"
+                "\\(([^,]+),([^)]+)\\)\\s*\\[[^\\]]*\\]\\s*\"([^\"]*)\"");
+
+    int canID = -1;
+    QString messageName;
+    int skipped = 0;
+
+    QTextStream in(&file);
+    while (!in.atEnd()) {
+        QString line = in.readLine().trimmed();
+
+        if (message.indexIn(line) == 0) {
+            canID = message.cap(1).toUInt() & 0x1FFFFFFF;
+            messageName = message.cap(2);
+            continue;
+        }
+
+        if (sig.indexIn(line) != 0 || canID < 0) {
+            continue;
+        }
+
+        if (!sig.cap(2).isEmpty() && sig.cap(2) != "M") { // multiplexed value
+            skipped++;
+            continue;
+        }
+
+        if (!selected.isEmpty() && !selected.contains(sig.cap(1))) {
+            continue;
+        }
+
+        dbcSignal tmp;
+        tmp.name = sig.cap(1);
+        tmp.message = messageName;
+        tmp.units = sig.cap(9);
+        tmp.canID = canID;
+        tmp.factor = sig.cap(7).toDouble();
+        tmp.offset = sig.cap(8).toDouble();
+
+        if (!compile(tmp, sig.cap(3).toInt(), sig.cap(4).toInt(), sig.cap(5) == "0", sig.cap(6) == "-")) {
+            skipped++;
+            continue;
+        }
+
+        idToSignals[canID].append(sigs.size());
+        sigs.append(tmp);
+    }
+
+    if (sigs.empty()) {
+        error = "No usable signals found in " + fileName;
+        return false;
+    }
+
+    if (skipped > 0) {
+        error = QString::number(skipped) + " signals could not be used";
+    }
+
+    this->fileName = fileName;
+    return true;
+}
+
+// Work out a single shift and mask for the signal so decoding a frame is one load,
+// shift and mask per signal. Intel signals are taken from the frame read as a little
+// endian word, Motorola signals from the frame read as a big endian word where the
+// DBC start bit is the most significant bit of the signal.
+bool dbc::compile(dbcSignal &sig, int startBit, int length, bool bigEndian, bool isSigned)
+{
+    if (length < 1 || length > 64 || startBit < 0 || startBit > 63) {
+        return false;
+    }
+
+    int lsb;
+    if (bigEndian) {
+        int msb = (7 - startBit / 8) * 8 + startBit % 8;
+        lsb = msb - (length - 1);
+    }
+    else {
+        lsb = startBit;
+        if (lsb + length > 64) {
+            return false;
+        }
+    }
+
+    if (lsb < 0) {
+        return false;
+    }
+
+    sig.bigEndian = bigEndian;
+    sig.shift = lsb;
+    sig.mask = (length == 64) ? ~Q_UINT64_C(0) : ((Q_UINT64_C(1) << length) - 1);
+    sig.signBit = isSigned ? (Q_UINT64_C(1) << (length - 1)) : 0;
+    return true;
+}
+
+QString dbc::getError() const
+{
+    return error;
+}
+
+QString dbc::getFileName() const
+{
+    return fileName;
+}
+
+int dbc::getNumSignals() const
+{
+    return sigs.size();
+}
+
+const dbcSignal& dbc::getSignal(int i) const
+{
+    return sigs.at(i);
+}
+
+QList<int> dbc::getCanIDs() const
+{
+    return idToSignals.keys();
+}
+
+const QVector<int>& dbc::getSignalsForID(int canID) const
+{
+    QHash<int, QVector<int> >::const_iterator it = idToSignals.constFind(canID);
+    if (it == idToSignals.constEnd()) {
+        return noSignals;
+    }
+    return it.value();
+}
+
+// values must hold getNumSignals() entries, only the signals in this frame are updated
+bool dbc::decode(int canID, const QByteArray &data, QVector<double> &values) const
+{
+    const QVector<int> &frameSignals = getSignalsForID(canID);
+    if (frameSignals.empty()) {
+        return false;
+    }
+
+    quint64 le = 0;
+    quint64 be = 0;
+    int len = qMin(data.length(), 8);
+    for (int i = 0; i < len; i++) {
+        quint64 byte = static_cast<quint8>(data.at(i));
+        le |= byte << (8 * i);
+        be |= byte << (8 * (7 - i));
+    }
+
+    for (int i = 0; i < frameSignals.size(); i++) {
+        const dbcSignal &sig = sigs.at(frameSignals.at(i));
+
+        quint64 raw = ((sig.bigEndian ? be : le) >> sig.shift) & sig.mask;
+        double val;
+        if (raw & sig.signBit) {
+            val = static_cast<qint64>(raw | ~sig.mask);
+        }
+        else {
+            val = raw;
+        }
+
+        values[frameSignals.at(i)] = val * sig.factor + sig.offset;
+    }
+
+    return true;
+}
@@ -0,0 +1,66 @@
+/*
+Copyright 2013 Jared Wiltshire
+
+This file is part of VAG Blocks.
+
+VAG Blocks is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+VAG Blocks is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with VAG Blocks.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DBC_H
+#define DBC_H
+
+#include <QString>
+#include <QStringList>
+#include <QVector>
+#include <QHash>
+
+typedef struct {
+    QString name;
+    QString message;
+    QString units;
+    int canID;
+    double factor;
+    double offset;
+
+    // extractor, compiled from start bit, length and byte order when the file is loaded
+    bool bigEndian; // take the bits from the frame read as a big endian word
+    int shift;
+    quint64 mask;
+    quint64 signBit; // 0 for unsigned signals
+} dbcSignal;
+
+class dbc
+{
+public:
+    dbc();
+    bool load(const QString &fileName, const QStringList &selected = QStringList());
+    void clear();
+    QString getError() const;
+    QString getFileName() const;
+    int getNumSignals() const;
+    const dbcSignal& getSignal(int i) const;
+    QList<int> getCanIDs() const;
+    const QVector<int>& getSignalsForID(int canID) const;
+    bool decode(int canID, const QByteArray &data, QVector<double> &values) const;
+private:
+    QString fileName;
+    QString error;
+    QVector<dbcSignal> sigs;
+    QHash<int, QVector<int> > idToSignals;
+    QVector<int> noSignals;
+
+    bool compile(dbcSignal &sig, int startBit, int length, bool bigEndian, bool isSigned);
+};
+
+#endif // DBC_H
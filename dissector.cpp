@@ -0,0 +1,409 @@
+/*
+Copyright 2013 Jared Wiltshire
+
+This file is part of VAG Blocks.
+
+VAG Blocks is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+VAG Blocks is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with VAG Blocks.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "dissector.h"
+#include "tp20.h"
+#include "kwp2000.h"
+#include "blockdecoder.h"
+
+#include <QFile>
+#include <QTextStream>
+#include <QRegExp>
+#include <QtConcurrentMap>
+
+typedef struct {
+    bool inMessage;
+    quint16 length;
+    QByteArray msg;
+    int expectedSeq; // -1 until the first data packet is seen
+} reassemblyState;
+
+static bool eventLessThan(const dissectedEvent &a, const dissectedEvent &b)
+{
+    return a.index < b.index;
+}
+
+dissector::dissector(QObject *parent) :
+    QObject(parent),
+    numFrames(0),
+    numUnassigned(0)
+{
+    connect(&watcher, SIGNAL(finished()), this, SLOT(channelsDissected()));
+}
+
+bool dissector::isRunning() const
+{
+    return watcher.isRunning();
+}
+
+void dissector::dissect(const QString &captureFile, const QString &reportFile)
+{
+    if (watcher.isRunning()) {
+        emit log("Dissector: Already busy with a capture");
+        return;
+    }
+
+    reportFileName = reportFile;
+
+    if (!splitChannels(captureFile)) {
+        emit log("Dissector: Could not read capture file " + captureFile);
+        return;
+    }
+
+    emit log("Dissector: " + QString::number(numFrames) + " frames, " +
+             QString::number(channels.length()) + " TP2.0 channels found");
+
+    // each channel is reassembled independently on the global thread pool
+    watcher.setFuture(QtConcurrent::mapped(channels, dissector::dissectChannel));
+}
+
+// Single pass over the capture, assigning frames to the channel whose IDs were handed
+// out in the most recent channel setup (C0/D0) exchange. The IDs are reused by the
+// ECU so a new D0 response always starts a new channel.
+bool dissector::splitChannels(const QString &captureFile)
+{
+    QFile file(captureFile);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        return false;
+    }
+
+    channels.clear();
+    numFrames = 0;
+    numUnassigned = 0;
+
+    QMap<int, capturedFrame> setupRequests; // keyed by destination module
+    QMap<int, int> idToChannel;
+
+    QTextStream in(&file);
+    while (!in.atEnd()) {
+        QString line = in.readLine();
+        capturedFrame frame;
+        if (!parseFrameLine(line, frame)) {
+            continue;
+        }
+        frame.index = numFrames++;
+
+        quint8 op = frame.data.length() > 1 ? static_cast<quint8>(frame.data.at(1)) : 0;
+
+        if (frame.canID == 0x200 && op == 0xC0) {
+            setupRequests.insert(static_cast<quint8>(frame.data.at(0)), frame);
+            continue;
+        }
+
+        if (frame.canID > 0x200 && frame.canID <= 0x2FF && frame.data.length() >= 7 && op == 0xD0) {
+            capturedChannel channel;
+            channel.number = channels.length() + 1;
+            channel.dest = frame.canID - 0x200;
+            channel.testerID = ((static_cast<quint8>(frame.data.at(5)) & 0x0F) << 8) + static_cast<quint8>(frame.data.at(4));
+            channel.moduleID = ((static_cast<quint8>(frame.data.at(3)) & 0x0F) << 8) + static_cast<quint8>(frame.data.at(2));
+
+            if (setupRequests.contains(channel.dest)) {
+                channel.frames.append(setupRequests.take(channel.dest));
+            }
+            channel.frames.append(frame);
+
+            idToChannel.insert(channel.testerID, channels.length());
+            idToChannel.insert(channel.moduleID, channels.length());
+            channels.append(channel);
+            continue;
+        }
+
+        if (idToChannel.contains(frame.canID)) {
+            channels[idToChannel.value(frame.canID)].frames.append(frame);
+        }
+        else {
+            numUnassigned++;
+        }
+    }
+
+    return true;
+}
+
+dissectedChannel dissector::dissectChannel(const capturedChannel &channel)
+{
+    dissectedChannel result;
+    result.channel = channel.number;
+    result.messages = 0;
+    result.acks = 0;
+    result.seqErrors = 0;
+
+    reassemblyState state[2]; // 0 is tester to module, 1 is module to tester
+    for (int i = 0; i < 2; i++) {
+        state[i].inMessage = false;
+        state[i].length = 0;
+        state[i].expectedSeq = -1;
+    }
+    const QString dirName[2] = {"Tester -> module", "Module -> tester"};
+
+    for (int i = 0; i < channel.frames.length(); i++) {
+        const capturedFrame &frame = channel.frames.at(i);
+        const QByteArray &data = frame.data;
+
+        dissectedEvent ev;
+        ev.index = frame.index;
+        ev.time = frame.time;
+        ev.channel = channel.number;
+
+        if (frame.canID == 0x200) {
+            ev.text = "Channel setup request to module 0x" + toHex(static_cast<quint8>(data.at(0)));
+            result.events.append(ev);
+            continue;
+        }
+        if (frame.canID == 0x200 + channel.dest) {
+            ev.text = "Channel setup response, tester ID 0x" + toHex(channel.testerID, 3) +
+                    ", module ID 0x" + toHex(channel.moduleID, 3);
+            result.events.append(ev);
+            continue;
+        }
+
+        int dir = (frame.canID == channel.testerID) ? 0 : 1;
+        reassemblyState &rx = state[dir];
+        quint8 op = static_cast<quint8>(data.at(0));
+        quint8 seq = op & 0x0F;
+
+        switch (op) {
+        case 0xA0:
+        case 0xA1:
+            if (data.length() < 6) {
+                ev.text = dirName[dir] + ": Short parameters packet " + bytesToStr(data);
+            }
+            else {
+                ev.text = dirName[dir] + (op == 0xA0 ? ": Parameters request" : ": Parameters response") +
+                        ", block size " + QString::number(static_cast<quint8>(data.at(1))) +
+                        ", T1 " + doubleToStr(tp20::decodeTiming(data.at(2)), 1) + " ms" +
+                        ", T3 " + doubleToStr(tp20::decodeTiming(data.at(4)), 1) + " ms";
+            }
+            result.events.append(ev);
+            continue;
+        case 0xA3:
+            ev.text = dirName[dir] + ": Channel test";
+            result.events.append(ev);
+            continue;
+        case 0xA4:
+        case 0xA8:
+            ev.text = dirName[dir] + (op == 0xA4 ? ": Break" : ": Disconnect");
+            result.events.append(ev);
+            for (int j = 0; j < 2; j++) {
+                state[j].inMessage = false;
+                state[j].expectedSeq = -1;
+            }
+            continue;
+        default:
+            break;
+        }
+
+        quint8 opcode = (op >> 4) & 0x0F;
+
+        if (opcode == 0xB || opcode == 0x9) {
+            result.acks++;
+            int expected = state[1-dir].expectedSeq;
+            if (expected >= 0 && seq != expected) {
+                ev.text = dirName[dir] + ": ACK " + QString::number(seq) +
+                        " does not match next sequence " + QString::number(expected);
+                result.events.append(ev);
+            }
+            else if (opcode == 0x9) {
+                ev.text = dirName[dir] + ": ACK, not ready for next packet";
+                result.events.append(ev);
+            }
+            continue;
+        }
+
+        if (opcode > 0x3) {
+            ev.text = dirName[dir] + ": Unknown TP2.0 op-code " + bytesToStr(data);
+            result.events.append(ev);
+            continue;
+        }
+
+        if (rx.expectedSeq >= 0 && seq != rx.expectedSeq) {
+            result.seqErrors++;
+            ev.text = dirName[dir] + ": Sequence error, expected " + QString::number(rx.expectedSeq) +
+                    " got " + QString::number(seq);
+            if (rx.inMessage) {
+                ev.text += ", partial message dropped";
+                rx.inMessage = false;
+            }
+            result.events.append(ev);
+        }
+        rx.expectedSeq = (seq + 1) & 0x0F;
+
+        if (!rx.inMessage) {
+            if (data.length() < 3) {
+                ev.text = dirName[dir] + ": First packet too short " + bytesToStr(data);
+                result.events.append(ev);
+                continue;
+            }
+            rx.length = (static_cast<quint8>(data.at(1)) << 8 | static_cast<quint8>(data.at(2))) & 0x7FFF;
+            rx.msg = data.mid(3);
+            rx.inMessage = true;
+        }
+        else {
+            rx.msg.append(data.mid(1));
+        }
+
+        if (opcode & 0x01) { // last packet
+            result.messages++;
+            ev.text = dirName[dir] + ": " + decodeKWP(rx.msg);
+            if (rx.msg.length() != rx.length) {
+                ev.text += " (length " + QString::number(rx.msg.length()) +
+                        ", expected " + QString::number(rx.length) + ")";
+            }
+            result.events.append(ev);
+            rx.inMessage = false;
+            rx.msg.clear();
+        }
+    }
+
+    return result;
+}
+
+void dissector::channelsDissected()
+{
+    writeReport();
+    channels.clear();
+}
+
+void dissector::writeReport()
+{
+    QList<dissectedChannel> results = watcher.future().results();
+
+    QFile file(reportFileName);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Text)) {
+        emit log("Dissector: Could not write report file " + reportFileName);
+        return;
+    }
+    QTextStream out(&file);
+    out.setCodec("UTF-8");
+
+    out << "Frames: " << numFrames << ", not part of a TP2.0 channel: " << numUnassigned << endl;
+
+    QList<dissectedEvent> events;
+    for (int i = 0; i < results.length(); i++) {
+        const dissectedChannel &res = results.at(i);
+        const capturedChannel &ch = channels.at(i);
+        out << "Channel " << ch.number << ": module 0x" << toHex(ch.dest)
+            << ", tester ID 0x" << toHex(ch.testerID, 3)
+            << ", module ID 0x" << toHex(ch.moduleID, 3)
+            << ", " << ch.frames.length() << " frames, "
+            << res.messages << " messages, "
+            << res.acks << " ACKs, "
+            << res.seqErrors << " sequence errors" << endl;
+        events.append(res.events);
+    }
+    out << endl;
+
+    qSort(events.begin(), events.end(), eventLessThan);
+
+    for (int i = 0; i < events.length(); i++) {
+        const dissectedEvent &ev = events.at(i);
+        out << ev.index << "\t";
+        if (ev.time >= 0) {
+            out << QString::number(ev.time, 'f', 6);
+        }
+        out << "\t" << ev.channel << "\t" << ev.text << endl;
+    }
+
+    file.close();
+
+    emit log("Dissector: Wrote " + QString::number(events.length()) + " events to " + reportFileName);
+    emit finished(reportFileName);
+}
+
+QString dissector::decodeKWP(const QByteArray &msg)
+{
+    if (msg.isEmpty()) {
+        return "Empty KWP message";
+    }
+
+    quint8 sid = static_cast<quint8>(msg.at(0));
+    QString name;
+
+    switch (sid & ~0x40) {
+    case 0x10: name = "startDiagnosticSession"; break;
+    case 0x11: name = "ecuReset"; break;
+    case 0x14: name = "clearDiagnosticInformation"; break;
+    case 0x18: name = "readDiagnosticTroubleCodesByStatus"; break;
+    case 0x1A: name = "readEcuIdentification"; break;
+    case 0x21: name = "readDataByLocalIdentifier"; break;
+    case 0x22: name = "readDataByCommonIdentifier"; break;
+    case 0x23: name = "readMemoryByAddress"; break;
+    case 0x27: name = "securityAccess"; break;
+    case 0x2C: name = "dynamicallyDefineLocalIdentifier"; break;
+    case 0x31: name = "startRoutineByLocalIdentifier"; break;
+    case 0x35: name = "requestUpload"; break;
+    case 0x36: name = "transferData"; break;
+    case 0x37: name = "requestTransferExit"; break;
+    case 0x3E: name = "testerPresent"; break;
+    case 0x83: name = "accessTimingParameters"; break;
+    default: break;
+    }
+
+    if (sid == 0x7F) {
+        QString ret = "Negative response";
+        if (msg.length() > 1) {
+            ret += " to " + toHex(static_cast<quint8>(msg.at(1)));
+        }
+        if (msg.length() > 2) {
+            ret += ", reason code " + toHex(static_cast<quint8>(msg.at(2)));
+        }
+        return ret;
+    }
+
+    if (name.isEmpty()) {
+        return "KWP " + bytesToStr(msg);
+    }
+
+    if (!(sid & 0x40)) {
+        return name + " request " + bytesToStr(msg);
+    }
+
+    if (sid == 0x61 && msg.length() >= 14) {
+        QStringList values;
+        typedValue decoded[4];
+        blockDecoder::decodeTriplets(msg.constData() + 2, 4, decoded);
+        for (int i = 0; i < 4; i++) {
+            const typedValue &val = decoded[i];
+            QString units = QString::fromUtf8(blockDecoder::unitsText(val.units));
+
+            if (val.kind == numberValue) {
+                values << doubleToStr(val.val) + " " + units;
+            }
+            else if (val.kind == rawValue) {
+                values << "0x" + toHex(static_cast<uint>(val.val), 4) + " " + units;
+            }
+            else {
+                values << val.text + " " + units;
+            }
+        }
+        return name + " response, block " + QString::number(static_cast<quint8>(msg.at(1))) +
+                ": " + values.join(", ");
+    }
+
+    return name + " response " + bytesToStr(msg);
+}
+
+QString dissector::bytesToStr(const QByteArray &data, int from)
+{
+    QString ret;
+    for (int i = from; i < data.length(); i++) {
+        ret += toHex(static_cast<quint8>(data.at(i)), 2) + " ";
+    }
+    ret.chop(1);
+    return ret;
+}
@@ -0,0 +1,79 @@
+/*
+Copyright 2013 Jared Wiltshire
+
+This file is part of VAG Blocks.
+
+VAG Blocks is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+VAG Blocks is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with VAG Blocks.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DISSECTOR_H
+#define DISSECTOR_H
+
+#include <QObject>
+#include <QFutureWatcher>
+#include <QStringList>
+
+#include "util.h"
+
+typedef struct {
+    int number;
+    int dest;
+    int testerID;
+    int moduleID;
+    QList<capturedFrame> frames;
+} capturedChannel;
+
+typedef struct {
+    int index;
+    double time;
+    int channel;
+    QString text;
+} dissectedEvent;
+
+typedef struct {
+    int channel;
+    int messages;
+    int acks;
+    int seqErrors;
+    QList<dissectedEvent> events;
+} dissectedChannel;
+
+class dissector : public QObject
+{
+    Q_OBJECT
+public:
+    explicit dissector(QObject *parent = 0);
+    bool isRunning() const;
+    static dissectedChannel dissectChannel(const capturedChannel &channel);
+signals:
+    void log(const QString &txt, int logLevel = stdLog);
+    void finished(const QString &reportFile);
+public slots:
+    void dissect(const QString &captureFile, const QString &reportFile);
+private slots:
+    void channelsDissected();
+private:
+    QFutureWatcher<dissectedChannel> watcher;
+    QList<capturedChannel> channels;
+    QString reportFileName;
+    int numFrames;
+    int numUnassigned;
+
+    bool splitChannels(const QString &captureFile);
+    void writeReport();
+    static QString decodeKWP(const QByteArray &msg);
+    static QString bytesToStr(const QByteArray &data, int from = 0);
+};
+
+#endif // DISSECTOR_H
@@ -0,0 +1,485 @@
+/*
+Copyright 2013 Jared Wiltshire
+
+This file is part of VAG Blocks.
+
+VAG Blocks is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+VAG Blocks is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with VAG Blocks.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "ecusim.h"
+#include "util.h"
+
+#include <QTimer>
+
+ecusim::ecusim(QObject *parent) :
+    elm327(parent),
+    header(0), filter(-1), recvTimeout(200), latency(1), randState(1),
+    dropPercent(0), duplicatePercent(0), reorderPercent(0), delayPercent(0), maxDelay(0),
+    pendingPercent(0), channelTestPercent(0), lastDue(0)
+{
+    resetStats();
+    clock.start();
+}
+
+// modules are on TP2.0 destination dest, listening on 0x740 + dest once a channel is set up
+void ecusim::addModule(int dest)
+{
+    simChannel chan;
+    chan.dest = dest;
+    chan.open = false;
+    chan.testerID = 0;
+    chan.moduleID = 0x740 + dest;
+    chan.bs = 0x0F;
+    chan.rxSeq = 0;
+    chan.txSeq = 0;
+    chan.requestLength = -1;
+    chan.responseIndex = 0;
+    modules[dest] = chan;
+}
+
+void ecusim::setLatency(int msecs)
+{
+    latency = msecs;
+}
+
+void ecusim::setSeed(uint seed)
+{
+    randState = seed;
+}
+
+// percentages apply to each data frame the modules send, delays to each response
+void ecusim::setFaults(int dropPercent, int duplicatePercent, int reorderPercent, int delayPercent, int maxDelay)
+{
+    this->dropPercent = dropPercent;
+    this->duplicatePercent = duplicatePercent;
+    this->reorderPercent = reorderPercent;
+    this->delayPercent = delayPercent;
+    this->maxDelay = maxDelay;
+}
+
+// pendingPercent of requests get a 7F xx 78 first, channelTestPercent of responses
+// carry a channel test from the module
+void ecusim::setInjections(int pendingPercent, int channelTestPercent)
+{
+    this->pendingPercent = pendingPercent;
+    this->channelTestPercent = channelTestPercent;
+}
+
+const simStats& ecusim::getStats() const
+{
+    return stats;
+}
+
+void ecusim::resetStats()
+{
+    stats.requests = 0;
+    stats.seqErrors = 0;
+    stats.retransmits = 0;
+    stats.drops = 0;
+    stats.duplicates = 0;
+    stats.reorders = 0;
+    stats.delays = 0;
+    stats.timeouts = 0;
+    stats.channelTests = 0;
+    stats.pending = 0;
+}
+
+// there's no port, just say it opened
+void ecusim::start()
+{
+    emit portOpened(true);
+}
+
+void ecusim::write(const QString &txt)
+{
+#ifndef STATIC_BUILD
+    emit log("TX: " + txt, rxTxLog, false);
+#endif
+
+    QString cmd = txt.toUpper();
+    cmd.remove(' ');
+
+    if (cmd.startsWith("AT") || cmd.startsWith("ST")) {
+        respond(atCommand(cmd), latency);
+        return;
+    }
+
+    QByteArray data;
+    bool ok = !cmd.isEmpty() && cmd.length() % 2 == 0 && cmd.length() <= 16;
+    for (int i = 0; ok && i < cmd.length() / 2; i++) {
+        data.append(static_cast<char>(cmd.mid(i*2, 2).toUShort(&ok, 16)));
+    }
+    if (!ok) {
+        respond(QStringList() << "?", latency);
+        return;
+    }
+
+    QList<simFrame> frames;
+    if (header == 0x200) {
+        frames = setupFrame(data);
+    }
+    else {
+        QMap<int, simChannel>::iterator it;
+        for (it = modules.begin(); it != modules.end(); ++it) {
+            if (it.value().open && it.value().moduleID == header) {
+                frames = channelFrame(it.value(), data);
+                break;
+            }
+        }
+    }
+
+    int delay = latency;
+    if (!frames.empty() && chance(delayPercent)) {
+        stats.delays++;
+        delay += 1 + random(maxDelay);
+    }
+
+    QStringList lines;
+    if (delay - latency > recvTimeout) { // the adapter has given up by the time it arrives
+        stats.timeouts++;
+        delay = latency + recvTimeout;
+    }
+    else {
+        for (int i = 0; i < frames.length(); i++) {
+            const simFrame &frame = frames.at(i);
+            if (filter >= 0 && frame.id != filter) {
+                continue;
+            }
+            QString line = toHex(frame.id, 3) + " " + QString::number(frame.data.length());
+            for (int j = 0; j < frame.data.length(); j++) {
+                line += " " + toHex(static_cast<quint8>(frame.data.at(j)), 2);
+            }
+            lines << line;
+        }
+    }
+
+    if (lines.empty()) {
+        lines << "NO DATA";
+    }
+    respond(lines, delay);
+}
+
+QStringList ecusim::atCommand(const QString &cmd)
+{
+    QStringList lines;
+
+    if (cmd == "ATI" || cmd == "ATZ") {
+        lines << "ELM327 v1.4b";
+    }
+    else if (cmd == "AT@1") {
+        lines << "VAG Blocks ECU simulator";
+    }
+    else if (cmd.startsWith("ST")) { // not an STN11xx
+        lines << "?";
+    }
+    else if (cmd.startsWith("ATSH")) {
+        header = fromHex(cmd.mid(4));
+        lines << "OK";
+    }
+    else if (cmd.startsWith("ATCRA")) {
+        filter = (cmd.length() > 5) ? fromHex(cmd.mid(5)) : -1;
+        lines << "OK";
+    }
+    else if (cmd.startsWith("ATST")) {
+        recvTimeout = fromHex(cmd.mid(4)) * 4;
+        lines << "OK";
+    }
+    else {
+        lines << "OK";
+    }
+
+    return lines;
+}
+
+// C0 channel setup on 0x200, answered with D0 on 0x200 + dest
+QList<simFrame> ecusim::setupFrame(const QByteArray &data)
+{
+    QList<simFrame> out;
+    int dest = static_cast<quint8>(data.at(0));
+
+    if (data.length() != 7 || static_cast<quint8>(data.at(1)) != 0xC0 || !modules.contains(dest)) {
+        return out;
+    }
+
+    simChannel &chan = modules[dest];
+    chan.open = true;
+    chan.testerID = static_cast<quint8>(data.at(4)) | (static_cast<quint8>(data.at(5)) & 0x07) << 8;
+    chan.rxSeq = 0;
+    chan.txSeq = 0;
+    chan.request.clear();
+    chan.requestLength = -1;
+    chan.responses.clear();
+    chan.responseIndex = 0;
+    chan.sent.clear();
+
+    simFrame frame;
+    frame.id = 0x200 + dest;
+    frame.data.append(static_cast<char>(0x00));
+    frame.data.append(static_cast<char>(0xD0));
+    frame.data.append(data.at(4));
+    frame.data.append(data.at(5));
+    frame.data.append(static_cast<char>(chan.moduleID & 0xFF));
+    frame.data.append(static_cast<char>(chan.moduleID >> 8));
+    frame.data.append(static_cast<char>(0x01));
+    out << frame;
+    return out;
+}
+
+QList<simFrame> ecusim::channelFrame(simChannel &chan, const QByteArray &data)
+{
+    QList<simFrame> out;
+    quint8 op = data.at(0);
+
+    if (op == 0xA0 || op == 0xA3) { // parameters or channel test, both get our parameters
+        if (op == 0xA0 && data.length() > 1) {
+            chan.bs = qBound(1, static_cast<quint8>(data.at(1)) & 0x0F, 0x0F);
+        }
+        simFrame frame;
+        frame.id = chan.testerID;
+        frame.data.append(static_cast<char>(0xA1));
+        frame.data.append(static_cast<char>(chan.bs));
+        frame.data.append(static_cast<char>(0x8A)); // T1 100ms
+        frame.data.append(static_cast<char>(0xFF));
+        frame.data.append(static_cast<char>(0x32)); // T3 5ms
+        frame.data.append(static_cast<char>(0xFF));
+        out << frame;
+    }
+    else if (op == 0xA8) { // disconnect, nothing comes back
+        chan.open = false;
+    }
+    else if ((op & 0xF0) == 0xB0) { // ACK for what we sent
+        quint8 ackSeq = op & 0x0F;
+        if (ackSeq != (chan.txSeq & 0x0F)) { // the tester wants frames again from ackSeq
+            for (int i = 0; i < chan.sent.length(); i++) {
+                if (chan.sent.at(i).second == ackSeq) {
+                    stats.retransmits++;
+                    chan.responseIndex = chan.sent.at(i).first;
+                    chan.txSeq = ackSeq;
+                    chan.sent = chan.sent.mid(0, i);
+                    break;
+                }
+            }
+        }
+        sendBlock(chan, out);
+    }
+    else if ((op & 0xC0) == 0x00) {
+        receiveData(chan, op, data, out);
+    }
+
+    return out;
+}
+
+void ecusim::receiveData(simChannel &chan, quint8 op, const QByteArray &data, QList<simFrame> &out)
+{
+    quint8 seq = op & 0x0F;
+    if (seq != (chan.rxSeq & 0x0F)) {
+        stats.seqErrors++;
+    }
+    chan.rxSeq = seq + 1;
+
+    int skip = 1;
+    if (chan.requestLength < 0) { // first frame carries the length
+        if (data.length() < 3) {
+            return;
+        }
+        chan.requestLength = (static_cast<quint8>(data.at(1)) << 8) | static_cast<quint8>(data.at(2));
+        chan.request.clear();
+        chan.responses.clear(); // a new request, anything not sent yet is forgotten
+        chan.responseIndex = 0;
+        chan.sent.clear();
+        skip = 3;
+    }
+    chan.request.append(data.mid(skip));
+
+    if (!(op & 0x20)) { // ACK wanted
+        simFrame ack;
+        ack.id = chan.testerID;
+        ack.data.append(static_cast<char>(0xB0 | (chan.rxSeq & 0x0F)));
+        out << ack;
+    }
+
+    if (!(op & 0x10)) { // more to come
+        return;
+    }
+
+    stats.requests++;
+    QByteArray request = chan.request.left(chan.requestLength);
+    chan.request.clear();
+    chan.requestLength = -1;
+
+    if (chance(pendingPercent)) {
+        stats.pending++;
+        QByteArray pending;
+        pending.append(static_cast<char>(0x7F));
+        pending.append(request.left(1));
+        pending.append(static_cast<char>(0x78));
+        chan.responses << pending;
+    }
+    chan.responses << kwpResponse(request);
+
+    if (chance(channelTestPercent)) {
+        stats.channelTests++;
+        simFrame test;
+        test.id = chan.testerID;
+        test.data.append(static_cast<char>(0xA3));
+        out << test;
+    }
+
+    sendBlock(chan, out);
+}
+
+// Sends the first response from responseIndex until a frame that wants an ACK
+void ecusim::sendBlock(simChannel &chan, QList<simFrame> &out)
+{
+    QList<simFrame> block;
+
+    while (!chan.responses.empty()) {
+        QByteArray msg;
+        msg.append(static_cast<char>(chan.responses.first().length() >> 8));
+        msg.append(static_cast<char>(chan.responses.first().length() & 0xFF));
+        msg.append(chan.responses.first());
+
+        if (chan.responseIndex >= msg.length()) { // all sent and ACKed, on to the next
+            chan.responses.removeFirst();
+            chan.responseIndex = 0;
+            chan.sent.clear();
+            continue;
+        }
+
+        int count = 0;
+        while (chan.responseIndex < msg.length()) {
+            int n = qMin(7, msg.length() - chan.responseIndex);
+            bool last = chan.responseIndex + n >= msg.length();
+            bool blockEnd = !last && ++count >= chan.bs;
+
+            quint8 op = last ? 0x10 : (blockEnd ? 0x00 : 0x20);
+            chan.sent << qMakePair(chan.responseIndex, static_cast<quint8>(chan.txSeq & 0x0F));
+
+            simFrame frame;
+            frame.id = chan.testerID;
+            frame.data.append(static_cast<char>(op | (chan.txSeq++ & 0x0F)));
+            frame.data.append(msg.mid(chan.responseIndex, n));
+            block << frame;
+
+            chan.responseIndex += n;
+            if (last || blockEnd) {
+                break;
+            }
+        }
+        break;
+    }
+
+    injectFaults(block);
+    out << block;
+}
+
+QByteArray ecusim::kwpResponse(const QByteArray &request)
+{
+    QByteArray resp;
+    if (request.isEmpty()) {
+        return resp;
+    }
+
+    quint8 sid = request.at(0);
+    quint8 param = (request.length() > 1) ? static_cast<quint8>(request.at(1)) : 0;
+
+    if (sid == 0x21 && request.length() == 2) { // block, four rpm values
+        resp.append(static_cast<char>(0x61));
+        resp.append(static_cast<char>(param));
+        for (int i = 0; i < 4; i++) {
+            resp.append(static_cast<char>(0x01));
+            resp.append(static_cast<char>(0xFA));
+            resp.append(static_cast<char>(param + i));
+        }
+    }
+    else if (sid == 0x10) {
+        resp.append(static_cast<char>(0x50));
+        resp.append(static_cast<char>(param));
+    }
+    else if (sid == 0x1A && param == 0x9B) {
+        resp.append(static_cast<char>(0x5A));
+        resp.append(static_cast<char>(0x9B));
+        resp.append(QByteArray("1K0907115AA 0010SIMULATED MODULE  0001   "));
+    }
+    else {
+        resp.append(static_cast<char>(0x7F));
+        resp.append(static_cast<char>(sid));
+        resp.append(static_cast<char>(0x11)); // service not supported
+    }
+
+    return resp;
+}
+
+void ecusim::injectFaults(QList<simFrame> &frames)
+{
+    for (int i = 0; i < frames.length(); i++) {
+        if (chance(dropPercent)) {
+            stats.drops++;
+            frames.removeAt(i--);
+        }
+        else if (chance(duplicatePercent)) {
+            stats.duplicates++;
+            simFrame copy = frames.at(i);
+            frames.insert(i, copy);
+            i++;
+        }
+        else if (i + 1 < frames.length() && chance(reorderPercent)) {
+            stats.reorders++;
+            frames.swap(i, i + 1);
+            i++;
+        }
+    }
+}
+
+// Responses come out in the order they were asked for, a delayed one holds up the rest
+void ecusim::respond(QStringList lines, int delay)
+{
+    lines << ">";
+    outgoing << lines;
+
+    qint64 due = qMax(lastDue, clock.elapsed() + delay);
+    lastDue = due;
+    QTimer::singleShot(static_cast<int>(due - clock.elapsed()), this, SLOT(deliver()));
+}
+
+void ecusim::deliver()
+{
+    if (outgoing.empty()) {
+        return;
+    }
+
+    QStringList lines = outgoing.takeFirst();
+    for (int i = 0; i < lines.length(); i++) {
+#ifndef STATIC_BUILD
+        emit log("RX: " + lines.at(i), rxTxLog, false);
+#endif
+        bufferLine(lines.at(i));
+    }
+}
+
+bool ecusim::chance(int percent)
+{
+    return percent > 0 && random(100) < percent;
+}
+
+// same generator on every platform so a seed gives the same run
+int ecusim::random(int range)
+{
+    if (range <= 0) {
+        return 0;
+    }
+    randState = randState * 1103515245 + 12345;
+    return (randState >> 16) % range;
+}
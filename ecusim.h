@@ -0,0 +1,118 @@
+/*
+Copyright 2013 Jared Wiltshire
+
+This file is part of VAG Blocks.
+
+VAG Blocks is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+VAG Blocks is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with VAG Blocks.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef ECUSIM_H
+#define ECUSIM_H
+
+#include <QObject>
+#include <QStringList>
+#include <QMap>
+#include <QList>
+#include <QPair>
+#include <QElapsedTimer>
+
+#include "elm327.h"
+
+typedef struct {
+    int id;
+    QByteArray data;
+} simFrame;
+
+// one TP2.0 channel as the module sees it
+typedef struct {
+    int dest;
+    bool open;
+    int testerID; // the module sends on this
+    int moduleID; // and listens on this
+    quint8 bs; // frames it may send before waiting for an ACK
+    quint8 rxSeq; // next sequence expected from the tester
+    quint8 txSeq;
+    QByteArray request; // being received
+    int requestLength;
+    QList<QByteArray> responses; // waiting to go, the first is being sent with its length
+    int responseIndex;
+    QList<QPair<int, quint8> > sent; // offset and sequence of each frame of the first response
+} simChannel;
+
+typedef struct {
+    int requests; // KWP requests received
+    int seqErrors; // tester frames out of sequence
+    int retransmits; // frames sent again after an ACK asked for them
+    int drops;
+    int duplicates;
+    int reorders;
+    int delays;
+    int timeouts; // delays longer than AT ST, the adapter gives NO DATA
+    int channelTests;
+    int pending; // 7F xx 78 sent before the real response
+} simStats;
+
+// Stands in for an ELM327 with TP2.0 modules behind it, for testing tp20 without a
+// car. Commands are answered as the adapter would, one line at a time after
+// latency msecs. Faults are picked from a seeded generator so a run can be repeated.
+class ecusim : public elm327
+{
+    Q_OBJECT
+public:
+    explicit ecusim(QObject *parent = 0);
+    void write(const QString &txt);
+    void addModule(int dest);
+    void setLatency(int msecs);
+    void setSeed(uint seed);
+    void setFaults(int dropPercent, int duplicatePercent, int reorderPercent, int delayPercent, int maxDelay);
+    void setInjections(int pendingPercent, int channelTestPercent);
+    const simStats& getStats() const;
+    void resetStats();
+public slots:
+    void start();
+private slots:
+    void deliver();
+private:
+    QMap<int, simChannel> modules;
+    int header; // AT SH
+    int filter; // AT CRA
+    int recvTimeout; // AT ST in msecs
+    int latency;
+    uint randState;
+    int dropPercent;
+    int duplicatePercent;
+    int reorderPercent;
+    int delayPercent;
+    int maxDelay;
+    int pendingPercent;
+    int channelTestPercent;
+    simStats stats;
+    QList<QStringList> outgoing; // each is delivered by its own single shot timer, in order
+    QElapsedTimer clock;
+    qint64 lastDue;
+
+    QStringList atCommand(const QString &cmd);
+    QList<simFrame> setupFrame(const QByteArray &data);
+    QList<simFrame> channelFrame(simChannel &chan, const QByteArray &data);
+    void receiveData(simChannel &chan, quint8 op, const QByteArray &data, QList<simFrame> &out);
+    void sendBlock(simChannel &chan, QList<simFrame> &out);
+    QByteArray kwpResponse(const QByteArray &request);
+    void injectFaults(QList<simFrame> &frames);
+    void respond(QStringList lines, int delay);
+    bool chance(int percent);
+    int random(int range);
+};
+
+#endif // ECUSIM_H
@@ -131,102 +131,146 @@ void elm327::write(const QByteArray &data)
     write(txt);
 }
 
-// need to return a list of CAN messages rather than lumped together.
+// Reads lines until the prompt, the prompt is the last line unless the adapter timed out
+QStringList elm327::getResponseLines()
+{
+    QStringList lines;
+    QString line;
+
+    do {
+        line = getLine();
+        if (line.isEmpty()) {
+            break;
+        }
+        lines << line;
+    } while (line != ">");
+
+    return lines;
+}
+
 QList<canFrame*>* elm327::getResponseCAN(int &status)
+{
+    return parseResponseCAN(getResponseLines(), status);
+}
+
+bool elm327::getResponseStatus(int &status)
+{
+    return parseResponseStatus(getResponseLines(), status);
+}
+
+QString elm327::getResponseStr(int &status)
+{
+    return parseResponseStr(getResponseLines(), status);
+}
+
+// The parse functions take the complete response to one command, as returned by
+// getResponseLines() or collected by the caller as lines arrive.
+
+// need to return a list of CAN messages rather than lumped together.
+QList<canFrame*>* elm327::parseResponseCAN(const QStringList &lines, int &status)
 {
     status = 0;
-    QString response = getLine();
     QList<canFrame*>* result = new QList<canFrame*>;
-    int triesForPrompt = 20;
 
-    if (response.left(2) == "AT") {
-        status |= AT_RESPONSE;
-        response = getLine(); // echos must be on, get another line
+    bool prompt = !lines.empty() && lines.last() == ">";
+    int end = prompt ? lines.length() - 1 : lines.length();
+    int i = 0;
+
+    if (i < end && lines.at(i).left(2) == "AT") {
+        status |= AT_RESPONSE; // echos must be on, skip the line
+        i++;
     }
 
-    if (response.length() == 0) {
-        status |= TIMEOUT_ERROR;
+    if (i >= end) {
+        if (!prompt) {
+            status |= TIMEOUT_ERROR;
+        }
     }
-    else if (response == "OK") {
+    else if (lines.at(i) == "OK") {
         status |= OK_RESPONSE;
-        response = getLine();
+        i++;
     }
-    else if (response == "STOPPED") {
+    else if (lines.at(i) == "STOPPED") {
         status |= STOPPED_RESPONSE;
-        response = getLine();
+        i++;
     }
-    else if (response == "?") {
+    else if (lines.at(i) == "?") {
         status |= UNKNOWN_RESPONSE;
-        response = getLine();
+        i++;
     }
-    else if (response == "NO DATA") {
+    else if (lines.at(i) == "NO DATA") {
         status |= NO_DATA_RESPONSE;
-        response = getLine();
+        i++;
     }
-    else if (response == "CAN ERROR") {
+    else if (lines.at(i) == "CAN ERROR") {
         status |= CAN_ERROR;
-        response = getLine();
-    }
-
-    if (status != 0) {
-        triesForPrompt = 1;
+        i++;
     }
 
-    // receive data until prompt appears
-    for (int i = 0; response != ">"; i++) {
-        if (i >= triesForPrompt) {
-            status |= NO_PROMPT_ERROR;
-            break;
-        }
-
-        if (response == "STOPPED") {
+    for (; i < end; i++) {
+        if (lines.at(i) == "STOPPED") {
             status |= STOPPED_RESPONSE;
+            continue;
         }
-        else {
-            canFrame* newCF = hexToCF(response);
-            if (!newCF) {
-                status |= PROCESSING_ERROR;
-                response = getLine();
-                continue;
-            }
-            result->append(newCF);
+
+        canFrame* newCF = hexToCF(lines.at(i));
+        if (!newCF) {
+            status |= PROCESSING_ERROR;
+            continue;
         }
-        response = getLine();
+        result->append(newCF);
+    }
+
+    if (!prompt && !(status & TIMEOUT_ERROR)) {
+        status |= NO_PROMPT_ERROR;
     }
 
     return result;
 }
 
-bool elm327::getResponseStatus(int &status)
+bool elm327::parseResponseStatus(const QStringList &lines, int &status)
 {
     status = 0;
-    QString response = getLine();
     bool ret = false;
+    int i = 0;
 
-    if (response.left(2) == "AT") {
-        status |= AT_RESPONSE;
-        response = getLine(); // echos must be on, get another line
+    if (i < lines.length() && lines.at(i).left(2) == "AT") {
+        status |= AT_RESPONSE; // echos must be on, skip the line
+        i++;
     }
 
-    if (response == "OK") {
-        status |= OK_RESPONSE;
-        ret = true;
-    }
-    else if (response == "?") {
-        status |= UNKNOWN_RESPONSE;
+    if (i < lines.length()) {
+        if (lines.at(i) == "OK") {
+            status |= OK_RESPONSE;
+            ret = true;
+        }
+        else if (lines.at(i) == "?") {
+            status |= UNKNOWN_RESPONSE;
+        }
     }
 
-    // receive data until prompt appears
-    for (int i = 0; getLine() != ">"; i++) {
-        if (i >= 2) {
-            status |= NO_PROMPT_ERROR;
-            break;
-        }
+    if (lines.empty() || lines.last() != ">") {
+        status |= NO_PROMPT_ERROR;
     }
 
     return ret;
 }
 
+QString elm327::parseResponseStr(const QStringList &lines, int &status)
+{
+    status = 0;
+
+    if (lines.empty() || lines.last() != ">") {
+        status |= NO_PROMPT_ERROR;
+    }
+
+    if (lines.empty() || lines.first() == ">") {
+        return QString();
+    }
+
+    return lines.first();
+}
+
 void elm327::setSerialParams(const serialSettings &in)
 {
     if (port && port->isOpen()) {
@@ -257,29 +301,12 @@ void elm327::setRecvCanID(int id)
     write("AT CRA " + idStr);
 }
 
-QString elm327::getResponseStr(int &status)
-{
-    status = 0;
-    QString response = getLine();
-
-    // receive data until prompt appears
-    for (int i = 0; getLine() != ">"; i++) {
-        if (i >= 2) {
-            status |= NO_PROMPT_ERROR;
-            break;
-        }
-    }
-
-    return response;
-}
-
-canFrame* elm327::hexToCF(QString &input)
+canFrame* elm327::hexToCF(QString input)
 {
     int id, len, tst = 0;
     QByteArray data;
     bool ok;
 
-    QString orig = input;
     input.remove(' ');
 
     id = input.mid(0, 3).toUInt(&ok, 16);
@@ -357,9 +384,16 @@ void elm327::constructLine()
         emit log("RX: " + line, rxTxLog, false);
 #endif
 
-        protectLines->lock();
-        bufferedLines << line;
-        linesAvailable.wakeAll();
-        protectLines->unlock();
+        bufferLine(line);
     }
 }
+
+void elm327::bufferLine(const QString &line)
+{
+    protectLines->lock();
+    bufferedLines << line;
+    linesAvailable.wakeAll();
+    protectLines->unlock();
+
+    emit lineAvailable();
+}
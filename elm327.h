@@ -54,28 +54,35 @@ public:
     QString getResponseStr(int &status);
     bool getResponseStatus(int &status);
     QString getLine(int timeout = 1100, bool wait = true);
+    QStringList getResponseLines();
+    static QList<canFrame*>* parseResponseCAN(const QStringList &lines, int &status);
+    static QString parseResponseStr(const QStringList &lines, int &status);
+    static bool parseResponseStatus(const QStringList &lines, int &status);
     void setSerialParams(const serialSettings &in);
     bool getPortOpen();
 signals:
     void log(const QString &txt, int logLevel = stdLog, bool flush = false);
     void portOpened(bool status);
     void portClosed();
+    void lineAvailable();
 public slots:
     void closePort();
     void openPort();
     void write(const QByteArray &data);
-    void write(const QString &txt);
+    virtual void write(const QString &txt);
     void setSendCanID(int id);
     void setRecvCanID(int id);
 private slots:
     void constructLine();
+protected:
+    void bufferLine(const QString &line);
 private:
     SerialPort* port;
     serialSettings settings;
     QStringList bufferedLines;
     QMutex* protectLines;
     QWaitCondition linesAvailable;
-    canFrame *hexToCF(QString &input);
+    static canFrame *hexToCF(QString input);
 
     int sendCanID;
     int recvCanID;
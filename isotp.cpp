@@ -0,0 +1,369 @@
+/*
+Copyright 2013 Jared Wiltshire
+
+This file is part of VAG Blocks.
+
+VAG Blocks is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+VAG Blocks is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with VAG Blocks.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "isotp.h"
+
+#include <QElapsedTimer>
+
+isotp::isotp(elm327 *elm, QObject *parent) :
+    QObject(parent),
+    elm(elm),
+    padByte(0xAA),
+    txID(-1), rxID(-1),
+    adapterTimeout(-1)
+{
+}
+
+// frames are padded to 8 bytes with byte, -1 for no padding
+void isotp::setPadding(int byte)
+{
+    padByte = byte;
+}
+
+// may be called from any thread, the request is sent the next time run() is called
+void isotp::queueRequest(const isotpRequest &req)
+{
+    protectQueue.lock();
+    queue << req;
+    protectQueue.unlock();
+}
+
+// Sends the first request and blocks the thread until it's answered. One request a
+// run, tp20 keeps its channels alive in between.
+void isotp::run()
+{
+    protectQueue.lock();
+    if (queue.empty()) {
+        protectQueue.unlock();
+        return;
+    }
+    isotpRequest req = queue.takeFirst();
+    protectQueue.unlock();
+
+    // tp20 may have changed them since the last run
+    adapterTimeout = -1;
+    command("AT SH " + toHex(req.txID, 3));
+    txID = req.txID;
+    command("AT CRA " + toHex(req.rxID, 3));
+    rxID = req.rxID;
+
+    QByteArray resp;
+    QString error;
+    if (transfer(req, resp, error)) {
+        emit response(req.rxID, resp);
+    }
+    else {
+        emit log("Error: ISO-TP to " + toHex(req.txID, 3) + ", " + error, debugMsgLog);
+        emit failed(req.rxID, error);
+    }
+}
+
+// Sends the request as a single frame, or a first frame and consecutive frames paced
+// by the module's flow control, then receives the response
+bool isotp::transfer(const isotpRequest &req, QByteArray &resp, QString &error)
+{
+    const QByteArray &data = req.data;
+    int len = data.length();
+    QList<QByteArray> frames;
+
+    if (len < 1 || len > 0xFFF) {
+        error = "request length " + QString::number(len) + " can't be sent";
+        return false;
+    }
+
+    if (len <= 7) {
+        QByteArray sf;
+        sf.append(static_cast<char>(len));
+        sf.append(data);
+        exchange(sf, req.timeout, frames);
+        return receive(frames, resp, error);
+    }
+
+    QByteArray ff;
+    ff.append(static_cast<char>(0x10 | (len >> 8)));
+    ff.append(static_cast<char>(len & 0xFF));
+    ff.append(data.left(6));
+    exchange(ff, flowControlTimeout, frames);
+
+    int index = 6;
+    quint8 seq = 1;
+    int waits = 0;
+    while (index < len) {
+        // the last flow control in the response counts, a wait can be followed by
+        // a go ahead before the adapter stops listening
+        QByteArray fc;
+        QList<QByteArray> others;
+        while (!frames.empty()) {
+            QByteArray frame = frames.takeFirst();
+            if (!frame.isEmpty() && (static_cast<quint8>(frame.at(0)) >> 4) == 0x3) {
+                fc = frame;
+            }
+            else {
+                others << frame;
+            }
+        }
+        if (fc.isEmpty() && !others.empty()) { // eg. a negative response to the first frame
+            return receive(others, resp, error);
+        }
+        if (fc.length() < 3) {
+            error = "no flow control after " + QString::number(index) + " of " + QString::number(len) + " bytes";
+            return false;
+        }
+
+        int status = static_cast<quint8>(fc.at(0)) & 0x0F;
+        if (status == 1) { // wait, ask again by listening
+            if (++waits > maxWaits || !listen(flowControlTimeout, frames)) {
+                error = "module kept asking to wait";
+                return false;
+            }
+            continue;
+        }
+        if (status != 0) {
+            error = "module has no room for " + QString::number(len) + " bytes";
+            return false;
+        }
+
+        int bs = static_cast<quint8>(fc.at(1));
+        int stMin = static_cast<quint8>(fc.at(2));
+        // STmin over 0x7F is in 100us steps, the adapter's round trip is longer than that anyway
+        int gap = (stMin <= 0x7F) ? qMax(static_cast<int>(frameTimeout), stMin) : static_cast<int>(frameTimeout);
+
+        for (int count = 1; index < len; count++) {
+            QByteArray cf;
+            cf.append(static_cast<char>(0x20 | (seq++ & 0x0F)));
+            cf.append(data.mid(index, 7));
+            index += 7;
+
+            bool last = index >= len;
+            bool blockEnd = !last && bs > 0 && count == bs;
+            exchange(cf, last ? req.timeout : (blockEnd ? flowControlTimeout : gap), frames);
+
+            if (blockEnd) {
+                break; // for the next flow control
+            }
+            if (!last && !frames.empty()) {
+                emit log("Warning: ISO-TP module answered before the request was complete", debugMsgLog);
+                frames.clear();
+            }
+        }
+    }
+
+    return receive(frames, resp, error);
+}
+
+// frames holds what the module sent after the last frame of the request
+bool isotp::receive(QList<QByteArray> &frames, QByteArray &resp, QString &error)
+{
+    int pending = 0;
+
+    forever {
+        if (frames.empty()) {
+            if (pending == 0) {
+                error = "no response";
+                return false;
+            }
+            if (pending > maxPending || !listen(pendingTimeout, frames)) {
+                error = "no response after response pending";
+                return false;
+            }
+            continue;
+        }
+
+        QByteArray frame = frames.takeFirst();
+        if (frame.isEmpty()) {
+            continue;
+        }
+        quint8 type = static_cast<quint8>(frame.at(0)) >> 4;
+
+        if (type == 0x0) { // single frame, anything past the length is padding
+            int len = static_cast<quint8>(frame.at(0)) & 0x0F;
+            if (len == 0 || len > frame.length() - 1) {
+                error = "invalid single frame length";
+                return false;
+            }
+            QByteArray msg = frame.mid(1, len);
+            if (isPending(msg)) {
+                emit log("Info: ISO-TP response pending", debugMsgLog);
+                pending++;
+                continue;
+            }
+            resp = msg;
+            return true;
+        }
+
+        if (type == 0x1) { // first frame, ask for the rest in one go
+            if (frame.length() < 8) {
+                error = "first frame too short";
+                return false;
+            }
+            // a length of 0 is the ISO 15765-2:2016 escape, the next four bytes hold a length over 4095
+            qint64 len = ((static_cast<quint8>(frame.at(0)) & 0x0F) << 8) | static_cast<quint8>(frame.at(1));
+            int start = 2;
+            if (len == 0) {
+                for (int i = 2; i < 6; i++) {
+                    len = (len << 8) | static_cast<quint8>(frame.at(i));
+                }
+                start = 6;
+                if (len <= 0xFFF) {
+                    error = "invalid first frame length";
+                    return false;
+                }
+            }
+            else if (len < 8) {
+                error = "invalid first frame length";
+                return false;
+            }
+            resp = frame.mid(start, 8 - start);
+
+            QByteArray fc;
+            fc.append(static_cast<char>(0x30));
+            fc.append(static_cast<char>(0x00)); // block size 0, no more flow control
+            fc.append(static_cast<char>(0x00)); // STmin 0
+            frames.clear();
+            exchange(fc, consecutiveTimeout, frames);
+
+            quint8 seq = 1;
+            while (resp.length() < len) {
+                if (frames.empty()) {
+                    error = "consecutive frames stopped after " + QString::number(resp.length()) +
+                            " of " + QString::number(len) + " bytes";
+                    return false;
+                }
+                QByteArray cf = frames.takeFirst();
+                if (cf.isEmpty() || (static_cast<quint8>(cf.at(0)) >> 4) != 0x2) {
+                    error = "expected a consecutive frame";
+                    return false;
+                }
+                quint8 cfSeq = static_cast<quint8>(cf.at(0)) & 0x0F;
+                if (cfSeq != (seq & 0x0F)) {
+                    if (cfSeq == ((seq - 1) & 0x0F)) { // repeated
+                        continue;
+                    }
+                    error = "consecutive frame " + QString::number(cfSeq) + " out of sequence, expected " +
+                            QString::number(seq & 0x0F);
+                    return false;
+                }
+                seq++;
+                resp.append(cf.mid(1, static_cast<int>(qMin<qint64>(7, len - resp.length()))));
+            }
+            return true;
+        }
+
+        emit log("Warning: ISO-TP unexpected frame type " + QString::number(type), debugMsgLog);
+    }
+}
+
+// Writes one frame and collects the frames the module sends back until the adapter
+// times out. Returns the elm327 status flags.
+int isotp::exchange(const QByteArray &frame, int timeout, QList<QByteArray> &frames)
+{
+    setTimeout(timeout);
+
+    QByteArray padded = frame;
+    if (padByte >= 0) {
+        while (padded.length() < 8) {
+            padded.append(static_cast<char>(padByte));
+        }
+    }
+
+    QString txt;
+    for (int i = 0; i < padded.length(); i++) {
+        txt += toHex(static_cast<quint8>(padded.at(i)), 2) + " ";
+    }
+    txt.chop(1);
+    QMetaObject::invokeMethod(elm, "write", Qt::QueuedConnection, Q_ARG(QString, txt));
+
+    int status;
+    QList<canFrame*>* result = elm->getResponseCAN(status);
+    for (int i = 0; i < result->length(); i++) {
+        frames << result->at(i)->data;
+    }
+    qDeleteAll(result->begin(), result->end());
+    delete result;
+
+    return status;
+}
+
+// The adapter only listens after it sends, so after a response pending or flow
+// control wait the bus is monitored until the next frame from the module
+bool isotp::listen(int msecs, QList<QByteArray> &frames)
+{
+    QElapsedTimer timer;
+    timer.start();
+    bool promptSeen = false;
+
+    QMetaObject::invokeMethod(elm, "write", Qt::QueuedConnection, Q_ARG(QString, "AT MA"));
+
+    int remaining;
+    while (frames.empty() && (remaining = msecs - timer.elapsed()) > 0) {
+        QString line = elm->getLine(remaining);
+        if (line == ">") {
+            promptSeen = true;
+            break;
+        }
+        capturedFrame frame;
+        if (parseFrameLine(line, frame) && frame.canID == rxID) {
+            frames << frame.data;
+        }
+    }
+
+    if (!promptSeen) {
+        QMetaObject::invokeMethod(elm, "write", Qt::QueuedConnection, Q_ARG(QString, "."));
+        for (int timeoutCount = 0; timeoutCount < 5;) {
+            QString line = elm->getLine();
+            if (line == "") {
+                timeoutCount++;
+                continue;
+            }
+            if (line == ">") {
+                break;
+            }
+            capturedFrame frame;
+            if (parseFrameLine(line, frame) && frame.canID == rxID) {
+                frames << frame.data;
+            }
+        }
+    }
+
+    return !frames.empty();
+}
+
+bool isotp::command(const QString &cmd)
+{
+    int status;
+    QMetaObject::invokeMethod(elm, "write", Qt::QueuedConnection, Q_ARG(QString, cmd));
+    return elm->getResponseStatus(status);
+}
+
+void isotp::setTimeout(int msecs)
+{
+    int steps = qBound(1, (msecs + 3) / 4, 0xFF); // each increment is 4ms
+    if (steps * 4 == adapterTimeout) {
+        return;
+    }
+    command("AT ST " + toHex(steps));
+    adapterTimeout = steps * 4;
+}
+
+// 7F xx 78, the module needs longer
+bool isotp::isPending(const QByteArray &msg)
+{
+    return msg.length() == 3 && static_cast<quint8>(msg.at(0)) == 0x7F && static_cast<quint8>(msg.at(2)) == 0x78;
+}
@@ -0,0 +1,82 @@
+/*
+Copyright 2013 Jared Wiltshire
+
+This file is part of VAG Blocks.
+
+VAG Blocks is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+VAG Blocks is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with VAG Blocks.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef ISOTP_H
+#define ISOTP_H
+
+#include <QObject>
+#include <QMutex>
+#include <QList>
+
+#include "elm327.h"
+#include "util.h"
+
+typedef struct {
+    int txID; // the module listens on this, eg. 0x7E0
+    int rxID; // and answers on this, eg. 0x7E8
+    QByteArray data;
+    int timeout; // msecs to wait for the response after the last frame
+} isotpRequest;
+
+// ISO 15765-2 transport for the modules that use UDS rather than TP2.0. Like the
+// monitor it needs the ELM327 to itself, requests are queued from any thread and
+// run() is called through tp20::runExclusive() once for each to send it. The ELM327 is left
+// with CAN formatting off by tp20 so the PCI bytes, padding and flow control are
+// all done here. Our flow control asks for everything at once, block size 0 and
+// STmin 0.
+class isotp : public QObject
+{
+    Q_OBJECT
+public:
+    explicit isotp(elm327* elm, QObject *parent = 0);
+    void setPadding(int byte);
+    void queueRequest(const isotpRequest &req);
+signals:
+    void log(const QString &txt, int logLevel = stdLog);
+    void response(int rxID, const QByteArray &data);
+    void failed(int rxID, const QString &reason);
+public slots:
+    void run();
+private:
+    elm327* elm;
+    QMutex protectQueue;
+    QList<isotpRequest> queue;
+    int padByte; // -1 sends frames at their real length
+    int txID; // header and filter last set, -1 if unknown
+    int rxID;
+    int adapterTimeout; // msecs the AT ST was last set to, -1 if unknown
+
+    bool transfer(const isotpRequest &req, QByteArray &resp, QString &error);
+    bool receive(QList<QByteArray> &frames, QByteArray &resp, QString &error);
+    int exchange(const QByteArray &frame, int timeout, QList<QByteArray> &frames);
+    bool listen(int msecs, QList<QByteArray> &frames);
+    bool command(const QString &cmd);
+    void setTimeout(int msecs);
+    static bool isPending(const QByteArray &msg);
+
+    static const int flowControlTimeout = 1000; // N_Bs
+    static const int consecutiveTimeout = 100; // gap between consecutive frames before the adapter gives up
+    static const int frameTimeout = 8; // listening after a frame nothing answers
+    static const int pendingTimeout = 5000; // P2* after a response pending
+    static const int maxWaits = 10; // flow control waits before giving up
+    static const int maxPending = 10; // response pending before giving up
+};
+
+#endif // ISOTP_H
@@ -28,49 +28,131 @@ along with VAG Blocks.  If not, see <http://www.gnu.org/licenses/>.
 
 kwp2000::kwp2000(QObject *parent) :
     QObject(parent),
+    firstBroadcastSample(0),
     nextBlock(0),
     readingBlocks(false),
+    readsPaused(false),
+    lastReadDest(-1),
+    dynamicSupported(-1),
+    dynamicDefined(false),
+    dynamicClearing(false),
+    dynamicRetried(false),
+    periodicMode(0),
+    periodicState(periodicOff),
+    periodicId(-1),
+    periodicStopId(-1),
+    periodicMisses(0),
+    firstExtraSample(0),
+    firstMemorySample(0),
+    memoryPending(-1),
+    closeRequested(false),
+    channelWasOpen(false),
+    reconnecting(false),
+    reconnectAttempts(0),
+    reconnectTry(0),
+    monitorWindow(0),
+    monitorInterval(1000),
+    windowLeft(0),
+    keepAliveInterval(500),
+    inMonitorWindow(false),
+    sweeping(false),
+    bulkDest(-1),
+    sweepIndex(0),
+    sweepReads(0),
+    sweepDraining(false),
+    nextRequestId(0),
+    fastTiming(true),
+    timingRestoring(false),
+    portPending(portKeep),
+    serialPending(false),
     logFile(0),
     labelFile(0),
+    logStartClock(0),
     doModuleRefresh(true),
     destModule(-1),
     slowRecvTimeout(40),
     normRecvTimeout(24),
-    fastRecvTimeout(16)
+    fastRecvTimeout(16),
+    adaptiveTimeouts(false)
 {
     elmThread = new QThread(this);
     tpThread = new QThread(this);
 
     elm = new elm327();
     tp = new tp20(elm);
-
+    mon = new monitor(elm);
+    iso = new isotp(elm);
+    udsClient = new uds(iso, tp, this);
+    mon->setDecoder(&broadcastDecoder);
+    acquisitionClock.start();
+    lastMonitorWindow.start();
+    mon->setClock(acquisitionClock);
+
+    // the monitor shares the TP2.0 thread so it can never interleave with a channel
     elm->moveToThread(elmThread);
     tp->moveToThread(tpThread);
+    mon->moveToThread(tpThread);
+    iso->moveToThread(tpThread);
 
     elmThread->start();
     tpThread->start();
 
-    connect(tp, SIGNAL(response(QByteArray*)), this, SLOT(recvKWP(QByteArray*)));
+    qRegisterMetaType<tpMessage>("tpMessage");
+    connect(tp, SIGNAL(response(int, tpMessage)), this, SLOT(recvKWP(int, tpMessage)));
 
     connect(elm, SIGNAL(log(QString, int)), this, SIGNAL(log(QString, int)));
     connect(tp, SIGNAL(log(QString, int)), this, SIGNAL(log(QString, int)));
+    connect(iso, SIGNAL(log(QString, int)), this, SIGNAL(log(QString, int)));
+    connect(udsClient, SIGNAL(log(QString, int)), this, SIGNAL(log(QString, int)));
+    connect(udsClient, SIGNAL(didData(int, QMap<int, QByteArray>)), this, SLOT(udsData(int, QMap<int, QByteArray>)));
+    connect(tp, SIGNAL(elmInitDone(bool)), udsClient, SLOT(forgetModules()));
 
     connect(tp, SIGNAL(channelOpened(bool)), this, SLOT(channelOpenSlot(bool)));
-    connect(tp, SIGNAL(channelOpened(bool)), this, SIGNAL(channelOpen(bool)));
     connect(tp, SIGNAL(elmInitDone(bool)), this, SIGNAL(elmInitialised(bool)));
     connect(tp, SIGNAL(elmInitDone(bool)), this, SLOT(openGW_refresh(bool)));
+    connect(tp, SIGNAL(channelParams(int, int, int, int)), this, SLOT(channelParamsSlot(int, int, int, int)));
+    connect(tp, SIGNAL(channelStatus(int, bool)), this, SLOT(channelStatusSlot(int, bool)));
+    qRegisterMetaType<rttEstimate>("rttEstimate");
+    connect(tp, SIGNAL(responseTime(int, int, rttEstimate)), this, SLOT(responseTimeSlot(int, int, rttEstimate)));
 
     connect(elm, SIGNAL(portOpened(bool)), this, SIGNAL(portOpened(bool)));
     connect(elm, SIGNAL(portClosed()), this, SIGNAL(portClosed()));
 
-    readBlockTimer.setInterval(500);
+    qRegisterMetaType<broadcastBatch>("broadcastBatch");
+    connect(mon, SIGNAL(broadcastData(broadcastBatch)), this, SLOT(broadcastData(broadcastBatch)));
+    connect(mon, SIGNAL(done()), this, SLOT(monitorDone()));
+    connect(mon, SIGNAL(windowDone()), this, SLOT(monitorWindowDone()));
+
+    readBlockTimer.setInterval(readWatchdog);
     connect(&readBlockTimer, SIGNAL(timeout()), this, SLOT(readBlockTimeout()));
 
+    scheduleTimer.setSingleShot(true);
+    connect(&scheduleTimer, SIGNAL(timeout()), this, SLOT(scheduleTimeout()));
+    rateClock.start();
+
+    sweepTimer.setSingleShot(true);
+    connect(&sweepTimer, SIGNAL(timeout()), this, SLOT(sweepTimeout()));
+
+    reconnectTimer.setSingleShot(true);
+    connect(&reconnectTimer, SIGNAL(timeout()), this, SLOT(reconnectTimeout()));
+    restoreTimer.setSingleShot(true);
+    restoreTimer.setInterval(restoreTimeout);
+    connect(&restoreTimer, SIGNAL(timeout()), this, SLOT(restoreTimedOut()));
+
+    qRegisterMetaType<kwpResult>("kwpResult");
+    requestTimer.setSingleShot(true);
+    connect(&requestTimer, SIGNAL(timeout()), this, SLOT(requestTimeout()));
+    requestClock.start();
+
     initModuleNames();
 }
 
 kwp2000::~kwp2000()
 {
+    closeRequested = true;
+    reconnectTimer.stop();
+    mon->stop();
+    queueTimingRestore();
     QMetaObject::invokeMethod(tp, "closeChannel", Qt::BlockingQueuedConnection);
     closePortBlocking();
 
@@ -90,6 +172,13 @@ kwp2000::~kwp2000()
 
 void kwp2000::openPort()
 {
+    if (restoreTiming()) {
+        portPending = portOpen;
+        return;
+    }
+    closeRequested = true;
+    cancelReconnect();
+    mon->stop();
     if (tp->getChannelDest() >= 0) {
         QMetaObject::invokeMethod(tp, "closeChannel", Qt::BlockingQueuedConnection);
     }
@@ -97,6 +186,13 @@ void kwp2000::openPort()
 }
 
 void kwp2000::closePort() {
+    if (restoreTiming()) {
+        portPending = portClose;
+        return;
+    }
+    closeRequested = true;
+    cancelReconnect();
+    mon->stop();
     if (tp->getChannelDest() >= 0) {
         QMetaObject::invokeMethod(tp, "closeChannel", Qt::BlockingQueuedConnection);
     }
@@ -105,6 +201,10 @@ void kwp2000::closePort() {
 
 void kwp2000::closePortBlocking()
 {
+    closeRequested = true;
+    cancelReconnect();
+    mon->stop();
+    queueTimingRestore();
     if (tp->getChannelDest() >= 0) {
         QMetaObject::invokeMethod(tp, "closeChannel", Qt::BlockingQueuedConnection);
     }
@@ -112,7 +212,7 @@ void kwp2000::closePortBlocking()
 }
 
 void kwp2000::openChannel(int i) {
-    if (getChannelDest() >= 0) {
+    if (getChannelDest() >= 0 || reconnecting) {
         return;
     }
 
@@ -131,6 +231,7 @@ void kwp2000::openChannel(int i) {
     }
 
     destModule = i;
+    closeRequested = false;
 
     emit log("Opening channel to module 0x" + toHex(destModule));
     QMetaObject::invokeMethod(tp, "openChannel", Qt::QueuedConnection,
@@ -140,11 +241,24 @@ void kwp2000::openChannel(int i) {
 
 void kwp2000::closeChannel() {
     emit log("Closing channel to module 0x" + toHex(destModule));
+    closeRequested = true;
+    cancelReconnect();
+
+    if (restoreTiming()) {
+        return;
+    }
     QMetaObject::invokeMethod(tp, "closeChannel", Qt::QueuedConnection);
 }
 
 void kwp2000::setSerialParams(const serialSettings &in)
 {
+    if (restoreTiming()) {
+        pendingSerial = in;
+        serialPending = true;
+        return;
+    }
+    closeRequested = true;
+    cancelReconnect();
     if (tp->getChannelDest() >= 0) {
         QMetaObject::invokeMethod(tp, "closeChannel", Qt::BlockingQueuedConnection);
     }
@@ -181,15 +295,17 @@ void kwp2000::startDiag(int param)
     QByteArray packet;
     packet.append(0x10);
     packet.append(param);
-    QMetaObject::invokeMethod(tp, "sendData", Qt::QueuedConnection,
-                              Q_ARG(QByteArray, packet),
-                              Q_ARG(int, slowRecvTimeout));
+    sendInternal(getChannelDest(), packet, slowRecvTimeout);
 }
 
 void kwp2000::openBlock(int blockNum)
 {
     if (!currentBlocks.contains(blockNum)) {
         currentBlocks.insert(blockNum, QVector<blockValue>(4));
+        for (int pos = 0; pos < 4; pos++) {
+            typedValue none = {noValue, 0, 0, QString()};
+            currentBlocks[blockNum][pos].value = none;
+        }
 
         // set descriptions from label file
 
@@ -225,317 +341,1601 @@ void kwp2000::closeAllBlocks()
 
 void kwp2000::channelOpenSlot(bool status)
 {
+    dynamicSupported = -1; // a new session forgets the definition, and may be another module
+    dynamicDefined = false;
+    dynamicClearing = false;
+    dynamicRetried = false;
+    pendingLayout.clear();
+    periodicState = periodicOff; // and any periodic transmission
+    periodicStopId = -1;
+    if (moduleTimings.contains(destModule)) {
+        moduleTimings[destModule].applied = false; // and the timing
+    }
+
     if (status == false) {
-        if (destModule >= 0) {
-            emit log("Channel closed to module 0x" + toHex(destModule));
+        cancelRequests(-1);
+        internalPending.clear();
+        internalSent.clear();
+        readBackoff.clear();
+
+        // the other modules are only read alongside this one
+        if (!extraOpen.empty()) {
+            QMetaObject::invokeMethod(tp, "closeChannel", Qt::QueuedConnection);
         }
-        destModule = -1;
+        extraChannels.clear();
+        extraOpen.clear();
 
-        modulePartNum.clear();
-        closeAllBlocks();
-        emit labelsLoaded(false);
+        if (sweeping) {
+            sweeping = false;
+            sweepTimer.stop();
+            emit log("Parameter sweep aborted");
+        }
+
+        restoreTimer.stop();
+        if (reconnecting || (!closeRequested && channelWasOpen && destModule >= 0 && reconnectAttempts > 0)) {
+            scheduleReconnect();
+            return;
+        }
+
+        endSession();
     }
     else {
         emit log("Channel opened to module 0x" + toHex(destModule));
+        channelWasOpen = true;
+
+        if (reconnecting) { // the blocks are read again once the session is back
+            startDiag();
+            openExtraChannels();
+            restoreTimer.start();
+            return;
+        }
 
         if (tp->getChannelDest() == 31 && doModuleRefresh) {
             QByteArray tmp;
             tmp.append(0x1A);
             tmp.append(0x9F);
-            QMetaObject::invokeMethod(tp, "sendData", Qt::QueuedConnection,
-                                      Q_ARG(QByteArray, tmp),
-                                      Q_ARG(int, slowRecvTimeout));
+            sendInternal(getChannelDest(), tmp, slowRecvTimeout);
         }
         else {
             // when channel is opened, start diagnostic session
             // when diag session started the ID strings will be retrieved
             startDiag();
+            openExtraChannels();
         }
+        emit channelOpen(true);
     }
 }
 
-void kwp2000::miscCommand(const QByteArray &cmd)
+void kwp2000::endSession()
 {
-    QMetaObject::invokeMethod(tp, "sendData", Qt::QueuedConnection,
-                              Q_ARG(QByteArray, cmd),
-                              Q_ARG(int, slowRecvTimeout));
+    if (destModule >= 0) {
+        emit log("Channel closed to module 0x" + toHex(destModule));
+    }
+    destModule = -1;
+    channelWasOpen = false;
+
+    modulePartNum.clear();
+    closeAllBlocks();
+    emit labelsLoaded(false);
+    emit channelOpen(false);
 }
 
-void kwp2000::changeSampleFormat()
+// The blocks and log file are kept while the channel is down, the UI isn't told
+// it closed unless every try fails
+void kwp2000::scheduleReconnect()
 {
-    sample.clear();
-
-    QList<int> openBlocks = currentBlocks.keys();
-    for (int i = 0; i < openBlocks.length(); i++) {
-        int blockNum = openBlocks.at(i);
-
-        for (int pos = 0; pos < 4; pos++) {
-            blockRef tmpRef = {blockNum, pos};
+    if (!reconnecting) {
+        emit log("Channel to module 0x" + toHex(destModule) + " dropped");
+        reconnecting = true;
+        reconnectTry = 0;
+        readBlockTimer.stop();
+    }
 
-            bool matchFound = false;
+    if (reconnectTry >= reconnectAttempts) {
+        emit log("Could not reconnect to module 0x" + toHex(destModule));
+        reconnecting = false;
+        endSession();
+        return;
+    }
 
-            // check and see if an equivilent sampleValue already exists
-            if (pos == 0 && blockLabels[blockNum].desc[0].toLower() == "engine speed") {
-                for (int sampleNum = 0; sampleNum < sample.length(); sampleNum++) {
-                    int existingBlock = sample[sampleNum].refs[0].blockNum;
-                    int existingPos = sample[sampleNum].refs[0].pos;
+    int delay = qMin(reconnectDelay << qMin(reconnectTry, 16), reconnectMaxDelay);
+    reconnectTry++;
+    emit log("Reconnecting in " + QString::number(delay / 1000.0) + "s (attempt " +
+             QString::number(reconnectTry) + " of " + QString::number(reconnectAttempts) + ")");
+    reconnectTimer.start(delay);
+}
 
-                    if (existingPos == 0 && blockLabels[existingBlock].desc[0].toLower() == "engine speed") {
-                        matchFound = true;
-                        currentBlocks[blockNum][pos].indexToSampleValue = sampleNum;
-                        sample[sampleNum].refs.append(tmpRef);
-                    }
-                }
-            }
+void kwp2000::reconnectTimeout()
+{
+    if (!reconnecting) {
+        return;
+    }
 
-            if (!matchFound) {
-                // insert new sampleValue
-                sampleValue value;
-                value.refs.append(tmpRef);
-                currentBlocks[blockNum][pos].indexToSampleValue = sample.length();
-                sample.append(value);
-            }
-        }
+    // the port is opened again with the same settings, the next try finds it initialised
+    if (!getPortOpen()) {
+        emit log("Reopening the serial port");
+        QMetaObject::invokeMethod(elm, "openPort", Qt::QueuedConnection);
+        scheduleReconnect();
+        return;
+    }
+    if (!getElmInitialised()) {
+        scheduleReconnect();
+        return;
     }
 
-    emit sampleFormatChanged();
+    int addr = moduleList.contains(destModule) ? moduleList.value(destModule).addr : destModule;
+    QMetaObject::invokeMethod(tp, "openChannel", Qt::QueuedConnection,
+                              Q_ARG(int, addr),
+                              Q_ARG(int, normRecvTimeout));
 }
 
-void kwp2000::startLogging()
+// Gives up on a reconnect that is under way, the session is closed as normal
+void kwp2000::cancelReconnect()
 {
-    QDir(".").mkdir("Logs");
-
-    logFileName = "Logs/" + QDateTime::currentDateTime().toString("yyyy-MM-dd_HH-mm-ss") + ".csv";
+    if (!reconnecting) {
+        return;
+    }
 
-    logFile = new QFile(logFileName, this);
-    logFile->open(QIODevice::WriteOnly | QIODevice::Text);
-    logOut.setDevice(logFile);
+    reconnecting = false;
+    reconnectTimer.stop();
+    restoreTimer.stop();
+    endSession();
+}
 
-    // print header
-    logOut << "Time";
-    for (int i = 0; i < sample.length(); i++) {
-        int sampleBlockNum = sample[i].refs[0].blockNum;
-        int samplePos = sample[i].refs[0].pos;
-        logOut << "," + blockLabels[sampleBlockNum].desc[samplePos];
-        logOut << " " + blockLabels[sampleBlockNum].subDesc[samplePos];
-        logOut << " [" + currentBlocks[sampleBlockNum][samplePos].units + "]";
+// The channel came back but the module didn't answer the session request, it is
+// closed so the drop is handled as before and counts as a failed try
+void kwp2000::restoreTimedOut()
+{
+    if (!reconnecting) {
+        return;
     }
-    logOut << endl;
-    logOut.flush();
 
-    emit loggingStarted();
+    emit log("No answer to the session request on module 0x" + toHex(destModule));
+    forgetInternal(getChannelDest(), 0x10);
+    QMetaObject::invokeMethod(tp, "closeChannel", Qt::QueuedConnection);
 }
 
-void kwp2000::stopLogging()
+void kwp2000::setReconnectAttempts(int attempts)
 {
-    logOut.setDevice(0);
-    logFile->close();
-    delete logFile;
-    logFile = 0;
+    reconnectAttempts = attempts;
 }
 
-void kwp2000::loadLabelFile()
+// Block size, T1 and T3 to ask dest for when a channel is opened, eg. a set saved
+// from an earlier sweep
+void kwp2000::setModuleParams(int dest, int bs, int t1, int t3)
 {
-    if (modulePartNum.empty()) {
-        emit labelsLoaded(false);
-        return;
-    }
+    QMetaObject::invokeMethod(tp, "setModuleParams", Qt::QueuedConnection,
+                              Q_ARG(int, dest),
+                              Q_ARG(int, bs),
+                              Q_ARG(int, t1),
+                              Q_ARG(int, t3));
+}
 
-    QString partNum;
-    int end = modulePartNum.at(0).indexOf(QChar(' '));
-    if (end < 0) {
-        partNum = modulePartNum.at(0);
-    }
-    else {
-        partNum = modulePartNum.at(0).left(end);
-    }
+bool kwp2000::getReconnecting() const
+{
+    return reconnecting;
+}
 
-    QStringList partSplit;
-    for (int i = 0; i < partNum.length(); i += 3) {
-        partSplit << partNum.mid(i, 3);
+// Opens a channel to each module in the extra blocks setting, their blocks are
+// read in turn with the open blocks
+void kwp2000::openExtraChannels()
+{
+    QList<int> modules = extraBlocks.keys();
+    for (int i = 0; i < modules.length(); i++) {
+        int module = modules.at(i);
+        int addr = moduleList.contains(module) ? moduleList.value(module).addr : module;
+        if (addr == getChannelDest() || extraChannels.contains(addr)) {
+            continue;
+        }
+
+        extraChannels.insert(addr, module);
+        emit log("Opening channel to module 0x" + toHex(module));
+        QMetaObject::invokeMethod(tp, "addChannel", Qt::QueuedConnection,
+                                  Q_ARG(int, addr),
+                                  Q_ARG(int, normRecvTimeout));
     }
-    partNum = partSplit.join("-");
+}
 
-    if (labelDir.length() == 0) {
-        emit labelsLoaded(false);
-        return;
+void kwp2000::channelStatusSlot(int dest, bool open)
+{
+    if (!extraChannels.contains(dest)) {
+        return; // the main channel is handled by channelOpenSlot()
     }
 
-    QDir dir(labelDir);
-    if (!dir.exists()) {
-        emit labelsLoaded(false);
+    int module = extraChannels.value(dest);
+    if (!open) {
+        cancelRequests(dest);
+        forgetInternal(dest, -1);
+        if (extraOpen.removeAll(dest) > 0) {
+            emit log("Channel closed to module 0x" + toHex(module));
+        }
+        else {
+            emit log("Warning: Could not open a channel to module 0x" + toHex(module));
+        }
+        extraChannels.remove(dest);
         return;
     }
 
-    labelFileName = dir.absolutePath() + "/User/" + partNum + ".lbl";
-    labelFile = new QFile(labelFileName, this);
-
-    // try to find labels from direct part name
-    // check user folder first, then root label dir
-    if (!labelFile->exists()) {
-        labelFileName = dir.absolutePath() + "/" + partNum + ".lbl";
-        labelFile->setFileName(labelFileName);
+    emit log("Channel opened to module 0x" + toHex(module));
+    extraOpen.append(dest);
 
-        if (!labelFile->exists()) {
-            // try to find labels from redirect files
-            // check user folder first, then root label dir
-            QString fileName = findLabelFromRedir(partNum, dir.absolutePath() + "/User");
-            if (fileName.length() == 0) {
-                fileName = findLabelFromRedir(partNum, dir.absolutePath());
-            }
-            if (fileName.length() == 0) {
-                emit labelsLoaded(false);
-                return;
-            }
+    // the session is started before any block read reaches the module
+    QByteArray packet;
+    packet.append(0x10);
+    packet.append(0x89);
+    sendInternal(dest, packet, slowRecvTimeout);
 
-            // got label file name from redirect, now find file in user or root dir
-            labelFileName = dir.absolutePath() + "/User/" + fileName;
-            labelFile->setFileName(labelFileName);
+    if (!readingBlocks) {
+        readingBlocks = true;
+        readBlocks();
+    }
+}
 
-            if (!labelFile->exists()) {
-                labelFileName = dir.absolutePath() + "/" + fileName;
-                labelFile->setFileName(labelFileName);
+// Blocks to read from other modules, eg. "02:1,2; 03:4" reads blocks 1 and 2 from
+// the transmission and block 4 from the ABS. Module numbers are hex.
+void kwp2000::setExtraBlocks(const QString &spec)
+{
+    QMap<int, QList<int> > blocks;
+
+    QStringList modules = spec.split(QChar(';'), QString::SkipEmptyParts);
+    for (int i = 0; i < modules.length(); i++) {
+        QStringList parts = modules.at(i).split(QChar(':'));
+        bool ok;
+        int module = parts.at(0).trimmed().toInt(&ok, 16);
+        if (parts.length() != 2 || !ok || module <= 0 || module > 0xFF) {
+            emit log("Warning: Could not read the extra blocks for " + modules.at(i).trimmed());
+            continue;
+        }
 
-                if (!labelFile->exists()) {
-                    emit labelsLoaded(false);
-                    return;
-                }
+        QStringList nums = parts.at(1).split(QChar(','), QString::SkipEmptyParts);
+        for (int j = 0; j < nums.length(); j++) {
+            int blockNum = nums.at(j).trimmed().toInt(&ok);
+            if (ok && blockNum >= 0 && blockNum <= 255 && !blocks[module].contains(blockNum)) {
+                blocks[module].append(blockNum);
             }
         }
     }
 
-    labelFile->open(QIODevice::ReadOnly);
-    labelIn.setDevice(labelFile);
-
-    int blockNum = -1;
-    int pos = -1;
-    while(!labelIn.atEnd()) {
-        QString line = labelIn.readLine();
-        if (line.length() > 0) {
-            char firstChar = line.at(0).toAscii();
-            if (firstChar >= 48 && firstChar <= 57) {
-                bool ok;
-
-                QStringList parts = line.split(QChar(','));
-                if (parts.length() < 3) {
-                    continue;
-                }
-
-                blockNum = parts.at(0).toInt(&ok);
-                if (!ok || blockNum < 0 || blockNum > 255) {
-                    continue;
-                }
-
-                pos = parts.at(1).toInt(&ok);
-                if (!ok || pos < 0 || pos > 4) {
-                    continue;
-                }
+    if (blocks == extraBlocks) {
+        return;
+    }
 
-                if (!blockLabels.contains(blockNum)) {
-                    blockLabels_t newBlockLabel;
-                    blockLabels.insert(blockNum, newBlockLabel);
-                }
+    extraBlocks = blocks;
+    changeSampleFormat();
+}
 
-                if (pos == 0) {
-                    blockLabels[blockNum].blockName = parts.at(2);
-                    continue;
-                }
+// Memory variables to log, eg. "rpm@38A4:2:0.25:0:rpm; ign@3A12:1s:-0.75" as
+// name@hex address:size[:scale[:offset[:units]]]. The size is 1, 2 or 4 bytes,
+// followed by s if the value is signed and b if it's big endian.
+void kwp2000::setMemoryVariables(const QString &spec)
+{
+    if (spec == memorySpec) {
+        return;
+    }
+    memorySpec = spec;
+
+    QList<memoryVariable> vars;
+
+    QStringList entries = spec.split(QChar(';'), QString::SkipEmptyParts);
+    for (int i = 0; i < entries.length(); i++) {
+        QStringList parts = entries.at(i).split(QChar(':'));
+        QStringList ref = parts.at(0).split(QChar('@'));
+        bool ok = parts.length() >= 2 && parts.length() <= 5 && ref.length() == 2;
+
+        memoryVariable var;
+        var.name = ref.at(0).trimmed();
+        var.address = ok ? ref.at(1).trimmed().toInt(&ok, 16) : -1;
+
+        QString size = ok ? parts.at(1).trimmed().toLower() : QString();
+        var.isSigned = size.contains(QChar('s'));
+        var.bigEndian = size.contains(QChar('b'));
+        size.remove(QChar('s'));
+        size.remove(QChar('b'));
+        var.size = ok ? size.toInt(&ok) : 0;
+
+        var.scale = 1;
+        var.offset = 0;
+        if (ok && parts.length() > 2) {
+            var.scale = parts.at(2).trimmed().toDouble(&ok);
+        }
+        if (ok && parts.length() > 3) {
+            var.offset = parts.at(3).trimmed().toDouble(&ok);
+        }
+        var.units = sampleStore::internUnits(parts.length() > 4 ? parts.at(4).trimmed() : QString());
 
-                blockLabels[blockNum].desc[pos-1] = parts.at(2);
-                if (parts.length() > 3) {
-                    blockLabels[blockNum].subDesc[pos-1] = parts.at(3);
-                }
-                if (parts.length() > 4) {
-                    QString longDesc = parts.at(4);
-                    blockLabels[blockNum].longDesc[pos-1] = longDesc.replace("\\n", "\n");
-                }
-            }
+        if (!ok || var.name.isEmpty() || var.address < 0 || var.address > 0xFFFFFF ||
+                (var.size != 1 && var.size != 2 && var.size != 4)) {
+            emit log("Warning: Could not read the memory variable " + entries.at(i).trimmed());
+            continue;
+        }
 
-            // binary description
-            if (firstChar == ';' && line.contains(QChar('='))) {
-                if (blockNum < 0 || blockNum > 255 || pos < 0 || pos > 4) {
-                    continue;
-                }
-                if (!blockLabels.contains(blockNum)) {
-                    continue;
-                }
-                blockLabels[blockNum].binDesc[pos-1] += line.mid(2) + '\n';
-            }
+        int j = 0;
+        while (j < vars.length() && vars.at(j).address <= var.address) {
+            j++;
         }
+        vars.insert(j, var);
     }
 
-    if (blockLabels.count() > 0) {
-        emit labelsLoaded(true);
-    }
-    else {
-        emit labelsLoaded(false);
-    }
+    memoryVars = vars;
+    groupMemoryReads();
+    changeSampleFormat();
 
-    labelIn.setDevice(0);
-    labelFile->close();
-    delete labelFile;
-    labelFile = 0;
+    if (!memoryVars.empty() && getChannelDest() >= 0 && !readingBlocks) {
+        readingBlocks = true;
+        readBlocks();
+    }
 }
 
-void kwp2000::openGW_refresh(bool ok)
+// Block and memory variable reads stop until they're resumed, so a bulk transfer
+// has the channel to itself
+void kwp2000::pauseReads(bool pause)
 {
-    if (ok) {
-        doModuleRefresh = true;
-        QMetaObject::invokeMethod(tp, "openChannel", Qt::QueuedConnection,
-                                  Q_ARG(int, 31),
-                                  Q_ARG(int, normRecvTimeout));
+    readsPaused = pause;
+    if (pause) {
+        readBlockTimer.stop();
+        scheduleTimer.stop();
+    }
+    else if (readingBlocks) {
+        readBlocks();
     }
 }
 
-void kwp2000::readBlocks()
+// TP2.0's largest block size, with the timing the module has already accepted.
+// restoreBlockSize() puts back what the channel had.
+void kwp2000::useMaxBlockSize()
 {
-    QList<int> openBlocks = currentBlocks.keys();
-    if (openBlocks.empty()) {
-        nextBlock = 0;
-        readingBlocks = false;
+    int dest = getChannelDest();
+    if (dest < 0 || !moduleParams.contains(dest)) {
         return;
     }
 
-    if (nextBlock >= openBlocks.length()) {
-        nextBlock = 0;
+    bulkDest = dest;
+    bulkSavedParams = moduleParams.value(dest);
+    QMetaObject::invokeMethod(tp, "setParams", Qt::QueuedConnection,
+                              Q_ARG(int, 0x0F),
+                              Q_ARG(int, bulkSavedParams.T1),
+                              Q_ARG(int, bulkSavedParams.T3));
+}
+
+void kwp2000::restoreBlockSize()
+{
+    if (bulkDest >= 0 && bulkDest == getChannelDest()) {
+        QMetaObject::invokeMethod(tp, "setParams", Qt::QueuedConnection,
+                                  Q_ARG(int, bulkSavedParams.bs),
+                                  Q_ARG(int, bulkSavedParams.T1),
+                                  Q_ARG(int, bulkSavedParams.T3));
+    }
+    bulkDest = -1;
+}
+
+void kwp2000::groupMemoryReads()
+{
+    memoryReads.clear();
+    memoryPending = -1;
+
+    for (int i = 0; i < memoryVars.length(); i++) {
+        const memoryVariable &var = memoryVars.at(i);
+        if (!memoryReads.empty()) {
+            memoryRead &last = memoryReads.last();
+            int end = qMax(last.address + last.length, var.address + var.size);
+            if (var.address <= last.address + last.length + maxMemoryGap && end - last.address <= maxMemoryRead) {
+                last.length = end - last.address;
+                last.vars << i;
+                continue;
+            }
+        }
+
+        memoryRead read;
+        read.address = var.address;
+        read.length = var.size;
+        read.vars << i;
+        memoryReads << read;
+    }
+
+    if (!memoryVars.empty()) {
+        emit log("Reading " + QString::number(memoryVars.length()) + " memory variables with " +
+                 QString::number(memoryReads.length()) + " requests", debugMsgLog);
+    }
+}
+
+void kwp2000::memoryDataHandler(const QByteArray &data)
+{
+    int index = memoryPending;
+    memoryPending = -1;
+    if (index < 0 || index >= memoryReads.length()) {
+        readNext();
+        return;
+    }
+
+    const memoryRead &read = memoryReads.at(index);
+    if (data.length() != read.length) {
+        emit log("Warning: Memory read at 0x" + toHex(read.address, 6) + " returned " +
+                 QString::number(data.length()) + " bytes, not " + QString::number(read.length), debugMsgLog);
+        readNext();
+        return;
+    }
+
+    qint64 now = acquisitionClock.elapsed();
+    const quint8 *bytes = reinterpret_cast<const quint8*>(data.constData());
+    for (int i = 0; i < read.vars.length(); i++) {
+        const memoryVariable &var = memoryVars.at(read.vars.at(i));
+        const quint8 *p = bytes + (var.address - read.address);
+
+        quint32 raw = 0;
+        for (int b = 0; b < var.size; b++) {
+            raw |= static_cast<quint32>(p[var.bigEndian ? var.size - 1 - b : b]) << (8 * b);
+        }
+
+        double val = raw;
+        if (var.isSigned && (raw & (Q_UINT64_C(1) << (8 * var.size - 1)))) {
+            val -= static_cast<double>(Q_UINT64_C(1) << (8 * var.size));
+        }
+
+        typedValue tmp = {numberValue, val * var.scale + var.offset, var.units, QString()};
+        queueSampleUpdate(now, firstMemorySample + read.vars.at(i), tmp);
+    }
+    mergeSamples(now - mergeHorizon);
+
+    readNext();
+}
+
+void kwp2000::miscCommand(const QByteArray &cmd)
+{
+    sendRequest(cmd, 0, -1, this, "miscCommandDone");
+}
+
+void kwp2000::miscCommandDone(const kwpResult &result)
+{
+    emit log("Misc command " + toHex(static_cast<quint8>(result.request.at(0))) + ": " + requestStatusText(result));
+}
+
+// Sends data to dest (-1 for the open channel) and returns the request's ID, or -1 if
+// there's no channel to send it on. requestFinished() is emitted with the result and,
+// if given, member (a slot taking a kwpResult) is invoked on receiver. timeout is
+// msecs for the whole exchange, 0 for defaultRequestTimeout.
+int kwp2000::sendRequest(const QByteArray &data, int timeout, int dest, QObject *receiver, const char *member)
+{
+    if (dest < 0) {
+        dest = getChannelDest();
+    }
+    if (data.isEmpty() || dest < 0) {
+        emit log("Error: No channel open to send the request on");
+        return -1;
+    }
+
+    kwpRequest req;
+    req.result.id = nextRequestId++;
+    req.result.dest = dest;
+    req.result.request = data;
+    req.result.status = requestCancelled;
+    req.result.nrc = 0;
+    req.result.msecs = requestClock.elapsed();
+    req.responseSid = static_cast<quint8>(data.at(0)) | 0x40;
+    req.responseParam = (data.length() > 1 && echoesParam(data.at(0))) ? static_cast<quint8>(data.at(1)) : -1;
+    req.deadline = req.result.msecs + (timeout > 0 ? timeout : defaultRequestTimeout);
+    req.receiver = receiver;
+    req.member = member;
+    requests.append(req);
+    startRequestTimer();
+
+    QMetaObject::invokeMethod(tp, "sendDataTo", Qt::QueuedConnection,
+                              Q_ARG(int, dest),
+                              Q_ARG(QByteArray, data),
+                              Q_ARG(int, slowRecvTimeout),
+                              Q_ARG(int, priorityCommand));
+    return req.result.id;
+}
+
+QString kwp2000::requestStatusText(const kwpResult &result)
+{
+    switch (result.status) {
+    case requestPositive:
+        return "response " + QString(result.response.toHex()).toUpper() + " after " + QString::number(result.msecs) + "ms";
+    case requestNegative:
+        return "refused, " + negativeResponse(result.nrc);
+    case requestTimedOut:
+        return "no response after " + QString::number(result.msecs) + "ms";
+    default:
+        return "cancelled, the channel closed";
+    }
+}
+
+// ISO 14230-3 response codes
+QString kwp2000::negativeResponse(quint8 code)
+{
+    switch (code) {
+    case 0x10:
+        return "general reject";
+    case 0x11:
+        return "service not supported";
+    case 0x12:
+        return "sub-function not supported or invalid format";
+    case 0x21:
+        return "busy, repeat request";
+    case 0x22:
+        return "conditions not correct or request sequence error";
+    case 0x23:
+        return "routine not complete";
+    case 0x31:
+        return "request out of range";
+    case 0x33:
+        return "security access denied";
+    case 0x35:
+        return "invalid key";
+    case 0x36:
+        return "exceeded number of attempts";
+    case 0x37:
+        return "required time delay not expired";
+    case 0x40:
+        return "download not accepted";
+    case 0x41:
+        return "improper download type";
+    case 0x42:
+        return "can't download to specified address";
+    case 0x43:
+        return "can't download number of bytes requested";
+    case 0x50:
+        return "upload not accepted";
+    case 0x51:
+        return "improper upload type";
+    case 0x52:
+        return "can't upload from specified address";
+    case 0x53:
+        return "can't upload number of bytes requested";
+    case 0x71:
+        return "transfer suspended";
+    case 0x72:
+        return "transfer aborted";
+    case 0x74:
+        return "illegal address in block transfer";
+    case 0x75:
+        return "illegal byte count in block transfer";
+    case 0x76:
+        return "illegal block transfer type";
+    case 0x77:
+        return "block transfer data checksum error";
+    case 0x78:
+        return "response pending";
+    case 0x79:
+        return "incorrect byte count during block transfer";
+    case 0x80:
+        return "service not supported in active diagnostic session";
+    default:
+        if (code >= 0x90 && code <= 0xF9) {
+            return "manufacturer specific reason " + toHex(code);
+        }
+        return "negative response " + toHex(code);
+    }
+}
+
+// Services whose positive response starts with the request's first parameter
+bool kwp2000::echoesParam(quint8 sid)
+{
+    switch (sid) {
+    case 0x10: // startDiagnosticSession
+    case 0x1A: // readEcuIdentification
+    case 0x21: // readDataByLocalIdentifier
+    case 0x22: // readDataByCommonIdentifier, first byte of the identifier
+    case 0x27: // securityAccess
+    case 0x2C: // dynamicallyDefineLocalIdentifier
+    case 0x30: // inputOutputControlByLocalIdentifier
+    case 0x31: // startRoutineByLocalIdentifier
+    case 0x32: // stopRoutineByLocalIdentifier
+    case 0x33: // requestRoutineResultsByLocalIdentifier
+    case 0x3B: // writeDataByLocalIdentifier
+    case 0x83: // accessTimingParameters
+        return true;
+    default:
+        return false;
+    }
+}
+
+// A 7F xx 78 (response pending) gives the request longer rather than finishing it
+// The parameter is only part of the key for the services that echo it
+int kwp2000::internalKey(int dest, quint8 sid, quint8 param)
+{
+    return (dest << 16) | (sid << 8) | (echoesParam(sid) ? param : 0);
+}
+
+void kwp2000::sendInternal(int dest, const QByteArray &data, int timeout, int priority)
+{
+    if (data.isEmpty()) {
+        return;
+    }
+
+    internalPending[internalKey(dest, data.at(0), data.length() > 1 ? data.at(1) : 0)]++;
+    internalSent[dest].append(data);
+    QMetaObject::invokeMethod(tp, "sendDataTo", Qt::QueuedConnection,
+                              Q_ARG(int, dest),
+                              Q_ARG(QByteArray, data),
+                              Q_ARG(int, timeout),
+                              Q_ARG(int, priority));
+}
+
+// A negative response could be for any internal request for the service
+bool kwp2000::internalWaiting(int dest, const tpMessage &msg) const
+{
+    quint8 sid = msg.at(0);
+    if (sid != 0x7F) {
+        return internalPending.value(internalKey(dest, sid & ~0x40, msg.length() > 1 ? msg.at(1) : 0)) > 0;
+    }
+    else if (msg.length() < 2) {
+        return false;
+    }
+
+    int first = internalKey(dest, msg.at(1), 0);
+    QMap<int, int>::const_iterator it = internalPending.lowerBound(first);
+    return it != internalPending.constEnd() && it.key() <= (first | 0xFF);
+}
+
+// Returns the request msg answers, empty if it wasn't one of them. tp20 answers each
+// destination in order, so a negative response is for the oldest request for its service.
+QByteArray kwp2000::internalAnswered(int dest, const tpMessage &msg)
+{
+    if (msg.length() < 1 || internalPending.empty()) {
+        return QByteArray();
+    }
+
+    quint8 sid = msg.at(0);
+    if (sid == 0x7F && (msg.length() < 2 || (msg.length() > 2 && msg.at(2) == 0x78))) {
+        return QByteArray(); // the real answer follows
+    }
+
+    QMap<int, QList<QByteArray> >::iterator sentIt = internalSent.find(dest);
+    if (sentIt == internalSent.end()) {
+        return QByteArray();
+    }
+
+    QByteArray request;
+    QList<QByteArray> &sent = sentIt.value();
+    for (int i = 0; i < sent.size(); i++) {
+        const QByteArray &req = sent.at(i);
+        if (sid == 0x7F ? static_cast<quint8>(req.at(0)) == msg.at(1) :
+                internalKey(dest, req.at(0), req.length() > 1 ? req.at(1) : 0) ==
+                internalKey(dest, sid & ~0x40, msg.length() > 1 ? msg.at(1) : 0)) {
+            request = sent.takeAt(i);
+            break;
+        }
+    }
+    if (request.isEmpty()) {
+        return request;
+    }
+
+    QMap<int, int>::iterator it = internalPending.find(internalKey(dest, request.at(0), request.length() > 1 ? request.at(1) : 0));
+    if (it != internalPending.end() && --it.value() <= 0) {
+        internalPending.erase(it);
+    }
+    return request;
+}
+
+// For requests that will never be answered now, -1 for every destination or service
+void kwp2000::forgetInternal(int dest, int sid)
+{
+    QMap<int, int>::iterator it = internalPending.begin();
+    while (it != internalPending.end()) {
+        if ((sid < 0 || ((it.key() >> 8) & 0xFF) == sid) && (dest < 0 || (it.key() >> 16) == dest)) {
+            it = internalPending.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+
+    QMap<int, QList<QByteArray> >::iterator sent;
+    for (sent = internalSent.begin(); sent != internalSent.end(); ++sent) {
+        if (dest >= 0 && sent.key() != dest) {
+            continue;
+        }
+        for (int i = 0; i < sent.value().size(); i++) {
+            if (sid < 0 || static_cast<quint8>(sent.value().at(i).at(0)) == sid) {
+                sent.value().removeAt(i--);
+            }
+        }
+    }
+}
+
+bool kwp2000::claimResponse(int dest, const tpMessage &msg)
+{
+    if (msg.length() < 1 || internalWaiting(dest, msg)) {
+        return false;
+    }
+
+    quint8 sid = msg.at(0);
+    bool negative = (sid == 0x7F);
+    if (negative && msg.length() < 3) {
+        return false;
+    }
+
+    for (int i = 0; i < requests.size(); i++) {
+        kwpRequest &req = requests[i];
+        if (req.result.dest != dest) {
+            continue;
+        }
+
+        if (negative) {
+            if (msg.at(1) != static_cast<quint8>(req.result.request.at(0))) {
+                continue;
+            }
+            if (msg.at(2) == 0x78) {
+                req.deadline = requestClock.elapsed() + responsePendingTimeout;
+                startRequestTimer();
+                return true;
+            }
+            req.result.nrc = msg.at(2);
+        }
+        else if (sid != req.responseSid ||
+                 (req.responseParam >= 0 && (msg.length() < 2 || msg.at(1) != req.responseParam))) {
+            continue;
+        }
+
+        req.result.response = QByteArray(msg.constData(), msg.length()); // the message goes back to the pool
+        completeRequest(requests.takeAt(i), negative ? requestNegative : requestPositive);
+        return true;
+    }
+
+    return false;
+}
+
+// req has already been taken out of requests
+void kwp2000::completeRequest(kwpRequest req, int status)
+{
+    req.result.status = status;
+    req.result.msecs = requestClock.elapsed() - req.result.msecs;
+    startRequestTimer();
+
+    if (req.receiver && !req.member.isEmpty()) {
+        QMetaObject::invokeMethod(req.receiver, req.member.constData(), Qt::QueuedConnection,
+                                  Q_ARG(kwpResult, req.result));
+    }
+
+    emit requestFinished(req.result);
+}
+
+// Every request to dest, or all of them for -1. They're all taken out before any
+// is completed, a receiver may send another request.
+void kwp2000::cancelRequests(int dest)
+{
+    QList<kwpRequest> cancelled;
+    for (int i = 0; i < requests.size(); i++) {
+        if (dest < 0 || requests.at(i).result.dest == dest) {
+            cancelled << requests.takeAt(i--);
+        }
+    }
+
+    for (int i = 0; i < cancelled.size(); i++) {
+        completeRequest(cancelled.at(i), requestCancelled);
+    }
+}
+
+void kwp2000::startRequestTimer()
+{
+    if (requests.empty()) {
+        requestTimer.stop();
+        return;
+    }
+
+    qint64 earliest = requests.first().deadline;
+    for (int i = 1; i < requests.size(); i++) {
+        earliest = qMin(earliest, requests.at(i).deadline);
+    }
+    requestTimer.start(qMax(earliest - requestClock.elapsed(), Q_INT64_C(0)));
+}
+
+void kwp2000::requestTimeout()
+{
+    qint64 now = requestClock.elapsed();
+    QList<kwpRequest> expired;
+    for (int i = 0; i < requests.size(); i++) {
+        if (requests.at(i).deadline <= now) {
+            expired << requests.takeAt(i--);
+        }
+    }
+
+    for (int i = 0; i < expired.size(); i++) {
+        completeRequest(expired.at(i), requestTimedOut);
+    }
+    startRequestTimer();
+}
+
+void kwp2000::changeSampleFormat()
+{
+    dynamicDefined = false; // the open blocks have changed
+
+    // anything still waiting to be merged refers to the old layout
+    mergeSamples(acquisitionClock.elapsed());
+    pendingUpdates.clear();
+    sample.clear();
+
+    QList<int> openBlocks = currentBlocks.keys();
+    for (int i = 0; i < openBlocks.length(); i++) {
+        int blockNum = openBlocks.at(i);
+
+        for (int pos = 0; pos < 4; pos++) {
+            blockRef tmpRef = {blockNum, pos};
+
+            bool matchFound = false;
+
+            // check and see if an equivilent channel already exists
+            if (pos == 0 && blockLabels[blockNum].desc[0].toLower() == "engine speed") {
+                for (int sampleNum = 0; sampleNum < sample.size(); sampleNum++) {
+                    int existingBlock = sample.ref(sampleNum).blockNum;
+                    int existingPos = sample.ref(sampleNum).pos;
+
+                    if (existingPos == 0 && blockLabels[existingBlock].desc[0].toLower() == "engine speed") {
+                        matchFound = true;
+                        currentBlocks[blockNum][pos].indexToSampleValue = sampleNum;
+                    }
+                }
+            }
+
+            if (!matchFound) {
+                currentBlocks[blockNum][pos].indexToSampleValue = sample.append(tmpRef);
+            }
+        }
+    }
+
+    // then the values from the other modules
+    extraValues.clear();
+    firstExtraSample = sample.size();
+    QMap<int, QList<int> >::const_iterator it;
+    for (it = extraBlocks.constBegin(); it != extraBlocks.constEnd(); ++it) {
+        for (int i = 0; i < it.value().length(); i++) {
+            for (int pos = 0; pos < 4; pos++) {
+                extraValue extra = {it.key(), it.value().at(i), pos};
+                blockRef tmpRef = {extraBlock, extraValues.length()};
+                extraValues.append(extra);
+                sample.append(tmpRef);
+            }
+        }
+    }
+
+    // then the memory variables, in address order
+    firstMemorySample = sample.size();
+    for (int i = 0; i < memoryVars.length(); i++) {
+        blockRef tmpRef = {memoryBlock, i};
+        sample.append(tmpRef, memoryVars.at(i).units);
+    }
+
+    // broadcast signals follow the block values, in the order they appear in the DBC file
+    firstBroadcastSample = sample.size();
+    for (int i = 0; i < broadcastDecoder.getNumSignals(); i++) {
+        blockRef tmpRef = {broadcastBlock, i};
+        sample.append(tmpRef, sampleStore::internUnits(broadcastDecoder.getSignal(i).units));
+    }
+
+    emit sampleFormatChanged();
+}
+
+void kwp2000::startLogging()
+{
+    QDir(".").mkdir("Logs");
+
+    logFileName = "Logs/" + QDateTime::currentDateTime().toString("yyyy-MM-dd_HH-mm-ss") + ".csv";
+
+    logFile = new QFile(logFileName, this);
+    logFile->open(QIODevice::WriteOnly | QIODevice::Text);
+    logOut.setDevice(logFile);
+
+    // print header
+    logOut << "Time";
+    for (int i = 0; i < sample.size(); i++) {
+        logOut << "," + getSampleDesc(i);
+        logOut << " [" + getSampleUnits(i) + "]";
+    }
+    logOut << endl;
+    logOut.flush();
+    logFlushed.start();
+
+    logStartTime = QTime::currentTime();
+    logStartClock = acquisitionClock.elapsed();
+
+    emit loggingStarted();
+}
+
+void kwp2000::stopLogging()
+{
+    mergeSamples(acquisitionClock.elapsed());
+
+    logOut.flush();
+    logOut.setDevice(0);
+    logFile->close();
+    delete logFile;
+    logFile = 0;
+}
+
+void kwp2000::loadLabelFile()
+{
+    if (modulePartNum.empty()) {
+        emit labelsLoaded(false);
+        return;
+    }
+
+    QString partNum;
+    int end = modulePartNum.at(0).indexOf(QChar(' '));
+    if (end < 0) {
+        partNum = modulePartNum.at(0);
+    }
+    else {
+        partNum = modulePartNum.at(0).left(end);
+    }
+
+    QStringList partSplit;
+    for (int i = 0; i < partNum.length(); i += 3) {
+        partSplit << partNum.mid(i, 3);
+    }
+    partNum = partSplit.join("-");
+
+    if (labelDir.length() == 0) {
+        emit labelsLoaded(false);
+        return;
+    }
+
+    QDir dir(labelDir);
+    if (!dir.exists()) {
+        emit labelsLoaded(false);
+        return;
+    }
+
+    labelFileName = dir.absolutePath() + "/User/" + partNum + ".lbl";
+    labelFile = new QFile(labelFileName, this);
+
+    // try to find labels from direct part name
+    // check user folder first, then root label dir
+    if (!labelFile->exists()) {
+        labelFileName = dir.absolutePath() + "/" + partNum + ".lbl";
+        labelFile->setFileName(labelFileName);
+
+        if (!labelFile->exists()) {
+            // try to find labels from redirect files
+            // check user folder first, then root label dir
+            QString fileName = findLabelFromRedir(partNum, dir.absolutePath() + "/User");
+            if (fileName.length() == 0) {
+                fileName = findLabelFromRedir(partNum, dir.absolutePath());
+            }
+            if (fileName.length() == 0) {
+                emit labelsLoaded(false);
+                return;
+            }
+
+            // got label file name from redirect, now find file in user or root dir
+            labelFileName = dir.absolutePath() + "/User/" + fileName;
+            labelFile->setFileName(labelFileName);
+
+            if (!labelFile->exists()) {
+                labelFileName = dir.absolutePath() + "/" + fileName;
+                labelFile->setFileName(labelFileName);
+
+                if (!labelFile->exists()) {
+                    emit labelsLoaded(false);
+                    return;
+                }
+            }
+        }
+    }
+
+    labelFile->open(QIODevice::ReadOnly);
+    labelIn.setDevice(labelFile);
+
+    int blockNum = -1;
+    int pos = -1;
+    while(!labelIn.atEnd()) {
+        QString line = labelIn.readLine();
+        if (line.length() > 0) {
+            char firstChar = line.at(0).toAscii();
+            if (firstChar >= 48 && firstChar <= 57) {
+                bool ok;
+
+                QStringList parts = line.split(QChar(','));
+                if (parts.length() < 3) {
+                    continue;
+                }
+
+                blockNum = parts.at(0).toInt(&ok);
+                if (!ok || blockNum < 0 || blockNum > 255) {
+                    continue;
+                }
+
+                pos = parts.at(1).toInt(&ok);
+                if (!ok || pos < 0 || pos > 4) {
+                    continue;
+                }
+
+                if (!blockLabels.contains(blockNum)) {
+                    blockLabels_t newBlockLabel;
+                    blockLabels.insert(blockNum, newBlockLabel);
+                }
+
+                if (pos == 0) {
+                    blockLabels[blockNum].blockName = parts.at(2);
+                    continue;
+                }
+
+                blockLabels[blockNum].desc[pos-1] = parts.at(2);
+                if (parts.length() > 3) {
+                    blockLabels[blockNum].subDesc[pos-1] = parts.at(3);
+                }
+                if (parts.length() > 4) {
+                    QString longDesc = parts.at(4);
+                    blockLabels[blockNum].longDesc[pos-1] = longDesc.replace("\\n", "\n");
+                }
+            }
+
+            // binary description
+            if (firstChar == ';' && line.contains(QChar('='))) {
+                if (blockNum < 0 || blockNum > 255 || pos < 0 || pos > 4) {
+                    continue;
+                }
+                if (!blockLabels.contains(blockNum)) {
+                    continue;
+                }
+                blockLabels[blockNum].binDesc[pos-1] += line.mid(2) + '\n';
+            }
+        }
+    }
+
+    if (blockLabels.count() > 0) {
+        emit labelsLoaded(true);
+    }
+    else {
+        emit labelsLoaded(false);
+    }
+
+    labelIn.setDevice(0);
+    labelFile->close();
+    delete labelFile;
+    labelFile = 0;
+}
+
+void kwp2000::openGW_refresh(bool ok)
+{
+    if (ok && !reconnecting) {
+        doModuleRefresh = true;
+        QMetaObject::invokeMethod(tp, "openChannel", Qt::QueuedConnection,
+                                  Q_ARG(int, 31),
+                                  Q_ARG(int, normRecvTimeout));
+    }
+}
+
+void kwp2000::loadBroadcastSignals(const QString &dbcFile, const QStringList &names)
+{
+    if (mon->getMonitoring()) {
+        emit log("Broadcast signals can't be changed while monitoring");
+        return;
+    }
+
+    if (dbcFile.isEmpty()) {
+        if (broadcastDecoder.getNumSignals() > 0) {
+            broadcastDecoder.clear();
+            changeSampleFormat();
+        }
+        return;
+    }
+
+    if (broadcastDecoder.load(dbcFile, names)) {
+        emit log("Loaded " + QString::number(broadcastDecoder.getNumSignals()) +
+                 " broadcast signals from " + QFileInfo(dbcFile).fileName());
+    }
+    if (!broadcastDecoder.getError().isEmpty()) {
+        emit log("Warning: " + broadcastDecoder.getError());
+    }
+
+    changeSampleFormat();
+}
+
+void kwp2000::startMonitor()
+{
+    if (mon->getMonitoring()) {
+        return;
+    }
+
+    if (!getElmInitialised() || getChannelDest() >= 0) {
+        emit log("Close the module before monitoring broadcast signals");
+        emit monitoringChanged(false);
+        return;
+    }
+
+    if (broadcastDecoder.getNumSignals() == 0) {
+        emit log("Warning: No broadcast signals loaded, frames will only be written to the capture file");
+    }
+
+    // the monitor needs the ELM327 to itself, tp20 runs it once it's idle
+    QMetaObject::invokeMethod(tp, "runExclusive", Qt::QueuedConnection,
+                              Q_ARG(QObject*, mon),
+                              Q_ARG(QByteArray, "start"),
+                              Q_ARG(int, 0)); // no channels are open to keep alive
+    emit monitoringChanged(true);
+}
+
+void kwp2000::stopMonitor()
+{
+    mon->stop();
+}
+
+void kwp2000::monitorDone()
+{
+    emit monitoringChanged(false);
+}
+
+// Reads UDS identifiers from a module on ISO-TP, spec is the module's request ID then
+// the DIDs in hex, eg. "7E0: F187 F189 F190". The response ID is the request ID + 8
+// unless given as "7E0/7E8: ...".
+void kwp2000::readIdentifiers(const QString &spec)
+{
+    if (!getElmInitialised()) {
+        emit log("Open the port before reading UDS identifiers");
+        return;
+    }
+
+    QRegExp format("^\\s*([0-9A-Fa-f]{3})(?:\\s*/\\s*([0-9A-Fa-f]{3}))?\\s*:(.*)$");
+    if (!format.exactMatch(spec)) {
+        emit log("Error: UDS identifiers should be given as module ID: DIDs, eg. 7E0: F190");
+        return;
+    }
+
+    int txID = fromHex(format.cap(1));
+    int rxID = format.cap(2).isEmpty() ? txID + 8 : fromHex(format.cap(2));
+
+    QList<int> dids;
+    QStringList didStrs = format.cap(3).split(QRegExp("[\\s,;]+"), QString::SkipEmptyParts);
+    for (int i = 0; i < didStrs.length(); i++) {
+        bool ok;
+        int did = didStrs.at(i).toInt(&ok, 16);
+        if (!ok || did < 0 || did > 0xFFFF) {
+            emit log("Error: " + didStrs.at(i) + " is not a UDS identifier");
+            return;
+        }
+        dids << did;
+    }
+
+    udsClient->readDIDs(txID, rxID, dids);
+}
+
+void kwp2000::udsData(int txID, const QMap<int, QByteArray> &values)
+{
+    QMap<int, QByteArray>::const_iterator it;
+    for (it = values.constBegin(); it != values.constEnd(); ++it) {
+        const QByteArray &data = it.value();
+        bool printable = !data.isEmpty();
+        QString hex;
+        for (int i = 0; i < data.length(); i++) {
+            quint8 byte = data.at(i);
+            printable = printable && byte >= 0x20 && byte < 0x7F;
+            hex += toHex(byte) + " ";
+        }
+        emit log(toHex(txID, 3) + " " + toHex(it.key(), 4) + ": " +
+                 (printable ? QString::fromAscii(data.constData(), data.length()).trimmed() : hex.trimmed()));
+    }
+}
+
+void kwp2000::broadcastData(const broadcastBatch &batch)
+{
+    if (firstBroadcastSample + broadcastDecoder.getNumSignals() > sample.size()) {
+        return; // sample format changed while the batch was queued
+    }
+
+    int pos = 0;
+    for (int f = 0; f < batch.canIDs.size(); f++) {
+        const QVector<int> &frameSignals = broadcastDecoder.getSignalsForID(batch.canIDs.at(f));
+        if (pos + frameSignals.size() > batch.values.size()) {
+            return;
+        }
+        for (int i = 0; i < frameSignals.size(); i++) {
+            int sig = frameSignals.at(i);
+            typedValue val = {numberValue, batch.values.at(pos++), sample.units(firstBroadcastSample + sig), QString()};
+            queueSampleUpdate(batch.times.at(f), firstBroadcastSample + sig, val);
+        }
+    }
+
+    mergeSamples(acquisitionClock.elapsed() - mergeHorizon);
+}
+
+void kwp2000::setMonitorWindow(int window, int interval)
+{
+    monitorWindow = window;
+    monitorInterval = interval;
+}
+
+void kwp2000::monitorWindowDone()
+{
+    if (windowLeft > 0 && getChannelDest() >= 0) {
+        monitorWindowPart();
+        return;
+    }
+
+    windowLeft = 0;
+    inMonitorWindow = false;
+    lastMonitorWindow.restart();
+    readBlocks();
+}
+
+// Called after each block response. When monitor windows are enabled and due the
+// broadcast IDs are monitored for a short time in between block reads.
+void kwp2000::readNext()
+{
+    if (monitorWindow > 0 && broadcastDecoder.getNumSignals() > 0 && getChannelDest() >= 0 &&
+            lastMonitorWindow.elapsed() >= monitorInterval) {
+        readBlockTimer.stop();
+        inMonitorWindow = true;
+        windowLeft = monitorWindow;
+        monitorWindowPart();
+        return;
+    }
+
+    readBlocks();
+}
+
+// The tp thread is blocked for the whole part, it is kept to half the keep alive
+// interval so the filter changes either side still leave the channels time
+void kwp2000::monitorWindowPart()
+{
+    QList<int> ids = broadcastDecoder.getCanIDs();
+    int mask = 0x7FF;
+    for (int i = 1; i < ids.length(); i++) {
+        mask &= ~(ids.at(i) ^ ids.at(0));
+    }
+
+    int part = qMin(windowLeft, qMax(keepAliveInterval / 2, 1));
+    windowLeft -= part;
+    mon->setWindow(part, ids.at(0) & mask, mask, tp->getRecvCanID());
+    QMetaObject::invokeMethod(tp, "runExclusive", Qt::QueuedConnection,
+                              Q_ARG(QObject*, mon),
+                              Q_ARG(QByteArray, "window"),
+                              Q_ARG(int, part));
+}
+
+void kwp2000::readBlocks()
+{
+    scheduleTimer.stop();
+    if (inMonitorWindow || sweeping || reconnecting || readsPaused) {
+        return;
+    }
+
+    int id;
+    bool periodic = periodicMode > 0 && periodicState != periodicRefused && periodicCandidate(id);
+    if (periodicState == periodicRunning && (!periodic || id != periodicId)) {
+        stopPeriodic(); // the blocks changed
+    }
+
+    if (useDynamicIdentifier() && !dynamicDefined) {
+        defineDynamicIdentifier();
+        return;
+    }
+
+    if (periodic) {
+        if (periodicState == periodicOff) {
+            startPeriodic(id);
+            return;
+        }
+        if (periodicState == periodicStarting) {
+            readBlockTimer.start(readWatchdog);
+            return;
+        }
+    }
+
+    // the open blocks, the ones without a rate all at once if they can be, then the
+    // blocks on the other modules and the memory reads
+    QList<readTarget> targets;
+    QList<int> blocks = currentBlocks.keys();
+    bool covered = periodicState == periodicRunning || useDynamicIdentifier();
+    if (useDynamicIdentifier() && periodicState != periodicRunning) {
+        readTarget target = {getChannelDest(), 0, dynamicIdentifier, 0};
+        targets << target;
+    }
+    for (int i = 0; i < blocks.length(); i++) {
+        double rate = blockRate(0, blocks.at(i));
+        if (rate <= 0 && covered) {
+            continue; // the module sends it by itself or it's in the dynamic identifier
+        }
+        readTarget target = {getChannelDest(), 0, blocks.at(i), rate};
+        targets << target;
+    }
+    for (int i = 0; i < extraOpen.length(); i++) {
+        int module = extraChannels.value(extraOpen.at(i));
+        QList<int> moduleBlocks = extraBlocks.value(module);
+        for (int j = 0; j < moduleBlocks.length(); j++) {
+            readTarget target = {extraOpen.at(i), module, moduleBlocks.at(j), blockRate(module, moduleBlocks.at(j))};
+            targets << target;
+        }
+    }
+    for (int i = 0; i < memoryReads.length(); i++) {
+        readTarget target = {getChannelDest(), memoryModule, i, 0};
+        targets << target;
+    }
+
+    if (targets.empty() && periodicState != periodicRunning) {
+        nextBlock = 0;
+        readingBlocks = false;
+        return;
+    }
+
+    // the rated block furthest past its deadline, otherwise the next unrated one
+    qint64 now = acquisitionClock.elapsed();
+    int pick = -1;
+    qint64 pickDue = 0;
+    int samePick = -1; // the same on the channel read last
+    qint64 samePickDue = 0;
+    qint64 nextDue = -1;
+    QList<int> unrated;
+    for (int i = 0; i < targets.length(); i++) {
+        const readTarget &target = targets.at(i);
+        qint64 backoff = target.module == memoryModule ? 0 : readBackoff.value((target.dest << 8) | target.blockNum, 0);
+        if (backoff > now) {
+            if (nextDue < 0 || backoff < nextDue) {
+                nextDue = backoff;
+            }
+            continue;
+        }
+        if (target.rate <= 0) {
+            unrated << i;
+            continue;
+        }
+
+        qint64 due = readDue.value((target.dest << 8) | target.blockNum, now);
+        if (due <= now && target.dest == lastReadDest && (samePick < 0 || due < samePickDue)) {
+            samePick = i;
+            samePickDue = due;
+        }
+        if (due <= now && (pick < 0 || due < pickDue)) {
+            pick = i;
+            pickDue = due;
+        }
+        else if (due > now && (nextDue < 0 || due < nextDue)) {
+            nextDue = due;
+        }
+    }
+
+    if (samePick >= 0 && samePickDue - pickDue <= channelSwitchSlack) {
+        pick = samePick;
+        pickDue = samePickDue;
+    }
+
+    if (pick < 0 && !unrated.empty()) {
+        if (nextBlock >= unrated.length()) {
+            nextBlock = 0;
+        }
+        pick = unrated.at(nextBlock++);
+    }
+
+    if (pick < 0) {
+        if (nextDue >= 0) {
+            scheduleTimer.start(nextDue - now);
+        }
+        if (periodicState == periodicRunning) {
+            readBlockTimer.start(readWatchdog); // notices if the module stops sending
+        }
+        else {
+            readBlockTimer.stop();
+        }
+        return;
+    }
+
+    const readTarget &target = targets.at(pick);
+    if (target.rate > 0) {
+        // a block that fell behind is read as soon as it can be, not in a burst to catch up
+        readDue.insert((target.dest << 8) | target.blockNum,
+                       qMax(pickDue + static_cast<qint64>(1000 / target.rate), now));
     }
 
     QByteArray packet;
-    packet.append(0x21);
-    packet.append(openBlocks.at(nextBlock++));
+    if (target.module == memoryModule) {
+        const memoryRead &read = memoryReads.at(target.blockNum);
+        packet.append(0x23);
+        packet.append(read.address >> 16);
+        packet.append(read.address >> 8);
+        packet.append(read.address);
+        packet.append(read.length);
+        memoryPending = target.blockNum;
+    }
+    else {
+        packet.append(0x21);
+        packet.append(target.blockNum);
+    }
 
-    QMetaObject::invokeMethod(tp, "sendData", Qt::QueuedConnection,
-                              Q_ARG(QByteArray, packet),
-                              Q_ARG(int, fastRecvTimeout));
-    readBlockTimer.start();
+    lastReadDest = target.dest;
+    sendInternal(target.dest, packet, fastRecvTimeout, priorityBlockRead);
+    readBlockTimer.start(readBlockWatchdog(target.dest));
+}
+
+void kwp2000::scheduleTimeout()
+{
+    if (readingBlocks) {
+        readBlocks();
+    }
+}
+
+// Target rates in reads per second, eg. "7:10; 2:1" reads block 7 ten times a
+// second and block 2 once. Other modules are given as hex module/block, eg. "02/4:1".
+// Blocks not listed are read as often as the link allows.
+void kwp2000::setBlockRates(const QString &spec)
+{
+    QMap<int, double> rates;
+
+    QStringList entries = spec.split(QChar(';'), QString::SkipEmptyParts);
+    for (int i = 0; i < entries.length(); i++) {
+        QStringList parts = entries.at(i).split(QChar(':'));
+        QStringList ref = parts.at(0).split(QChar('/'));
+        bool ok = parts.length() == 2 && ref.length() <= 2;
+        int module = 0;
+        if (ok && ref.length() == 2) {
+            module = ref.at(0).trimmed().toInt(&ok, 16);
+            ok = ok && module > 0 && module <= 0xFF;
+        }
+        int blockNum = ok ? ref.last().trimmed().toInt(&ok) : -1;
+        double rate = ok ? parts.at(1).trimmed().toDouble(&ok) : 0;
+        if (!ok || blockNum < 0 || blockNum > 255 || rate < 0) {
+            emit log("Warning: Could not read the block rate " + entries.at(i).trimmed());
+            continue;
+        }
+
+        if (rate > 0) {
+            rates.insert((module << 8) | blockNum, rate);
+        }
+    }
+
+    if (rates == blockRates) {
+        return;
+    }
+
+    blockRates = rates;
+    readDue.clear();
+    dynamicDefined = false; // it only holds the blocks without a rate
+}
+
+double kwp2000::blockRate(int module, int blockNum) const
+{
+    return blockRates.value((module << 8) | blockNum, 0);
+}
+
+// the open blocks read as often as possible
+QList<int> kwp2000::unratedBlocks() const
+{
+    QList<int> blocks;
+    QMap<int, QVector<blockValue> >::const_iterator it;
+    for (it = currentBlocks.constBegin(); it != currentBlocks.constEnd(); ++it) {
+        if (blockRate(0, it.key()) <= 0) {
+            blocks << it.key();
+        }
+    }
+    return blocks;
+}
+
+// responses a second for an open block over the last rateReportInterval
+double kwp2000::getBlockRate(int blockNum) const
+{
+    return achievedRates.value(blockNum, 0);
+}
+
+void kwp2000::countRead(int module, int blockNum)
+{
+    readCounts[(module << 8) | blockNum]++;
+
+    qint64 elapsed = rateClock.elapsed();
+    if (elapsed < rateReportInterval) {
+        return;
+    }
+
+    QList<int> blocks = currentBlocks.keys();
+    for (int i = 0; i < blocks.length(); i++) {
+        if (!readCounts.contains(blocks.at(i))) {
+            readCounts.insert(blocks.at(i), 0); // starved blocks are reported too
+        }
+    }
+
+    achievedRates.clear();
+    QStringList report;
+    QMap<int, int>::const_iterator it;
+    for (it = readCounts.constBegin(); it != readCounts.constEnd(); ++it) {
+        double rate = it.value() * 1000.0 / elapsed;
+        achievedRates.insert(it.key(), rate);
+
+        QString name = (it.key() >> 8) ? toHex(it.key() >> 8) + "/" : QString();
+        double target = blockRates.value(it.key(), 0);
+        report << name + QString::number(it.key() & 0xFF) + " " + QString::number(rate, 'f', 1) + "/s" +
+                  (target > 0 ? " (" + QString::number(target) + ")" : QString());
+    }
+    emit log("Block rates: " + report.join(", "), debugMsgLog);
+
+    readCounts.clear();
+    rateClock.restart();
 }
 
-void kwp2000::recvKWP(QByteArray *data)
+void kwp2000::recvKWP(int dest, const tpMessage &msg)
 {
-    if (!data) {
+    if (!requests.empty() && claimResponse(dest, msg)) {
+        return;
+    }
+    QByteArray answered = internalAnswered(dest, msg);
+
+    if (extraOpen.contains(dest) && dest != getChannelDest()) {
+        if (msg.length() < 2) {
+            emit log("Error: Received malformed KWP data from module 0x" + toHex(extraChannels.value(dest)));
+            return;
+        }
+        extraResponse(dest, msg.at(0), msg.at(1), msg.bytes(2));
+        return;
+    }
+
+    if (msg.isNull()) {
         emit log("Error: Received empty KWP data");
         QMetaObject::invokeMethod(tp, "closeChannel", Qt::BlockingQueuedConnection);
         return;
     }
 
-    if (data->length() < 2) {
+    if (msg.length() < 2) {
         emit log("Error: Received malformed KWP data");
         QMetaObject::invokeMethod(tp, "closeChannel", Qt::BlockingQueuedConnection);
-        delete data;
         return;
     }
 
-    quint8 respCode = static_cast<quint8>(data->at(0));
-    quint8 param = static_cast<quint8>(data->at(1));
-    data->remove(0,2);
+    quint8 respCode = msg.at(0);
+    quint8 param = msg.at(1);
+    QByteArray data = msg.bytes(2); // points into msg, no copy
+
+    bool pending = respCode == 0x7F && data.length() > 0 && static_cast<quint8>(data.at(0)) == 0x78;
+    if (sweeping && ((respCode == 0x7F && param == 0x1A && !pending) || (respCode == 0x5A && param == 0x9B))) {
+        sweepResponse(data, respCode);
+        return;
+    }
 
     if (respCode == 0x7F) {
+        if (data.length() > 0 && static_cast<quint8>(data.at(0)) == 0x78) {
+            emit log("Module is still working on the " + toHex(param) + " command", debugMsgLog);
+            return; // the real answer follows
+        }
+
         emit log("Warning: Received negative KWP response to " + toHex(param) + " command");
-        if (data->length() > 0) {
-            quint8 reasonCode = static_cast<quint8>(data->at(0));
+        if (data.length() > 0) {
+            quint8 reasonCode = static_cast<quint8>(data.at(0));
             emit log("Reason code " + toHex(reasonCode));
         }
-        delete data;
+        if (reconnecting && param == 0x10) {
+            startDiagHandler(data, param); // read the blocks anyway, some work outside the session
+        }
+        if (param == 0x21 && periodicState == periodicStarting) {
+            emit log("Module does not support periodic transmission, polling blocks");
+            periodicState = periodicRefused;
+            QMetaObject::invokeMethod(tp, "setListening", Qt::QueuedConnection, Q_ARG(int, -1));
+            readNext();
+        }
+        else if (param == 0x2C && dynamicClearing) {
+            dynamicClearing = false; // there was nothing to clear, the definition follows
+        }
+        else if (param == 0x2C) {
+            emit log("Module does not support dynamic identifiers, reading blocks one at a time");
+            dynamicSupported = 0;
+            dynamicDefined = false;
+            pendingLayout.clear();
+            readNext();
+        }
+        else if (param == 0x21 && dynamicDefined && answered.length() == 2 &&
+                 static_cast<quint8>(answered.at(1)) == dynamicIdentifier) { // the definition may have been lost, try once more
+            if (dynamicRetried) {
+                dynamicGiveUp();
+            }
+            else {
+                dynamicRedefine();
+            }
+            readNext();
+        }
+        else if (param == 0x21 && answered.length() == 2) {
+            // only the refused block, the others carry on
+            int blockNum = static_cast<quint8>(answered.at(1));
+            emit log("Warning: Module refused to read block " + QString::number(blockNum) + ", trying it again in " +
+                     QString::number(refusedReadBackoff / 1000) + "s");
+            readBackoff.insert((dest << 8) | blockNum, acquisitionClock.elapsed() + refusedReadBackoff);
+            readNext();
+        }
+        else if (param == 0x23 && memoryPending >= 0) {
+            const memoryRead &read = memoryReads.at(memoryPending);
+            emit log("Warning: Module refused to read " + QString::number(read.length) + " bytes at 0x" +
+                     toHex(read.address, 6) + ", no longer reading it");
+            for (int i = 0; i < read.vars.length(); i++) {
+                memoryVars[read.vars.at(i)].name += " (refused)";
+            }
+            memoryReads.removeAt(memoryPending);
+            memoryPending = -1;
+            readNext();
+        }
         return;
     }
 
@@ -558,82 +1958,337 @@ void kwp2000::recvKWP(QByteArray *data)
         }
         break;
     case 0x61:
-        blockDataHandler(data, param);
+        if (param == periodicStopId) { // answer to the stop, the values may be stale
+            periodicStopId = -1;
+            break;
+        }
+        if (periodicState == periodicStarting && param == periodicId) {
+            emit log("Module is sending " + (param == dynamicIdentifier ? QString("the blocks") :
+                                             "block " + QString::number(param)) + " periodically");
+            periodicState = periodicRunning;
+        }
+        if (param == dynamicIdentifier && dynamicDefined) {
+            dynamicDataHandler(data);
+        }
+        else {
+            blockDataHandler(data, param);
+        }
+        break;
+    case 0x63: // readMemoryByAddress has no parameter, the data starts straight away
+        memoryDataHandler(msg.bytes(1));
+        break;
+    case 0x6C:
+        if (param == dynamicIdentifier && dynamicClearing) {
+            dynamicClearing = false;
+        }
+        else if (param == dynamicIdentifier && !pendingLayout.empty()) {
+            emit log("Reading " + QString::number(pendingLayout.size() / 4) + " blocks with one request", debugMsgLog);
+            dynamicSupported = 1;
+            dynamicDefined = true;
+            dynamicLayout = pendingLayout;
+            pendingLayout.clear();
+            readNext();
+        }
         break;
     default:
         miscHandler(data, respCode, param);
         break;
     }
-}
+}
+
+void kwp2000::readBlockTimeout()
+{
+    // whatever the block loop was waiting for isn't coming
+    forgetInternal(-1, 0x21);
+    forgetInternal(-1, 0x23);
+    forgetInternal(-1, 0x2C);
+
+    if ((periodicState == periodicStarting || periodicState == periodicRunning) &&
+            ++periodicMisses > maxPeriodicMisses) {
+        emit log("Module stopped sending the blocks periodically, polling instead");
+        stopPeriodic();
+        periodicState = periodicRefused;
+    }
+
+    readBlocks();
+}
+
+// 2 slow, 3 medium or 4 fast, the rates are up to the module. 0 always polls.
+void kwp2000::setPeriodicMode(int mode)
+{
+    mode = (mode >= 2 && mode <= 4) ? mode : 0;
+    if (mode == periodicMode) {
+        return;
+    }
+
+    periodicMode = mode;
+    if (periodicState == periodicRefused) {
+        periodicState = periodicOff; // give it another go with the new mode
+    }
+    else if (periodicState != periodicOff) {
+        stopPeriodic(); // started again at the new rate on the next read
+    }
+}
+
+// one identifier covering the open blocks without a rate
+bool kwp2000::periodicCandidate(int &id) const
+{
+    if (useDynamicIdentifier()) {
+        id = dynamicIdentifier;
+        return dynamicDefined;
+    }
+    QList<int> blocks = unratedBlocks();
+    if (blocks.size() == 1) {
+        id = blocks.first();
+        return true;
+    }
+    return false;
+}
+
+// the first response comes back like a normal read, tp20 listens for the rest
+void kwp2000::startPeriodic(int id)
+{
+    periodicState = periodicStarting;
+    periodicId = id;
+    periodicMisses = 0;
+
+    QByteArray packet;
+    packet.append(0x21);
+    packet.append(id);
+    packet.append(periodicMode);
+
+    QMetaObject::invokeMethod(tp, "setListening", Qt::QueuedConnection, Q_ARG(int, getChannelDest()));
+    sendInternal(getChannelDest(), packet, normRecvTimeout, priorityBlockRead);
+    readBlockTimer.start(readWatchdog);
+}
+
+// transmission mode 05 stops it
+void kwp2000::stopPeriodic()
+{
+    QMetaObject::invokeMethod(tp, "setListening", Qt::QueuedConnection, Q_ARG(int, -1));
+
+    if (periodicState == periodicRunning || periodicState == periodicStarting) {
+        QByteArray packet;
+        packet.append(0x21);
+        packet.append(periodicId);
+        packet.append(0x05);
+        sendInternal(getChannelDest(), packet, normRecvTimeout, priorityBlockRead);
+        periodicStopId = periodicId;
+    }
+
+    periodicState = periodicOff;
+}
+
+void kwp2000::blockDataHandler(const QByteArray &data, quint8 param)
+{
+    quint8 blockNum = param;
+
+    if (!currentBlocks.contains(blockNum)) {
+        emit log("Warning: Got values for block " + QString::number(blockNum) + " but its not open.");
+        readBlocks();
+        return;
+    }
+    if (data.length() < 12) {
+        emit log("Warning: Values for block " + QString::number(blockNum) + " are short", debugMsgLog);
+        readNext();
+        return;
+    }
+    periodicMisses = 0;
+    countRead(0, blockNum);
+
+    typedValue values[4];
+    blockDecoder::decodeTriplets(data.constData(), 4, values);
+    QVector<blockValue> &block = currentBlocks[blockNum];
+    for (int i = 0; i < 4; i++) {
+        block[i].value = values[i];
+    }
+
+    emit newBlockData(blockNum);
+
+    updateSample(blockNum);
+
+    readNext();
+}
+
+bool kwp2000::useDynamicIdentifier() const
+{
+    return dynamicSupported != 0 && unratedBlocks().size() > 1 && !currentBlocks.contains(dynamicIdentifier);
+}
+
+// Each value is defined by local identifier (mode 01): its position in the dynamic
+// record, size 3 (formula and two bytes), the block and its position in the block.
+// Positions count bytes from 1, after the identifier.
+void kwp2000::defineDynamicIdentifier()
+{
+    // cleared first, a module that adds to an existing definition would otherwise
+    // send the old values as well
+    QByteArray clear;
+    clear.append(0x2C);
+    clear.append(dynamicIdentifier);
+    clear.append(0x04);
+    dynamicClearing = true;
+    sendInternal(getChannelDest(), clear, normRecvTimeout, priorityBlockRead);
+
+    QByteArray packet;
+    packet.append(0x2C);
+    packet.append(dynamicIdentifier);
+
+    pendingLayout.clear();
+    QList<int> blocks = unratedBlocks();
+    for (int i = 0; i < blocks.length(); i++) {
+        for (int pos = 0; pos < 4; pos++) {
+            blockRef ref = {blocks.at(i), pos};
+            packet.append(0x01);
+            packet.append(1 + pendingLayout.length() * 3);
+            packet.append(0x03);
+            packet.append(blocks.at(i));
+            packet.append(1 + pos * 3);
+            pendingLayout << ref;
+        }
+    }
+
+    sendInternal(getChannelDest(), packet, normRecvTimeout, priorityBlockRead);
+    readBlockTimer.start(readWatchdog);
+}
+
+void kwp2000::dynamicRedefine()
+{
+    dynamicDefined = false;
+    dynamicRetried = true;
+}
+
+void kwp2000::dynamicGiveUp()
+{
+    emit log("Module does not keep the dynamic identifier, reading blocks one at a time");
+    dynamicSupported = 0;
+    dynamicDefined = false;
+}
+
+// 61 F0 and a triplet for each value in dynamicLayout, shared out to the blocks. Any
+// other length means the module's definition isn't the one sent.
+void kwp2000::dynamicDataHandler(const QByteArray &data)
+{
+    if (data.length() != dynamicLayout.length() * 3) {
+        emit log("Warning: Dynamic identifier response is " + QString::number(data.length()) + " bytes, not " +
+                 QString::number(dynamicLayout.length() * 3), debugMsgLog);
+        if (dynamicRetried) {
+            dynamicGiveUp();
+        }
+        else {
+            dynamicRedefine();
+        }
+        readNext();
+        return;
+    }
+
+    dynamicRetried = false;
+    periodicMisses = 0;
+    dynamicValues.resize(dynamicLayout.length());
+    blockDecoder::decodeTriplets(data.constData(), dynamicLayout.length(), dynamicValues.data());
+
+    QList<int> updated;
+    for (int i = 0; i < dynamicLayout.length(); i++) {
+        const blockRef &ref = dynamicLayout.at(i);
+        if (!currentBlocks.contains(ref.blockNum)) {
+            continue;
+        }
+
+        currentBlocks[ref.blockNum][ref.pos].value = dynamicValues.at(i);
+
+        if (!updated.contains(ref.blockNum)) {
+            updated << ref.blockNum;
+        }
+    }
+
+    for (int i = 0; i < updated.length(); i++) {
+        countRead(0, updated.at(i));
+        emit newBlockData(updated.at(i));
+        updateSample(updated.at(i));
+    }
 
-void kwp2000::readBlockTimeout()
-{
-    readBlocks();
+    readNext();
 }
 
-void kwp2000::blockDataHandler(QByteArray *data, quint8 param)
+void kwp2000::extraResponse(int dest, quint8 respCode, quint8 param, const QByteArray &data)
 {
-    quint8 blockNum = param;
+    int module = extraChannels.value(dest);
 
-    if (!currentBlocks.contains(blockNum)) {
-        emit log("Warning: Got values for block " + QString::number(blockNum) + " but its not open.");
-        delete data;
-        readBlocks();
+    if (respCode == 0x50) {
+        emit log("Diagnostic session started on module 0x" + toHex(module), debugMsgLog);
         return;
     }
 
-    for (int i = 0; i < 4; i++) {
-        QString units;
-        QVariant val = decodeBlockData(data->at(i*3), data->at(i*3+1), data->at(i*3+2), units);
-
-        currentBlocks[blockNum][i].units = units;
-        currentBlocks[blockNum][i].val = val;
+    if (respCode == 0x7F) {
+        emit log("Warning: Module 0x" + toHex(module) + " sent a negative response to " + toHex(param));
+        if (param == 0x21) {
+            readNext();
+        }
+        return;
     }
 
-    emit newBlockData(blockNum);
+    if (respCode != 0x61) {
+        return;
+    }
 
-    updateSample(blockNum);
+    if (data.length() >= 12) {
+        countRead(module, param);
+        qint64 now = acquisitionClock.elapsed();
+        typedValue values[4];
+        blockDecoder::decodeTriplets(data.constData(), 4, values);
+        for (int i = 0; i < extraValues.length(); i++) {
+            const extraValue &extra = extraValues.at(i);
+            if (extra.module != module || extra.blockNum != param) {
+                continue;
+            }
 
-    if (logFile) {
-        writeSample();
+            queueSampleUpdate(now, firstExtraSample + i, values[extra.pos]);
+        }
+        mergeSamples(now - mergeHorizon);
     }
 
-    delete data;
-    readBlocks();
+    readNext();
 }
 
-void kwp2000::startDiagHandler(QByteArray *data, quint8 param)
+void kwp2000::startDiagHandler(const QByteArray &data, quint8 param)
 {
+    applyFastTiming();
+
+    if (reconnecting) { // same module, the IDs and labels haven't changed
+        emit log("Session restored on module 0x" + toHex(destModule));
+        reconnecting = false;
+        restoreTimer.stop();
+        if (readingBlocks) {
+            readBlocks();
+        }
+        return;
+    }
+
     emit diagStarted(param);
-    delete data;
 
     // do request for long ID
     QByteArray tmp;
     tmp.append(0x1A);
     tmp.append(0x9B);
-    QMetaObject::invokeMethod(tp, "sendData", Qt::QueuedConnection,
-                              Q_ARG(QByteArray, tmp),
-                              Q_ARG(int, slowRecvTimeout));
+    sendInternal(getChannelDest(), tmp, slowRecvTimeout);
 }
 
-void kwp2000::miscHandler(QByteArray *data, quint8 respCode, quint8 param)
+void kwp2000::miscHandler(const QByteArray &data, quint8 respCode, quint8 param)
 {
     emit log("Misc command: Response code" + toHex(respCode) + ", parameter " + toHex(param));
-    delete data;
 }
 
-void kwp2000::shortIdHandler(QByteArray *data) {
+void kwp2000::shortIdHandler(const QByteArray &data) {
     QStringList tmpList;
 
     // rewrite to use interpretRawData()
-    for (int i = 0; i < data->length();) {
-        if (static_cast<quint8>(data->at(i)) == 0xFF) {
+    for (int i = 0; i < data.length();) {
+        if (static_cast<quint8>(data.at(i)) == 0xFF) {
             break;
         }
         QString tmp;
-        quint8 len = static_cast<quint8>(data->at(i));
+        quint8 len = static_cast<quint8>(data.at(i));
         for (int j = 1; j < len; j++) {
-            tmp += QChar(data->at(i+j));
+            tmp += QChar(data.at(i+j));
         }
         i += len;
 
@@ -646,22 +2301,21 @@ void kwp2000::shortIdHandler(QByteArray *data) {
     ecuPartNum = tmpList;
     emit newEcuInfo(ecuPartNum);
 
-    delete data;
 }
 
-void kwp2000::longIdHandler(QByteArray *data)
+void kwp2000::longIdHandler(const QByteArray &data)
 {
     QStringList tmpList;
     QString tmp;
 
     for (int i = 0; i < 16; i++) {
-        tmp += QChar(data->at(i));
+        tmp += QChar(data.at(i));
     }
     tmpList << tmp;
 
     tmp.clear();
-    for (int i = 26; i < data->length(); i++) {
-        tmp += QChar(data->at(i));
+    for (int i = 26; i < data.length(); i++) {
+        tmp += QChar(data.at(i));
     }
     while(tmp.right(1) == QChar(' ')) {
         tmp.chop(1);
@@ -676,17 +2330,13 @@ void kwp2000::longIdHandler(QByteArray *data)
     QByteArray tmpBA;
     tmpBA.append(0x1A);
     tmpBA.append(0x91);
-    QMetaObject::invokeMethod(tp, "sendData", Qt::QueuedConnection,
-                              Q_ARG(QByteArray, tmpBA),
-                              Q_ARG(int, slowRecvTimeout));
+    sendInternal(getChannelDest(), tmpBA, slowRecvTimeout);
 
-    delete data;
 }
 
-void kwp2000::queryModulesHandler(QByteArray *data)
+void kwp2000::queryModulesHandler(const QByteArray &data)
 {
     QList<QByteArray> dataList = interpretRawData(data);
-    delete data;
 
     if (dataList.length() != 2) {
         emit log("List modules: Didn't get list of 2 byte arrays");
@@ -728,22 +2378,65 @@ void kwp2000::queryModulesHandler(QByteArray *data)
     QMetaObject::invokeMethod(tp, "closeChannel", Qt::BlockingQueuedConnection);
 }
 
-void kwp2000::writeSample()
+void kwp2000::writeSample(qint64 time)
 {
-    logOut << QTime::currentTime().toString("HH:mm:ss.zzz");
-    for (int i = 0; i < sample.length(); i++) {
-        logOut << "," + sample.at(i).val.toString();
+    logOut << logStartTime.addMSecs(time - logStartClock).toString("HH:mm:ss.zzz");
+    for (int i = 0; i < sample.size(); i++) {
+        logOut << "," + sample.toString(i);
+    }
+    logOut << '\n';
+
+    // a line per broadcast frame is too many writes to flush each one
+    if (logFlushed.elapsed() >= logFlushInterval) {
+        logOut.flush();
+        logFlushed.restart();
     }
-    logOut << endl;
-    logOut.flush();
 }
 
 void kwp2000::updateSample(int block)
 {
+    qint64 now = acquisitionClock.elapsed();
     for (int i = 0; i < 4; i++) {
         int sampleIndex = currentBlocks[block][i].indexToSampleValue;
-        sample[sampleIndex].val = currentBlocks[block][i].val;
+        queueSampleUpdate(now, sampleIndex, currentBlocks[block][i].value);
+    }
+
+    mergeSamples(now - mergeHorizon);
+}
+
+void kwp2000::queueSampleUpdate(qint64 time, int index, const typedValue &val)
+{
+    sampleUpdate update = {time, index, val};
+
+    // updates nearly always arrive in order, walk back from the end to find the place
+    int i = pendingUpdates.size();
+    while (i > 0 && pendingUpdates.at(i-1).time > time) {
+        i--;
+    }
+    pendingUpdates.insert(i, update);
+}
+
+// Applies the queued updates up to and including time upTo to the sample,
+// writing a log line for each distinct timestamp
+void kwp2000::mergeSamples(qint64 upTo)
+{
+    int merged = 0;
+    while (merged < pendingUpdates.size() && pendingUpdates.at(merged).time <= upTo) {
+        qint64 time = pendingUpdates.at(merged).time;
+
+        while (merged < pendingUpdates.size() && pendingUpdates.at(merged).time == time) {
+            const sampleUpdate &update = pendingUpdates.at(merged++);
+            if (update.index < sample.size()) {
+                sample.set(update.index, update.val, update.time);
+            }
+        }
+
+        if (logFile) {
+            writeSample(time);
+        }
     }
+
+    pendingUpdates.remove(0, merged);
 }
 
 QString kwp2000::findLabelFromRedir(QString partNum, QString dirStr)
@@ -799,18 +2492,18 @@ QString kwp2000::findLabelFromRedir(QString partNum, QString dirStr)
 }
 
 // should rewrite to not work char by char
-QList<QByteArray> kwp2000::interpretRawData(QByteArray *raw)
+QList<QByteArray> kwp2000::interpretRawData(const QByteArray &raw)
 {
     QList<QByteArray> retList;
 
-    for (int i = 0; i < raw->length();) {
-        if (static_cast<quint8>(raw->at(i)) == 0xFF) {
+    for (int i = 0; i < raw.length();) {
+        if (static_cast<quint8>(raw.at(i)) == 0xFF) {
             break;
         }
         QByteArray tmp;
-        quint8 len = static_cast<quint8>(raw->at(i));
+        quint8 len = static_cast<quint8>(raw.at(i));
         for (int j = 1; j < len; j++) {
-            tmp += static_cast<quint8>(raw->at(i+j));
+            tmp += static_cast<quint8>(raw.at(i+j));
         }
         i += len;
 
@@ -872,129 +2565,10 @@ void kwp2000::initModuleNames()
     moduleNames.insert(0x77, "Telephone");
 }
 
-QVariant kwp2000::decodeBlockData(quint8 id, quint8 a, quint8 b, QString &units)
-{
-    //qDebug() << "ID " << id << QString::number(id, 16) << " A " << a << " B " << b << flush;
-
-    unsigned int uint;
-    double dbl;
-    QString ret;
-
-    switch (id) {
-    case 0x01:
-        units = "rpm";
-        dbl = a*b/5.0;
-        return dbl;
-    case 0x04:
-        if (b > 127) {
-            units = QString::fromUtf8("\u00B0 ATDC");
-        }
-        else {
-            units = QString::fromUtf8("\u00B0 BTDC");
-        }
-        dbl = abs(b-127)*0.01*a;
-        return dbl;
-    case 0x07:
-        units = "km/h";
-        dbl = 0.01*a*b;
-        return dbl;
-    case 0x08:
-        units = "Binary";
-        uint = (a << 8 | b);
-        return uint;
-    case 0x10:
-        units = "Binary";
-        uint = (a << 8 | b);
-        return uint;
-    case 0x11:
-        units = "ASCII";
-        ret = QChar::fromAscii(a);
-        ret += QChar::fromAscii(b);
-        return ret;
-    case 0x12:
-        units = "mbar";
-        dbl = a*b/25.0;
-        return dbl;
-    case 0x14:
-        units = "%";
-        dbl = a*b/128.0-1;
-        return dbl;
-    case 0x15:
-        units = "V";
-        dbl = a*b/1000.0;
-        return dbl;
-    case 0x16:
-        units = "ms";
-        dbl = 0.001*a*b;
-        return dbl;
-    case 0x17:
-        units = "%";
-        dbl = b*a/256.0;
-        return dbl;
-    case 0x1A:
-        units = QString::fromUtf8("\u00B0 C");
-        dbl = b-a;
-        return dbl;
-    case 0x21:
-        units = "%";
-        if (a == 0)
-            dbl = 100.0*b;
-        else
-            dbl = 100.0*b/a;
-        return dbl;
-    case 0x22:
-        units = "kW";
-        dbl = (b-128)*0.01*a;
-        return dbl;
-    case 0x23:
-        units = "l/h";
-        dbl = a*b/100.0;
-        return dbl;
-    case 0x25:
-        units = "Binary";
-        uint = (a << 8 | b);
-        return uint;
-    case 0x27:
-        // fuel
-        units = "mg/stk";
-        dbl = a*b/256.0;
-        return dbl;
-    case 0x31:
-        // air
-        units = "mg/stk";
-        dbl = a*b/40.0;
-        return dbl;
-    case 0x33:
-        units = QString::fromUtf8("mg/stk \u0394");
-        dbl = ((b-128)/255.0)*a;
-        return dbl;
-    case 0x36:
-        units = "Count";
-        dbl = a*256+b;
-        return dbl;
-    case 0x37:
-        units = "s";
-        dbl = a*b/200.0;
-        return dbl;
-    case 0x51:
-        units = QString::fromUtf8("\u00B0 CF");
-        dbl = ((a*112000.0) + (b*436.0))/1000.0; // Torsion, check formula
-        return dbl;
-    case 0x5E:
-        units = "Nm";
-        dbl = a*(b/50.0-1); // Torque, check formula
-        return dbl;
-    default:
-        units = "Raw";
-        uint = (a << 8 | b);
-        return uint;
-    }
-}
-
 QVariant kwp2000::getBlockValue(int blockNum, int pos)
 {
     if (currentBlocks.contains(blockNum)) {
-        return currentBlocks[blockNum][pos].val;
+        return sampleStore::toVariant(currentBlocks[blockNum][pos].value);
     }
     else return QVariant();
 }
@@ -1002,7 +2576,7 @@ QVariant kwp2000::getBlockValue(int blockNum, int pos)
 QString kwp2000::getBlockUnits(int blockNum, int pos)
 {
     if (currentBlocks.contains(blockNum)) {
-        return currentBlocks[blockNum][pos].units;
+        return sampleStore::unitsName(currentBlocks[blockNum][pos].value.units);
     }
     else return QString();
 }
@@ -1041,29 +2615,9 @@ const QMap<int, moduleInfo_t> &kwp2000::getModuleList() const
     return moduleList;
 }
 
-const QList<sampleValue> &kwp2000::getSample() const
+const sampleStore &kwp2000::getSample() const
 {
     return sample;
-
-    /*
-    static double x = 0;
-    x += 2.0*M_PI / 20.0;
-
-    static QList<sampleValue> tmp;
-
-    if (tmp.empty()) {
-        sampleValue tmpSample1;
-        for (int i = 0; i < 16; i++) {
-            tmp.append(tmpSample1);
-        }
-    }
-
-    for (int i = 0; i < 16; i++) {
-        tmp[i].val = qSin(x + (2.0*M_PI / 16.0)*i) * 10 * (i+1);
-    }
-
-    return tmp;
-    */
 }
 
 QFileInfo kwp2000::getLogfileInfo()
@@ -1082,7 +2636,443 @@ void kwp2000::setTimeouts(int slow, int norm, int fast)
     tp->setSlowRecvTimeout(slow);
 }
 
+void kwp2000::setAdaptiveTimeouts(bool on)
+{
+    adaptiveTimeouts = on;
+    QMetaObject::invokeMethod(tp, "setAdaptiveTimeouts", Qt::QueuedConnection, Q_ARG(bool, on));
+}
+
+void kwp2000::responseTimeSlot(int dest, int service, const rttEstimate &estimate)
+{
+    responseTimes.insert((dest << 8) | service, estimate);
+}
+
+// Long enough for a few retransmission timeouts, never longer than the fixed
+// watchdog. Periodic transmission is timed by the module so it keeps the fixed one.
+int kwp2000::readBlockWatchdog(int dest) const
+{
+    rttEstimate estimate = responseTimes.value((dest << 8) | 0x21);
+    if (!adaptiveTimeouts || estimate.samples == 0 || periodicState != periodicOff) {
+        return readWatchdog;
+    }
+    return qBound(static_cast<int>(minReadWatchdog), 3 * estimate.rto + 50, static_cast<int>(readWatchdog));
+}
+
+// A line per module and service that has been answered, for the log
+QStringList kwp2000::getResponseTimes() const
+{
+    QStringList lines;
+    QMap<int, rttEstimate>::const_iterator it;
+    for (it = responseTimes.constBegin(); it != responseTimes.constEnd(); ++it) {
+        int dest = it.key() >> 8;
+        int module = (dest == getChannelDest()) ? destModule : extraChannels.value(dest, dest);
+        const rttEstimate &estimate = it.value();
+        lines << "Module " + toHex(module) + " service " + toHex(it.key() & 0xFF) + ": " +
+                 QString::number(estimate.srtt, 'f', 1) + "ms +/- " + QString::number(estimate.rttvar, 'f', 1) +
+                 "ms, timeout " + QString::number(estimate.rto) + "ms (" + QString::number(estimate.samples) +
+                 " responses, " + QString::number(estimate.timeouts) + " timeouts)";
+    }
+
+    QMap<int, moduleTiming>::const_iterator timing;
+    for (timing = moduleTimings.constBegin(); timing != moduleTimings.constEnd(); ++timing) {
+        if (!timing.value().limits.isEmpty()) {
+            lines << "Module " + toHex(timing.key()) + " timing limits: " + timingText(timing.value().limits);
+        }
+        if (!timing.value().accepted.isEmpty()) {
+            lines << "Module " + toHex(timing.key()) + " timing asked for: " + timingText(timing.value().accepted) +
+                     (timing.value().applied ? " (in use)" : "");
+        }
+    }
+    return lines;
+}
+
+void kwp2000::setFastTiming(bool on)
+{
+    fastTiming = on;
+}
+
+void kwp2000::applyFastTiming()
+{
+    if (!fastTiming || destModule < 0 || moduleTimings.value(destModule).refused) {
+        return;
+    }
+
+    QByteArray packet;
+    packet.append(0x83);
+    packet.append(static_cast<char>(0x00)); // read the limits
+    sendRequest(packet, 0, -1, this, "timingLimitsDone");
+}
+
+// Closing drops whatever tp20 still has queued, so the channel is closed by
+// timingRestoreDone() once the module has its default timing back. Returns false
+// if there is nothing to restore.
+bool kwp2000::restoreTiming()
+{
+    if (timingRestoring) {
+        return true;
+    }
+    if (!moduleTimings.value(destModule).applied || getChannelDest() < 0) {
+        return false;
+    }
+
+    QByteArray packet;
+    packet.append(0x83);
+    packet.append(0x01);
+    if (sendRequest(packet, timingRestoreTimeout, -1, this, "timingRestoreDone") < 0) {
+        return false;
+    }
+    timingRestoring = true;
+    closeRequested = true;
+    cancelReconnect();
+    return true;
+}
+
+// For the paths that can't wait for the answer, tp20 sends the 83 01 ahead of the close
+void kwp2000::queueTimingRestore()
+{
+    if (!moduleTimings.value(destModule).applied || getChannelDest() < 0) {
+        return;
+    }
+    moduleTimings[destModule].applied = false;
+
+    QByteArray packet;
+    packet.append(0x83);
+    packet.append(0x01);
+    QMetaObject::invokeMethod(tp, "sendDataTo", Qt::QueuedConnection,
+                              Q_ARG(int, getChannelDest()),
+                              Q_ARG(QByteArray, packet),
+                              Q_ARG(int, slowRecvTimeout),
+                              Q_ARG(int, priorityClose));
+}
+
+// C3 00 then the limits
+void kwp2000::timingLimitsDone(const kwpResult &result)
+{
+    if (result.dest != getChannelDest()) {
+        return;
+    }
+
+    if (result.status == requestNegative) {
+        emit log("Module 0x" + toHex(destModule) + " does not support accessTimingParameters, keeping its default timing", debugMsgLog);
+        moduleTimings[destModule].refused = true;
+        return;
+    }
+    if (result.status != requestPositive || result.response.length() < 7) {
+        return;
+    }
+
+    moduleTiming &timing = moduleTimings[destModule];
+    timing.limits = result.response.mid(2, 5);
+    emit log("Module 0x" + toHex(destModule) + " timing limits: " + timingText(timing.limits), debugMsgLog);
+
+    QByteArray packet;
+    packet.append(0x83);
+    packet.append(0x02); // read the timing in use
+    sendRequest(packet, 0, -1, this, "timingCurrentDone");
+}
+
+// C3 02 then the timing in use. The limits give the shortest P2min, P3min and
+// P4min, P2max and P3max are lowered to the limits but never raised above what
+// the module was using, a longer maximum would only make it slower to give up.
+void kwp2000::timingCurrentDone(const kwpResult &result)
+{
+    if (result.dest != getChannelDest()) {
+        return;
+    }
+
+    if (result.status != requestPositive || result.response.length() < 7) {
+        emit log("Module 0x" + toHex(destModule) + " did not say what timing it uses, keeping it", debugMsgLog);
+        return;
+    }
+
+    moduleTiming &timing = moduleTimings[destModule];
+    timing.current = result.response.mid(2, 5);
+
+    timing.accepted = timing.limits;
+    timing.accepted[1] = qMin(static_cast<quint8>(timing.current.at(1)), static_cast<quint8>(timing.limits.at(1)));
+    timing.accepted[3] = qMin(static_cast<quint8>(timing.current.at(3)), static_cast<quint8>(timing.limits.at(3)));
+
+    if (timing.accepted == timing.current) {
+        emit log("Module 0x" + toHex(destModule) + " is already using its fastest timing", debugMsgLog);
+        return;
+    }
+
+    QByteArray packet;
+    packet.append(0x83);
+    packet.append(0x03);
+    packet.append(timing.accepted);
+    sendRequest(packet, 0, -1, this, "timingSetDone");
+}
+
+void kwp2000::timingSetDone(const kwpResult &result)
+{
+    if (result.dest != getChannelDest()) {
+        return;
+    }
+
+    if (result.status != requestPositive) {
+        emit log("Warning: Module 0x" + toHex(destModule) + " did not accept its fastest timing, " +
+                 requestStatusText(result));
+        return;
+    }
+
+    moduleTimings[destModule].applied = true;
+    emit log("Module 0x" + toHex(destModule) + " is using its fastest timing: " +
+             timingText(moduleTimings[destModule].accepted));
+}
+
+void kwp2000::timingRestoreDone(const kwpResult &result)
+{
+    timingRestoring = false;
+    moduleTimings[destModule].applied = false;
+
+    if (result.status != requestCancelled) { // otherwise the channel is already gone
+        if (result.status != requestPositive) {
+            emit log("Warning: Could not restore the default timing, " + requestStatusText(result), debugMsgLog);
+        }
+        QMetaObject::invokeMethod(tp, "closeChannel", Qt::QueuedConnection);
+    }
+
+    if (serialPending) {
+        serialPending = false;
+        setSerialParams(pendingSerial);
+    }
+    int port = portPending;
+    portPending = portKeep;
+    if (port == portOpen) {
+        openPort();
+    }
+    else if (port == portClose) {
+        closePort();
+    }
+}
+
+// ISO 14230-2 resolutions: P2min, P3min and P4min 0.5ms, P2max 25ms, P3max 250ms
+QString kwp2000::timingText(const QByteArray &params)
+{
+    if (params.length() < 5) {
+        return QString();
+    }
+
+    const quint8 *p = reinterpret_cast<const quint8*>(params.constData());
+    return "P2 " + QString::number(p[0] * 0.5) + "-" + QString::number(p[1] * 25) +
+            "ms, P3 " + QString::number(p[2] * 0.5) + "-" + QString::number(p[3] * 250) +
+            "ms, P4 " + QString::number(p[4] * 0.5) + "ms";
+}
+
 void kwp2000::setKeepAliveInterval(int time)
 {
+    keepAliveInterval = time;
     tp->setKeepAliveInterval(time);
 }
+
+int kwp2000::getNumBroadcastSignals() const
+{
+    return broadcastDecoder.getNumSignals();
+}
+
+bool kwp2000::getMonitoring() const
+{
+    return mon->getMonitoring();
+}
+
+QString kwp2000::getSampleDesc(int i)
+{
+    blockRef ref = sample.ref(i);
+    if (ref.blockNum == broadcastBlock) {
+        return broadcastDecoder.getSignal(ref.pos).name;
+    }
+    if (ref.blockNum == extraBlock) {
+        const extraValue &extra = extraValues.at(ref.pos);
+        return "Module " + toHex(extra.module) + " block " + QString::number(extra.blockNum) +
+                " value " + QString::number(extra.pos + 1);
+    }
+    if (ref.blockNum == memoryBlock) {
+        return memoryVars.at(ref.pos).name;
+    }
+    return blockLabels[ref.blockNum].desc[ref.pos] + " " + blockLabels[ref.blockNum].subDesc[ref.pos];
+}
+
+QString kwp2000::getSampleUnits(int i)
+{
+    blockRef ref = sample.ref(i);
+    if (ref.blockNum >= 0 && currentBlocks.contains(ref.blockNum)) {
+        return getBlockUnits(ref.blockNum, ref.pos); // known as soon as the block is read
+    }
+    return sampleStore::unitsName(sample.units(i));
+}
+
+void kwp2000::channelParamsSlot(int dest, int bs, int t1, int t3)
+{
+    chanParam param = {0xA1, static_cast<quint8>(bs), static_cast<quint8>(t1), 0xFF, static_cast<quint8>(t3), 0xFF};
+    moduleParams.insert(dest, param);
+
+    if (!sweeping || sweepDraining || sweepIndex >= sweepResults.length()) {
+        return;
+    }
+
+    sweepResults[sweepIndex].acceptedBs = bs;
+    sweepResults[sweepIndex].acceptedT1 = t1;
+    sweepResults[sweepIndex].acceptedT3 = t3;
+    sweepReads = 0;
+    sweepClock.start();
+    sweepRead();
+}
+
+// Renegotiates the channel with each block size and T3 in turn and times a few
+// reads of the long identification (1A 9B), which takes several blocks to send.
+// The fastest set is kept for the module.
+void kwp2000::sweepParams()
+{
+    if (sweeping) {
+        return;
+    }
+
+    if (getChannelDest() < 0) {
+        emit log("Open a module before sweeping the channel parameters");
+        return;
+    }
+
+    static const quint8 blockSizes[] = {0x0F, 0x08, 0x04, 0x01};
+    static const quint8 gaps[] = {0x4A, 0x0A, 0x00}; // T3 10ms, 1ms, none
+
+    sweepResults.clear();
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 3; j++) {
+            paramSweepResult result = {blockSizes[i], 0x8A, gaps[j], -1, -1, -1, 0, 0, false};
+            sweepResults.append(result);
+        }
+    }
+
+    emit log("Sweeping TP2.0 parameters for module 0x" + toHex(getChannelDest()));
+
+    readBlockTimer.stop();
+    sweeping = true;
+    sweepDraining = false;
+    sweepIndex = -1;
+    sweepNext();
+}
+
+void kwp2000::sweepNext()
+{
+    sweepIndex++;
+    if (sweepIndex >= sweepResults.length()) {
+        finishSweep();
+        return;
+    }
+
+    const paramSweepResult &result = sweepResults.at(sweepIndex);
+    QMetaObject::invokeMethod(tp, "setParams", Qt::QueuedConnection,
+                              Q_ARG(int, result.bs),
+                              Q_ARG(int, result.t1),
+                              Q_ARG(int, result.t3));
+    sweepTimer.start(sweepReadTimeout);
+}
+
+void kwp2000::sweepRead()
+{
+    QByteArray packet;
+    packet.append(0x1A);
+    packet.append(0x9B);
+    sendInternal(getChannelDest(), packet, normRecvTimeout);
+    sweepTimer.start(sweepReadTimeout);
+}
+
+void kwp2000::sweepResponse(const QByteArray &data, quint8 respCode)
+{
+    int bytes = data.length() + 2;
+
+    if (sweepDraining) { // the answer that timed out, the next set can start now
+        emit log("Late response during the sweep ignored", debugMsgLog);
+        sweepDraining = false;
+        sweepTimer.stop();
+        sweepNext();
+        return;
+    }
+
+    if (respCode == 0x7F) {
+        emit log("Warning: Module refused the identification read during the sweep");
+        sweepNext();
+        return;
+    }
+
+    paramSweepResult &result = sweepResults[sweepIndex];
+    result.bytes += bytes;
+    if (++sweepReads < sweepReadsPerSet) {
+        sweepRead();
+        return;
+    }
+
+    result.msecs = sweepClock.elapsed();
+    result.ok = true;
+    sweepNext();
+}
+
+void kwp2000::sweepTimeout()
+{
+    if (!sweeping) {
+        return;
+    }
+
+    // the read may still be answered, that mustn't be counted for the next set
+    if (!sweepDraining) {
+        emit log("Warning: No response during the sweep with block size " +
+                 QString::number(sweepResults.at(sweepIndex).bs), debugMsgLog);
+        sweepDraining = true;
+        sweepTimer.start(sweepDrainDelay);
+        return;
+    }
+
+    sweepDraining = false;
+    forgetInternal(getChannelDest(), 0x1A);
+    sweepNext();
+}
+
+void kwp2000::finishSweep()
+{
+    sweeping = false;
+    sweepDraining = false;
+    sweepTimer.stop();
+
+    int best = -1;
+    double bestRate = 0;
+    for (int i = 0; i < sweepResults.length(); i++) {
+        const paramSweepResult &result = sweepResults.at(i);
+        QString line = "BS " + QString::number(result.bs) +
+                " T3 " + QString::number(tp20::decodeTiming(result.t3)) + "ms";
+        if (result.acceptedBs >= 0) {
+            line += " (module: BS " + QString::number(result.acceptedBs) +
+                    " T1 " + QString::number(tp20::decodeTiming(result.acceptedT1)) + "ms" +
+                    " T3 " + QString::number(tp20::decodeTiming(result.acceptedT3)) + "ms)";
+        }
+
+        if (!result.ok) {
+            emit log(line + " failed");
+            continue;
+        }
+
+        double rate = result.bytes * 1000.0 / qMax(result.msecs, Q_INT64_C(1));
+        emit log(line + " " + QString::number(rate, 'f', 0) + " bytes/s");
+        if (rate > bestRate) {
+            bestRate = rate;
+            best = i;
+        }
+    }
+
+    if (best >= 0 && getChannelDest() >= 0) {
+        const paramSweepResult &result = sweepResults.at(best);
+        emit log("Using block size " + QString::number(result.bs) + ", T3 " +
+                 QString::number(tp20::decodeTiming(result.t3)) + "ms for module 0x" + toHex(getChannelDest()));
+
+        setModuleParams(getChannelDest(), result.bs, result.t1, result.t3);
+        emit channelParamsChosen(getChannelDest(), result.bs, result.t1, result.t3);
+        QMetaObject::invokeMethod(tp, "setParams", Qt::QueuedConnection,
+                                  Q_ARG(int, result.bs),
+                                  Q_ARG(int, result.t1),
+                                  Q_ARG(int, result.t3));
+    }
+
+    if (readingBlocks) {
+        readBlocks();
+    }
+}
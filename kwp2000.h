@@ -28,29 +28,61 @@ along with VAG Blocks.  If not, see <http://www.gnu.org/licenses/>.
 #include <QFile>
 #include <QTextStream>
 #include <QFileInfo>
+#include <QElapsedTimer>
+#include <QTime>
+#include <QPointer>
 #include "serialport.h"
 #include "elm327.h"
 #include "tp20.h"
+#include "monitor.h"
+#include "isotp.h"
+#include "uds.h"
+#include "dbc.h"
+#include "samplestore.h"
+#include "blockdecoder.h"
 #include "util.h"
 #include "serialsettings.h"
 
-typedef struct {
-    int blockNum;
-    int pos;
-} blockRef;
+const int broadcastBlock = -1; // blockRef.blockNum for values decoded from broadcast frames
+const int extraBlock = -2; // blockRef.blockNum for values read from the other modules, pos indexes extraValues
+const int memoryBlock = -3; // blockRef.blockNum for memory variables, pos indexes memoryVars
+const int memoryModule = -1; // readTarget.module for a memory read, blockNum indexes memoryReads
 
 typedef struct {
-    QList<blockRef> refs;
-    QVariant val;
-} sampleValue;
+    qint64 time;
+    int index;
+    typedValue val;
+} sampleUpdate;
 
 typedef struct {
-    QString units;
     QString desc;
-    QVariant val;
+    typedValue value;
     int indexToSampleValue;
 } blockValue;
 
+typedef struct {
+    int module;
+    int blockNum;
+    int pos;
+} extraValue;
+
+typedef struct {
+    QString name;
+    int address;
+    int size; // bytes, 1, 2 or 4
+    bool isSigned;
+    bool bigEndian; // most ECUs here are C167s, little endian
+    double scale;
+    double offset;
+    int units; // from sampleStore::internUnits()
+} memoryVariable;
+
+typedef struct {
+    int address;
+    int length;
+    QList<int> vars; // indexes into memoryVars
+} memoryRead;
+
 typedef struct {
     QString blockName;
     QString desc[4];
@@ -59,6 +91,61 @@ typedef struct {
     QString binDesc[4];
 } blockLabels_t;
 
+typedef struct {
+    quint8 bs; // what was asked for
+    quint8 t1;
+    quint8 t3;
+    int acceptedBs; // what the module agreed to
+    int acceptedT1;
+    int acceptedT3;
+    int bytes;
+    qint64 msecs;
+    bool ok;
+} paramSweepResult;
+
+typedef struct {
+    int dest; // TP2.0 destination
+    int module; // 0 for the open module, memoryModule for a memory read
+    int blockNum; // or the dynamic identifier, or the memory read
+    double rate; // reads per second asked for, 0 for as often as the link allows
+} readTarget;
+
+enum kwpRequestStatus {
+    requestPositive,
+    requestNegative, // nrc says why
+    requestTimedOut,
+    requestCancelled // the channel closed first
+};
+
+typedef struct {
+    int id;
+    int dest;
+    QByteArray request;
+    int status;
+    quint8 nrc; // negative response code
+    QByteArray response; // from the response SID on, 7F SID NRC for a negative response
+    qint64 msecs; // from sending to the answer
+} kwpResult;
+
+Q_DECLARE_METATYPE(kwpResult)
+
+typedef struct {
+    kwpResult result;
+    quint8 responseSid;
+    int responseParam; // -1 if the response doesn't echo the first parameter
+    qint64 deadline; // requestClock msecs
+    QPointer<QObject> receiver; // member is invoked on it with the kwpResult
+    QByteArray member;
+} kwpRequest;
+
+typedef struct {
+    bool refused; // the module doesn't support accessTimingParameters (0x83)
+    bool applied; // accepted is in use, the defaults are set again before the channel closes
+    QByteArray limits; // P2min P2max P3min P3max P4min as the module sent them
+    QByteArray current; // what it was using before, from 83 02
+    QByteArray accepted; // what it was asked for with 83 03 and agreed to
+} moduleTiming;
+
 typedef struct {
     int number;
     int addr;
@@ -79,7 +166,6 @@ public:
     bool getBlockOpen(int i) const;
     bool getPortOpen() const;
     bool getElmInitialised() const;
-    static QVariant decodeBlockData(quint8 id, quint8 a, quint8 b, QString &units);
     QVariant getBlockValue(int blockNum, int pos);
     QString getBlockUnits(int blockNum, int pos);
     QString getBlockDesc(int blockNum, int pos);
@@ -88,10 +174,33 @@ public:
     void setLabelDir(QString dir);
     QString getLabelDir();
     const QMap<int, moduleInfo_t>& getModuleList() const;
-    const QList<sampleValue>& getSample() const;
+    const sampleStore& getSample() const;
     QFileInfo getLogfileInfo();
     void setTimeouts(int slow, int norm, int fast);
     void setKeepAliveInterval(int time);
+    void setMonitorWindow(int window, int interval);
+    void setExtraBlocks(const QString &spec);
+    void setReconnectAttempts(int attempts);
+    void setModuleParams(int dest, int bs, int t1, int t3);
+    void setPeriodicMode(int mode);
+    void setBlockRates(const QString &spec);
+    void setMemoryVariables(const QString &spec);
+    void pauseReads(bool pause);
+    void useMaxBlockSize();
+    void restoreBlockSize();
+    void setAdaptiveTimeouts(bool on);
+    void setFastTiming(bool on);
+    QStringList getResponseTimes() const;
+    int sendRequest(const QByteArray &data, int timeout = 0, int dest = -1,
+                    QObject *receiver = 0, const char *member = 0);
+    static QString requestStatusText(const kwpResult &result);
+    static QString negativeResponse(quint8 code);
+    double getBlockRate(int blockNum) const;
+    bool getReconnecting() const;
+    int getNumBroadcastSignals() const;
+    bool getMonitoring() const;
+    QString getSampleDesc(int i);
+    QString getSampleUnits(int i);
 signals:
     void log(const QString &txt, int logLevel = stdLog);
     void diagStarted(int param);
@@ -108,6 +217,9 @@ signals:
     void moduleListRefreshed();
     void sampleFormatChanged();
     void loggingStarted();
+    void monitoringChanged(bool on);
+    void requestFinished(const kwpResult &result);
+    void channelParamsChosen(int dest, int bs, int t1, int t3);
 public slots:
     void openPort();
     void closePort();
@@ -124,26 +236,227 @@ public slots:
     void stopLogging();
     void loadLabelFile();
     void openGW_refresh(bool ok = true);
+    void loadBroadcastSignals(const QString &dbcFile, const QStringList &names);
+    void startMonitor();
+    void stopMonitor();
+    void sweepParams();
+    void readIdentifiers(const QString &spec);
 private slots:
-    void recvKWP(QByteArray* data);
+    void recvKWP(int dest, const tpMessage &msg);
     void readBlockTimeout();
+    void scheduleTimeout();
+    void broadcastData(const broadcastBatch &batch);
+    void monitorDone();
+    void monitorWindowDone();
+    void channelParamsSlot(int dest, int bs, int t1, int t3);
+    void channelStatusSlot(int dest, bool open);
+    void sweepTimeout();
+    void reconnectTimeout();
+    void restoreTimedOut();
+    void udsData(int txID, const QMap<int, QByteArray> &values);
+    void responseTimeSlot(int dest, int service, const rttEstimate &estimate);
+    void requestTimeout();
+    void miscCommandDone(const kwpResult &result);
+    void timingLimitsDone(const kwpResult &result);
+    void timingCurrentDone(const kwpResult &result);
+    void timingSetDone(const kwpResult &result);
+    void timingRestoreDone(const kwpResult &result);
 private:
     QThread* elmThread;
     QThread* tpThread;
     elm327* elm;
     tp20* tp;
+    monitor* mon;
+    isotp* iso;
+    uds* udsClient;
+    dbc broadcastDecoder;
+    int firstBroadcastSample;
 
     void readBlocks();
+    void readNext();
     int nextBlock;
+    QMap<int, qint64> readBackoff; // (dest << 8) | block refused by the module to acquisition clock msecs
+    static const int refusedReadBackoff = 5000;
     bool readingBlocks;
+    bool readsPaused; // something else has the channel, eg. a memory upload
     QTimer readBlockTimer;
 
-    void blockDataHandler(QByteArray* data, quint8 param);
-    void startDiagHandler(QByteArray* data, quint8 param);
-    void miscHandler(QByteArray* data, quint8 respCode, quint8 param);
-    void longIdHandler(QByteArray* data);
-    void shortIdHandler(QByteArray* data);
-    void queryModulesHandler(QByteArray* data);
+    // A block with a rate in blockRates is read when it falls due, earliest deadline
+    // first, ahead of the blocks without one which share what is left of the link
+    // round-robin. The rates actually achieved are measured over rateReportInterval.
+    QMap<int, double> blockRates; // (module << 8) | block to reads per second
+    QMap<int, qint64> readDue; // (dest << 8) | block to acquisition clock msecs
+    QMap<int, int> readCounts; // (module << 8) | block to responses since rateClock started
+    QMap<int, double> achievedRates;
+    QElapsedTimer rateClock;
+    QTimer scheduleTimer; // runs readBlocks when nothing is due yet
+    static const int rateReportInterval = 5000;
+    // Reads stay on the channel read last while nothing elsewhere is more than
+    // channelSwitchSlack msecs further behind, each switch costs tp20 an AT SH and AT CRA.
+    int lastReadDest;
+    static const int channelSwitchSlack = 50;
+    double blockRate(int module, int blockNum) const;
+    QList<int> unratedBlocks() const;
+    void countRead(int module, int blockNum);
+
+    // With more than one block open without a rate the values are gathered into a
+    // dynamically defined local identifier (0x2C) so one 0x21 reads them all. dynamicLayout says which
+    // block value each triplet in the response belongs to.
+    int dynamicSupported; // -1 not tried yet on this channel, 0 refused, 1 accepted
+    bool dynamicDefined; // the module has the layout of the blocks open now
+    QList<blockRef> dynamicLayout;
+    QList<blockRef> pendingLayout; // sent with the 0x2C, waiting for the 0x6C
+    bool dynamicClearing; // waiting for the answer to 2C F0 04, sent before each definition
+    bool dynamicRetried; // defined again once since it last worked, it isn't tried a third time
+    QVector<typedValue> dynamicValues; // decoded response, kept to save reallocating it
+    static const quint8 dynamicIdentifier = 0xF0;
+    bool useDynamicIdentifier() const;
+    void defineDynamicIdentifier();
+    void dynamicDataHandler(const QByteArray &data);
+    void dynamicRedefine();
+    void dynamicGiveUp();
+
+    // The open block, or all of them through the dynamic identifier, can be asked for
+    // with a periodic transmission mode (21 id 02/03/04) so the module sends it without
+    // being polled and tp20 listens for it. Polling takes over if the module refuses
+    // or goes quiet.
+    enum periodicStates {
+        periodicOff,
+        periodicStarting,
+        periodicRunning,
+        periodicRefused // until the channel is opened again
+    };
+    int periodicMode; // transmission mode, 0 to always poll
+    int periodicState;
+    int periodicId; // identifier being sent
+    int periodicStopId; // its response to the stop is ignored, -1 if none
+    int periodicMisses; // read timer expiries without data
+    static const int maxPeriodicMisses = 3;
+    bool periodicCandidate(int &id) const;
+    void startPeriodic(int id);
+    void stopPeriodic();
+
+    // blocks read from other modules over their own channels while a module is open
+    QMap<int, QList<int> > extraBlocks; // module number to block numbers
+    QList<extraValue> extraValues;
+    int firstExtraSample;
+    QMap<int, int> extraChannels; // TP2.0 destination to module number, for the channels asked for
+    QList<int> extraOpen; // destinations with an open channel
+    void openExtraChannels();
+    void extraResponse(int dest, quint8 respCode, quint8 param, const QByteArray &data);
+
+    // RAM variables read with readMemoryByAddress (0x23) alongside the blocks. Variables
+    // close together are read with one request, reading a few bytes nobody asked for
+    // is cheaper than another round trip.
+    QString memorySpec;
+    QList<memoryVariable> memoryVars; // in address order
+    QList<memoryRead> memoryReads;
+    int firstMemorySample;
+    int memoryPending; // the memory read waiting for its 0x63, -1 if none
+    static const int maxMemoryRead = 64;
+    static const int maxMemoryGap = 8;
+    void groupMemoryReads();
+    void memoryDataHandler(const QByteArray &data);
+
+    // a channel that drops is opened again with the same blocks and log file,
+    // waiting reconnectDelay << try msecs (up to reconnectMaxDelay) before each try
+    bool closeRequested; // the user closed the channel or port, it isn't reopened
+    bool channelWasOpen; // only a channel that opened once is reconnected
+    bool reconnecting;
+    int reconnectAttempts; // 0 turns it off
+    int reconnectTry;
+    QTimer reconnectTimer;
+    QTimer restoreTimer; // the session request after a reconnect went unanswered
+    static const int reconnectDelay = 500;
+    static const int reconnectMaxDelay = 30000;
+    static const int restoreTimeout = 5000;
+    void scheduleReconnect();
+    void cancelReconnect();
+    void endSession();
+
+    // a window longer than half the keep alive interval is monitored in parts, tp20
+    // sends the keep alives that fall due in between
+    int monitorWindow;
+    int monitorInterval;
+    int windowLeft; // msecs of the current window still to monitor
+    int keepAliveInterval;
+    bool inMonitorWindow;
+    QElapsedTimer lastMonitorWindow;
+    void monitorWindowPart();
+
+    // TP2.0 parameters accepted by each module, and the sweep that picks them
+    QMap<int, chanParam> moduleParams;
+    QList<paramSweepResult> sweepResults;
+    bool sweeping;
+    int bulkDest; // channel useMaxBlockSize() changed, -1 if none
+    chanParam bulkSavedParams; // what it had before
+    int sweepIndex;
+    int sweepReads;
+    QElapsedTimer sweepClock;
+    QTimer sweepTimer;
+    bool sweepDraining; // waiting out a late answer so it isn't timed with the next set
+    static const int sweepReadsPerSet = 5;
+    static const int sweepReadTimeout = 2000;
+    static const int sweepDrainDelay = 1000;
+    void sweepNext();
+    void sweepRead();
+    void sweepResponse(const QByteArray &data, quint8 respCode);
+    void finishSweep();
+
+    // Requests sent with sendRequest() are matched to their responses by destination,
+    // response SID and, for the services that echo it, the first parameter, oldest
+    // first. tp20 answers each destination in order so several can be outstanding.
+    // A negative response only names the service, so it goes to the oldest request
+    // for that service. Responses that match no request go to the handlers below.
+    // The requests kwp2000 makes itself go straight to tp20 through sendInternal()
+    // and are counted in internalPending until answered, a response they could be
+    // waiting for is never given to a sendRequest() request.
+    QList<kwpRequest> requests;
+    int nextRequestId;
+    QElapsedTimer requestClock;
+    QTimer requestTimer; // fires at the earliest deadline
+    static const int defaultRequestTimeout = 2000;
+    static const int responsePendingTimeout = 5000; // after a 7F xx 78
+    QMap<int, int> internalPending; // internalKey() to requests not answered yet
+    QMap<int, QList<QByteArray> > internalSent; // dest to the same requests, oldest first
+    static bool echoesParam(quint8 sid);
+    static int internalKey(int dest, quint8 sid, quint8 param);
+    void sendInternal(int dest, const QByteArray &data, int timeout, int priority = priorityCommand);
+    bool internalWaiting(int dest, const tpMessage &msg) const;
+    QByteArray internalAnswered(int dest, const tpMessage &msg);
+    void forgetInternal(int dest, int sid);
+    bool claimResponse(int dest, const tpMessage &msg);
+    void completeRequest(kwpRequest req, int status);
+    void cancelRequests(int dest);
+    void startRequestTimer();
+
+    // Once the session has started the timing limits (83 00) and the timing in use
+    // (83 02) are read and the module is asked (83 03) for the shortest minimum times
+    // it allows, with the maximum times no longer than they were. The defaults are
+    // set again (83 01) before the channel or port is closed. What each module
+    // accepted is kept.
+    bool fastTiming;
+    QMap<int, moduleTiming> moduleTimings; // module number
+    static const int timingRestoreTimeout = 500;
+    void applyFastTiming();
+    bool restoreTiming();
+    void queueTimingRestore();
+
+    // openPort(), closePort() and setSerialParams() wait for the answer to the 83 01,
+    // what they were asked to do is done by timingRestoreDone()
+    enum { portKeep, portOpen, portClose };
+    bool timingRestoring;
+    int portPending;
+    bool serialPending;
+    serialSettings pendingSerial;
+    static QString timingText(const QByteArray &params);
+
+    void blockDataHandler(const QByteArray &data, quint8 param);
+    void startDiagHandler(const QByteArray &data, quint8 param);
+    void miscHandler(const QByteArray &data, quint8 respCode, quint8 param);
+    void longIdHandler(const QByteArray &data);
+    void shortIdHandler(const QByteArray &data);
+    void queryModulesHandler(const QByteArray &data);
 
     QString logFileName;
     QFile* logFile;
@@ -154,10 +467,22 @@ private:
     QTextStream labelIn;
 
     QMap<int, QVector<blockValue> > currentBlocks;
-    QList<sampleValue> sample;
-    void writeSample();
+    sampleStore sample;
+    void writeSample(qint64 time);
     void updateSample(int block);
 
+    // polled and broadcast values are merged in time order before they reach the sample,
+    // updates younger than mergeHorizon are held back in case an older one is still queued
+    QElapsedTimer acquisitionClock;
+    QVector<sampleUpdate> pendingUpdates;
+    void queueSampleUpdate(qint64 time, int index, const typedValue &val);
+    void mergeSamples(qint64 upTo);
+    static const int mergeHorizon = 50;
+    QTime logStartTime;
+    qint64 logStartClock;
+    QElapsedTimer logFlushed;
+    static const int logFlushInterval = 1000;
+
     QMap<int, blockLabels_t> blockLabels;
 
     QStringList modulePartNum;
@@ -166,7 +491,7 @@ private:
     QString labelDir;
     QString findLabelFromRedir(QString partNum, QString dirStr);
 
-    QList<QByteArray> interpretRawData(QByteArray* raw);
+    QList<QByteArray> interpretRawData(const QByteArray &raw);
     QMap<int, moduleInfo_t> moduleList;
     QMap<int, int> addrToModuleMap;
 
@@ -182,6 +507,14 @@ private:
     int slowRecvTimeout;
     int normRecvTimeout;
     int fastRecvTimeout;
+
+    // tp20's response time estimates, with adaptive timeouts the block read
+    // watchdog is a few times the estimate rather than readWatchdog
+    bool adaptiveTimeouts;
+    QMap<int, rttEstimate> responseTimes; // (dest << 8) | service
+    static const int readWatchdog = 500;
+    static const int minReadWatchdog = 100;
+    int readBlockWatchdog(int dest) const;
 };
 
 #endif // KWP2000_H
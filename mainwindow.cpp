@@ -22,12 +22,17 @@ along with VAG Blocks.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <QFileInfo>
 #include <QDir>
+#include <QFileDialog>
+#include <QInputDialog>
+#include <QMessageBox>
 #include "util.h"
 
 MainWindow::MainWindow(QWidget *parent) :
     QMainWindow(parent),
     ui(new Ui::MainWindow),
     kwp(this),
+    captureDissector(this),
+    memoryUpload(&kwp, this),
     appSettings(new QSettings("vagblocks.ini", QSettings::IniFormat, this)),
     serialConfigured(false),
     storedRow(-1), storedCol(-1),
@@ -77,7 +82,11 @@ MainWindow::MainWindow(QWidget *parent) :
     connect(ui->pushButton_refresh, SIGNAL(clicked()), &kwp, SLOT(openGW_refresh()));
     connect(&kwp, SIGNAL(sampleFormatChanged()), this, SLOT(sampleFormatChanged()));
     connect(&kwp, SIGNAL(loggingStarted()), this, SLOT(loggingStarted()));
+    connect(&kwp, SIGNAL(channelParamsChosen(int, int, int, int)), this, SLOT(saveChannelParams(int, int, int, int)));
     connect(settingsDialog, SIGNAL(settingsChanged()), this, SLOT(updateSettings()));
+    connect(&captureDissector, SIGNAL(log(QString, int)), this, SLOT(log(QString, int)));
+    connect(&memoryUpload, SIGNAL(log(QString, int)), this, SLOT(log(QString, int)));
+    connect(&kwp, SIGNAL(monitoringChanged(bool)), ui->actionMonitor_broadcast, SLOT(setChecked(bool)));
 
     for (int i = 0; i < 16; i++) { // setup running average for sample rate
         avgList.append(0);
@@ -200,6 +209,17 @@ void MainWindow::restoreSettings()
     settingsDialog->load();
     updateSettings();
 
+    // block size, T1 and T3 picked by a sweep, as hex bytes keyed by module
+    appSettings->beginGroup("ChannelParams");
+    QStringList modules = appSettings->childKeys();
+    for (int i = 0; i < modules.length(); i++) {
+        QStringList params = appSettings->value(modules.at(i)).toString().split(' ', QString::SkipEmptyParts);
+        if (params.length() == 3) {
+            kwp.setModuleParams(fromHex(modules.at(i)), fromHex(params.at(0)), fromHex(params.at(1)), fromHex(params.at(2)));
+        }
+    }
+    appSettings->endGroup();
+
     restoreGeometry(appSettings->value("MainWindow/geometry").toByteArray());
     restoreState(appSettings->value("MainWindow/state").toByteArray());
 
@@ -289,13 +309,12 @@ void MainWindow::plotUpdate()
 {
     int numSamples = settingsDialog->rate * settingsDialog->historySecs + 1;
     if (curves.size() > 0) {
-        QList<sampleValue> sampleList = kwp.getSample();
+        sampleSnapshot sample = kwp.getSample().snapshot();
 
         for (int i = 0; i < curves.size(); i++) {
-            QVariant val = sampleList[i].val;
-            QMetaType::Type valType = static_cast<QMetaType::Type>(val.type());
-            if (valType == QMetaType::Double || valType == QMetaType::UInt || valType == QMetaType::Int) {
-                curves[i].data->append(sampleList[i].val.toDouble());
+            int kind = sample.kinds.at(i);
+            if (kind == numberValue || kind == rawValue) {
+                curves[i].data->append(sample.values.at(i));
             }
             else {
                 curves[i].data->append(0);
@@ -319,7 +338,7 @@ void MainWindow::sampleFormatChanged()
     curves.clear();
     timeAxis.clear();
 
-    QList<sampleValue> sampleList = kwp.getSample();
+    int numValues = kwp.getSample().size();
     int numSamples = settingsDialog->rate * settingsDialog->historySecs + 1;
 
     timeAxis.clear();
@@ -329,7 +348,7 @@ void MainWindow::sampleFormatChanged()
 
     int numColors = sizeof(colorList) / sizeof(QString);
 
-    for (int i = 0; i < sampleList.length(); i++) {
+    for (int i = 0; i < numValues; i++) {
         QwtPlotCurve* curve = new QwtPlotCurve;
         QVector<double>* data = new QVector<double>();
         data->reserve(numSamples+1);
@@ -338,10 +357,7 @@ void MainWindow::sampleFormatChanged()
         QColor curveColor;
         curveColor.setNamedColor(colorList[i % numColors]);
 
-        int blockNum = sampleList.at(i).refs.at(0).blockNum;
-        int pos = sampleList.at(i).refs.at(0).pos;
-        blockLabels_t label = kwp.getBlockLabel(blockNum);
-        QString desc = label.desc[pos] + " " + label.subDesc[pos];
+        QString desc = kwp.getSampleDesc(i);
 
         curve->setRenderHint(QwtPlotItem::RenderAntialiased);
         curve->setPen(curveColor);
@@ -414,7 +430,143 @@ void MainWindow::updateSettings()
     setupPlot();
     kwp.setLabelDir(QDir::fromNativeSeparators(settingsDialog->labelDir));
     kwp.setTimeouts(settingsDialog->slow, settingsDialog->norm, settingsDialog->fast);
+    kwp.setAdaptiveTimeouts(settingsDialog->adaptiveTimeouts);
+    kwp.setFastTiming(settingsDialog->fastTiming);
     kwp.setKeepAliveInterval(settingsDialog->keepAliveInterval);
+    kwp.setReconnectAttempts(settingsDialog->reconnectAttempts);
+
+    QStringList broadcastSignals;
+    QStringList split = settingsDialog->broadcastSignals.split(QChar(','), QString::SkipEmptyParts);
+    for (int i = 0; i < split.length(); i++) {
+        broadcastSignals << split.at(i).trimmed();
+    }
+    kwp.loadBroadcastSignals(settingsDialog->dbcFile, broadcastSignals);
+    kwp.setMonitorWindow(settingsDialog->monitorWindow, settingsDialog->monitorInterval);
+    kwp.setExtraBlocks(settingsDialog->extraBlocks);
+    kwp.setPeriodicMode(settingsDialog->periodicMode);
+    kwp.setBlockRates(settingsDialog->blockRates);
+    kwp.setMemoryVariables(settingsDialog->memoryVariables);
+}
+
+void MainWindow::on_actionDissect_capture_triggered()
+{
+    if (captureDissector.isRunning()) {
+        return;
+    }
+
+    QString captureFile = QFileDialog::getOpenFileName(this, "Select a CAN bus capture", QString(),
+                                                       "Captures (*.txt *.log);;All files (*)");
+    if (captureFile.isEmpty()) {
+        return;
+    }
+
+    QFileInfo info(captureFile);
+    QString reportFile = info.absolutePath() + "/" + info.completeBaseName() + "_dissected.txt";
+    captureDissector.dissect(captureFile, reportFile);
+}
+
+void MainWindow::on_actionMonitor_broadcast_triggered(bool checked)
+{
+    if (checked) {
+        kwp.startMonitor();
+    }
+    else {
+        kwp.stopMonitor();
+    }
+}
+
+void MainWindow::on_actionTune_channel_triggered()
+{
+    kwp.sweepParams();
+}
+
+// kept so the module is opened with them next time too
+void MainWindow::saveChannelParams(int dest, int bs, int t1, int t3)
+{
+    appSettings->setValue("ChannelParams/" + toHex(dest), toHex(bs) + " " + toHex(t1) + " " + toHex(t3));
+    appSettings->sync();
+}
+
+void MainWindow::on_actionRead_UDS_identifiers_triggered()
+{
+    bool ok;
+    QString spec = appSettings->value("UDS/identifiers", "7E0: F187 F189 F190 F191 F197").toString();
+    spec = QInputDialog::getText(this, "Read UDS identifiers", "Module ID and identifiers, eg. 7E0: F190",
+                                 QLineEdit::Normal, spec, &ok);
+    if (!ok || spec.isEmpty()) {
+        return;
+    }
+
+    appSettings->setValue("UDS/identifiers", spec);
+    kwp.readIdentifiers(spec);
+}
+
+// A file started on the same region can be carried on from where it ends
+void MainWindow::on_actionRead_memory_triggered()
+{
+    if (memoryUpload.isRunning()) {
+        memoryUpload.stop();
+        return;
+    }
+
+    bool ok;
+    QString spec = appSettings->value("Upload/region", "0 10000").toString();
+    spec = QInputDialog::getText(this, "Read module memory", "Hex start address and length, eg. 0 10000",
+                                 QLineEdit::Normal, spec, &ok);
+    if (!ok || spec.isEmpty()) {
+        return;
+    }
+
+    QStringList parts = spec.split(QChar(' '), QString::SkipEmptyParts);
+    bool addressOk = false;
+    bool lengthOk = false;
+    int address = parts.length() == 2 ? parts.at(0).toInt(&addressOk, 16) : 0;
+    int length = parts.length() == 2 ? parts.at(1).toInt(&lengthOk, 16) : 0;
+    if (!addressOk || !lengthOk) {
+        log("Error: Could not read the memory region " + spec);
+        return;
+    }
+    appSettings->setValue("Upload/region", spec);
+
+    QString fileName = QFileDialog::getSaveFileName(this, "Save memory to", QString(),
+                                                    "Binary files (*.bin);;All files (*)", 0,
+                                                    QFileDialog::DontConfirmOverwrite);
+    if (fileName.isEmpty()) {
+        return;
+    }
+
+    bool resume = false;
+    qint64 existing = memupload::resumableBytes(fileName, address, length);
+    if (existing > 0) {
+        QMessageBox::StandardButton answer = QMessageBox::question(this, "Read module memory",
+                QString::number(existing) + " bytes of this region are already in " + fileName +
+                ". Carry on from there? No starts again.",
+                QMessageBox::Yes | QMessageBox::No | QMessageBox::Cancel);
+        if (answer == QMessageBox::Cancel) {
+            return;
+        }
+        resume = answer == QMessageBox::Yes;
+    }
+    else if (existing < 0) {
+        if (QMessageBox::question(this, "Read module memory",
+                                  fileName + " already exists and can't be carried on. Replace it?",
+                                  QMessageBox::Yes | QMessageBox::No) != QMessageBox::Yes) {
+            return;
+        }
+    }
+
+    memoryUpload.start(address, length, fileName, resume);
+}
+
+void MainWindow::on_actionResponse_times_triggered()
+{
+    QStringList lines = kwp.getResponseTimes();
+    if (lines.empty()) {
+        log("No response times measured yet");
+    }
+    for (int i = 0; i < lines.length(); i++) {
+        log(lines.at(i));
+    }
 }
 
 void MainWindow::newBlockData(int blockNum)
@@ -487,6 +639,8 @@ void MainWindow::newBlockData(int blockNum)
 
     ui->lcdNumber->display(runningAvg);
     perfTimer[row].start();
+
+    blockDisplays[row].blockTitle->setToolTip(QString::number(kwp.getBlockRate(blockNum), 'f', 1) + " reads/s");
 }
 
 void MainWindow::connectToSerial()
@@ -562,7 +716,7 @@ void MainWindow::portClosed()
 
 void MainWindow::on_pushButton_openModule_clicked()
 {
-    if (kwp.getChannelDest() >= 0) {
+    if (kwp.getChannelDest() >= 0 || kwp.getReconnecting()) {
         QMetaObject::invokeMethod(&kwp, "closeChannel", Qt::QueuedConnection);
     }
     else {
@@ -721,7 +875,7 @@ void MainWindow::on_actionReset_docks_triggered()
 void MainWindow::startLogging(bool start)
 {
     if (start) {
-        if (kwp.getNumBlocksOpen() <= 0) {
+        if (kwp.getSample().isEmpty()) {
             ui->pushButton_log->setChecked(false);
             return;
         }
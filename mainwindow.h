@@ -34,6 +34,8 @@ along with VAG Blocks.  If not, see <http://www.gnu.org/licenses/>.
 #include "clicklineedit.h"
 #include "about.h"
 #include "settings.h"
+#include "dissector.h"
+#include "memupload.h"
 
 #include "qwt_plot.h"
 #include "qwt_plot_curve.h"
@@ -82,6 +84,8 @@ private:
     settings* settingsDialog;
 
     kwp2000 kwp;
+    dissector captureDissector;
+    memupload memoryUpload;
     blockWidgets blockDisplays[4];
     QSignalMapper mapButtons;
     QSignalMapper mapValueClick;
@@ -148,6 +152,13 @@ private slots:
     void showCurve(QwtPlotItem *item, bool on);
     void loggingStarted();
     void updateSettings();
+    void on_actionDissect_capture_triggered();
+    void on_actionMonitor_broadcast_triggered(bool checked);
+    void on_actionTune_channel_triggered();
+    void saveChannelParams(int dest, int bs, int t1, int t3);
+    void on_actionResponse_times_triggered();
+    void on_actionRead_memory_triggered();
+    void on_actionRead_UDS_identifiers_triggered();
 };
 
 #endif // MAINWINDOW_H
@@ -0,0 +1,377 @@
+/*
+Copyright 2013 Jared Wiltshire
+
+This file is part of VAG Blocks.
+
+VAG Blocks is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+VAG Blocks is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with VAG Blocks.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "memupload.h"
+
+#include <QFileInfo>
+
+memupload::memupload(kwp2000 *kwp, QObject *parent) :
+    QObject(parent),
+    kwp(kwp),
+    running(false),
+    mode(modeRequestUpload),
+    regionStart(0),
+    regionEnd(0),
+    resumeAddress(0),
+    nextAddress(0),
+    writtenAddress(0),
+    blockLength(0),
+    chunkSize(maxReadChunk),
+    failures(0),
+    outstandingId(-1)
+{
+    reportTimer.setInterval(reportInterval);
+    connect(&reportTimer, SIGNAL(timeout()), this, SLOT(report()));
+
+    drainTimer.setInterval(drainDelay);
+    drainTimer.setSingleShot(true);
+    connect(&drainTimer, SIGNAL(timeout()), this, SLOT(drained()));
+}
+
+bool memupload::isRunning() const
+{
+    return running;
+}
+
+QString memupload::regionText(int address, int length)
+{
+    return toHex(address, 6) + " " + toHex(length, 6);
+}
+
+// Bytes already read into fileName for this region, 0 if there's no file or it's
+// empty, -1 if it holds something else or all of the region
+qint64 memupload::resumableBytes(const QString &fileName, int address, int length)
+{
+    QFileInfo info(fileName);
+    if (!info.exists() || info.size() == 0) {
+        return 0;
+    }
+
+    QFile region(fileName + ".region");
+    if (!region.open(QIODevice::ReadOnly | QIODevice::Text) ||
+            QString(region.readLine()).trimmed() != regionText(address, length) || info.size() >= length) {
+        return -1;
+    }
+    return info.size();
+}
+
+void memupload::start(int address, int length, const QString &fileName, bool resume)
+{
+    if (running) {
+        return;
+    }
+
+    if (kwp->getChannelDest() < 0) {
+        emit log("Open a module before reading its memory");
+        return;
+    }
+
+    if (address < 0 || length <= 0 || address + length > 0x1000000) {
+        emit log("Error: The memory region has to fit in 24 bit addresses");
+        return;
+    }
+
+    qint64 existing = 0;
+    if (resume) {
+        existing = resumableBytes(fileName, address, length);
+        if (existing < 0) {
+            emit log("Error: " + fileName + " was not started on this region, it can't be carried on");
+            return;
+        }
+    }
+
+    file.setFileName(fileName);
+    if (!file.open(QIODevice::WriteOnly | (existing > 0 ? QIODevice::Append : QIODevice::Truncate))) {
+        emit log("Error: Could not open " + fileName);
+        return;
+    }
+
+    QFile region(fileName + ".region");
+    if (!region.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Text)) {
+        emit log("Error: Could not open " + region.fileName());
+        file.close();
+        return;
+    }
+    region.write(regionText(address, length).toAscii() + "\n");
+    region.close();
+
+    regionStart = address;
+    regionEnd = address + length;
+    resumeAddress = address + existing;
+    nextAddress = resumeAddress;
+    writtenAddress = resumeAddress;
+    chunkSize = maxReadChunk;
+    failures = 0;
+    outstandingId = -1;
+    retries.clear();
+    running = true;
+
+    if (existing > 0) {
+        emit log("Resuming the memory read at 0x" + toHex(resumeAddress, 6) + ", " +
+                 QString::number(existing) + " bytes are already in " + fileName);
+    }
+    else {
+        emit log("Reading " + QString::number(length) + " bytes of memory from 0x" + toHex(address, 6) +
+                 " to " + fileName);
+    }
+
+    kwp->pauseReads(true);
+    kwp->useMaxBlockSize();
+    clock.start();
+    reportTimer.start();
+
+    // address, uncompressed and unencrypted, size
+    int remaining = regionEnd - resumeAddress;
+    QByteArray packet;
+    packet.append(0x35);
+    packet.append(resumeAddress >> 16);
+    packet.append(resumeAddress >> 8);
+    packet.append(resumeAddress);
+    packet.append(static_cast<char>(0x00));
+    packet.append(remaining >> 16);
+    packet.append(remaining >> 8);
+    packet.append(remaining);
+
+    mode = modeRequestUpload;
+    if (kwp->sendRequest(packet, 0, -1, this, "uploadStarted") < 0) {
+        finish(false);
+    }
+}
+
+void memupload::stop()
+{
+    if (!running) {
+        return;
+    }
+
+    emit log("Memory read stopped at 0x" + toHex(writtenAddress, 6) + ", it can be resumed into the same file");
+    finish(false);
+}
+
+// 75 then the longest 0x76 the module sends
+void memupload::uploadStarted(const kwpResult &result)
+{
+    if (!running || mode != modeRequestUpload) {
+        return;
+    }
+
+    if (result.status == requestCancelled) {
+        emit log("Error: The channel closed during the memory read");
+        finish(false);
+        return;
+    }
+
+    if (result.status == requestTimedOut) {
+        drainTimer.start(); // a late 0x75 isn't taken for a 0x63
+    }
+
+    if (result.status != requestPositive || result.response.length() < 2) {
+        emit log("Module did not accept requestUpload, " + kwp2000::requestStatusText(result) +
+                 ", reading with readMemoryByAddress");
+        mode = modeReadMemory;
+        fill();
+        return;
+    }
+
+    blockLength = qMax(static_cast<quint8>(result.response.at(1)) - 1, 1);
+    mode = modeTransferData;
+    fill();
+}
+
+// transferData has no address or sequence number, each 0x36 is answered with the
+// next block
+void memupload::fill()
+{
+    if (!running || outstandingId >= 0 || drainTimer.isActive()) {
+        return;
+    }
+
+    if (mode == modeTransferData) {
+        if (writtenAddress >= regionEnd) {
+            return;
+        }
+
+        QByteArray packet;
+        packet.append(0x36);
+        outstanding.address = writtenAddress;
+        outstanding.length = blockLength;
+        outstandingId = kwp->sendRequest(packet, 0, -1, this, "chunkDone");
+        if (outstandingId < 0) {
+            finish(false);
+        }
+    }
+    else if (mode == modeReadMemory) {
+        uploadChunk chunk;
+        if (!retries.empty()) {
+            chunk = retries.takeFirst();
+        }
+        else if (nextAddress < regionEnd) {
+            chunk.address = nextAddress;
+            chunk.length = qMin(chunkSize, regionEnd - nextAddress);
+            nextAddress += chunk.length;
+        }
+        else {
+            return;
+        }
+        readMemory(chunk);
+    }
+}
+
+// Anything that turned up late has gone to kwp2000's handlers by now
+void memupload::drained()
+{
+    fill();
+}
+
+void memupload::readMemory(const uploadChunk &chunk)
+{
+    QByteArray packet;
+    packet.append(0x23);
+    packet.append(chunk.address >> 16);
+    packet.append(chunk.address >> 8);
+    packet.append(chunk.address);
+    packet.append(chunk.length);
+
+    outstanding = chunk;
+    outstandingId = kwp->sendRequest(packet, 0, -1, this, "chunkDone");
+    if (outstandingId < 0) {
+        finish(false);
+    }
+}
+
+void memupload::chunkDone(const kwpResult &result)
+{
+    if (!running || result.id != outstandingId) {
+        return; // sent before stopping
+    }
+    uploadChunk chunk = outstanding;
+    outstandingId = -1;
+
+    if (result.status == requestCancelled) {
+        emit log("Error: The channel closed during the memory read");
+        finish(false);
+        return;
+    }
+
+    // its answer may still be on the way, the next request mustn't be given it
+    if (result.status == requestTimedOut) {
+        drainTimer.start();
+    }
+
+    if (mode == modeTransferData) {
+        if (result.status != requestPositive || result.response.length() < 2) {
+            emit log("Warning: transferData failed at 0x" + toHex(writtenAddress, 6) + ", " +
+                     kwp2000::requestStatusText(result) + ", reading the rest with readMemoryByAddress");
+            fallBack();
+            return;
+        }
+        store(writtenAddress, result.response.mid(1));
+        fill();
+        return;
+    }
+
+    if (result.status == requestPositive && result.response.length() == chunk.length + 1) {
+        failures = 0;
+        store(chunk.address, result.response.mid(1));
+        fill();
+        return;
+    }
+
+    if (++failures > maxFailures) {
+        emit log("Error: Could not read memory at 0x" + toHex(chunk.address, 6) + ", " +
+                 kwp2000::requestStatusText(result));
+        finish(false);
+        return;
+    }
+
+    // a refusal may only be the length, ask for less from then on
+    if (result.status == requestNegative && chunk.length > minReadChunk) {
+        chunkSize = qMax(chunk.length / 2, static_cast<int>(minReadChunk));
+        uploadChunk rest = {chunk.address + chunkSize, chunk.length - chunkSize};
+        chunk.length = chunkSize;
+        retries.prepend(rest);
+    }
+    retries.prepend(chunk);
+    fill();
+}
+
+// The module's upload is ended, the position it had got to is where 0x23 carries on
+void memupload::fallBack()
+{
+    QByteArray packet;
+    packet.append(0x37);
+    kwp->sendRequest(packet);
+
+    mode = modeReadMemory;
+    nextAddress = writtenAddress;
+    fill();
+}
+
+// Chunks are asked for one at a time in address order, a retried one is asked for
+// again before anything after it
+void memupload::store(int address, const QByteArray &data)
+{
+    QByteArray next = data.left(regionEnd - address);
+    file.write(next);
+    writtenAddress += next.length();
+
+    if (writtenAddress >= regionEnd) {
+        finish(true);
+    }
+}
+
+void memupload::finish(bool ok)
+{
+    if (!running) {
+        return;
+    }
+    running = false;
+    reportTimer.stop();
+    drainTimer.stop();
+
+    if (mode == modeTransferData && kwp->getChannelDest() >= 0) {
+        QByteArray packet;
+        packet.append(0x37);
+        kwp->sendRequest(packet);
+    }
+
+    outstandingId = -1;
+    retries.clear();
+    file.close();
+    kwp->restoreBlockSize();
+    kwp->pauseReads(false);
+
+    if (ok) {
+        qint64 msecs = qMax(clock.elapsed(), Q_INT64_C(1));
+        emit log("Memory read finished, " + QString::number(writtenAddress - resumeAddress) + " bytes in " +
+                 QString::number(msecs / 1000.0, 'f', 1) + "s, " +
+                 QString::number((writtenAddress - resumeAddress) * 1000.0 / msecs, 'f', 0) + " bytes/s");
+    }
+    emit finished(ok);
+}
+
+void memupload::report()
+{
+    qint64 msecs = clock.elapsed();
+    double rate = msecs > 0 ? (writtenAddress - resumeAddress) * 1000.0 / msecs : 0;
+    emit progress(writtenAddress - regionStart, regionEnd - regionStart, rate);
+    emit log("Memory read: " + QString::number(writtenAddress - regionStart) + " of " +
+             QString::number(regionEnd - regionStart) + " bytes, " + QString::number(rate, 'f', 0) + " bytes/s");
+}
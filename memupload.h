@@ -0,0 +1,106 @@
+/*
+Copyright 2013 Jared Wiltshire
+
+This file is part of VAG Blocks.
+
+VAG Blocks is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+VAG Blocks is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with VAG Blocks.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef MEMUPLOAD_H
+#define MEMUPLOAD_H
+
+#include <QObject>
+#include <QFile>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QMap>
+
+#include "kwp2000.h"
+#include "util.h"
+
+typedef struct {
+    int address;
+    int length; // bytes asked for, for transferData what the module said it sends
+} uploadChunk;
+
+// Copies a region of the open module's memory to a file. requestUpload (0x35) is
+// tried first and the data fetched with transferData (0x36), if the module refuses
+// it or the transfer goes wrong the rest is read with readMemoryByAddress (0x23).
+// Neither response says which address it holds, so only one request is outstanding
+// at a time and after a timeout nothing is asked for until a late answer has had
+// time to arrive and be thrown away. Reads of the blocks are paused meanwhile so
+// tp20 sends each request as soon as it's queued.
+// The region is kept beside the file in fileName.region, a file can only be
+// carried on from where it ends if it was started on the same region.
+class memupload : public QObject
+{
+    Q_OBJECT
+public:
+    explicit memupload(kwp2000 *kwp, QObject *parent = 0);
+    bool isRunning() const;
+    static qint64 resumableBytes(const QString &fileName, int address, int length);
+signals:
+    void log(const QString &txt, int logLevel = stdLog);
+    void progress(qint64 done, qint64 total, double bytesPerSec);
+    void finished(bool ok);
+public slots:
+    void start(int address, int length, const QString &fileName, bool resume);
+    void stop();
+private slots:
+    void uploadStarted(const kwpResult &result);
+    void chunkDone(const kwpResult &result);
+    void drained();
+    void report();
+private:
+    enum uploadModes {
+        modeRequestUpload, // waiting for the 0x75
+        modeTransferData,
+        modeReadMemory
+    };
+
+    kwp2000 *kwp;
+    bool running;
+    int mode;
+    QFile file;
+    int regionStart;
+    int regionEnd;
+    int resumeAddress; // where this run started, for the rate
+    int nextAddress; // next to ask for with 0x23
+    int writtenAddress; // next to go to the file
+    int blockLength; // data in each 0x76
+    int chunkSize; // data asked for with each 0x23
+    int failures; // in a row
+    int outstandingId; // -1 when nothing is outstanding
+    uploadChunk outstanding;
+    QList<uploadChunk> retries; // sent before anything new
+    QElapsedTimer clock;
+    QTimer reportTimer;
+    QTimer drainTimer; // runs after a timeout, nothing is sent until it fires
+
+    static const int drainDelay = 1000;
+    static const int maxReadChunk = 0xFE;
+    static const int minReadChunk = 16;
+    static const int maxFailures = 5;
+    static const int reportInterval = 1000;
+
+    static QString regionText(int address, int length);
+    void fill();
+    void readMemory(const uploadChunk &chunk);
+    void fallBack();
+    void store(int address, const QByteArray &data);
+    void finish(bool ok);
+};
+
+#endif // MEMUPLOAD_H
@@ -0,0 +1,153 @@
+/*
+Copyright 2013 Jared Wiltshire
+
+This file is part of VAG Blocks.
+
+VAG Blocks is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+VAG Blocks is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with VAG Blocks.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "messagepool.h"
+
+#include <string.h>
+
+QMutex messagePool::lock;
+QList<pooledBuffer*> messagePool::freeBuffers;
+
+tpMessage::tpMessage() :
+    buf(0)
+{
+}
+
+tpMessage::tpMessage(pooledBuffer *buf) :
+    buf(buf)
+{
+    buf->ref.ref();
+}
+
+tpMessage::tpMessage(const tpMessage &other) :
+    buf(other.buf)
+{
+    if (buf) {
+        buf->ref.ref();
+    }
+}
+
+tpMessage::~tpMessage()
+{
+    if (buf && !buf->ref.deref()) {
+        messagePool::release(buf);
+    }
+}
+
+tpMessage &tpMessage::operator=(const tpMessage &other)
+{
+    if (other.buf) {
+        other.buf->ref.ref();
+    }
+    if (buf && !buf->ref.deref()) {
+        messagePool::release(buf);
+    }
+    buf = other.buf;
+    return *this;
+}
+
+bool tpMessage::isNull() const
+{
+    return !buf;
+}
+
+int tpMessage::length() const
+{
+    return buf ? buf->length : 0;
+}
+
+quint8 tpMessage::at(int i) const
+{
+    return static_cast<quint8>(buf->storage.at(i));
+}
+
+const char *tpMessage::constData() const
+{
+    return buf ? buf->storage.constData() : 0;
+}
+
+// The returned array points into the pooled buffer rather than copying it, so
+// it's only valid while a handle to the message is held
+QByteArray tpMessage::bytes(int from) const
+{
+    if (!buf || from >= buf->length) {
+        return QByteArray();
+    }
+    return QByteArray::fromRawData(buf->storage.constData() + from, buf->length - from);
+}
+
+void tpMessage::append(const char *data, int len)
+{
+    if (!buf || len <= 0) {
+        return;
+    }
+
+    if (buf->length + len > buf->storage.size()) { // more than the first frame said
+        buf->storage.resize(qMax(buf->storage.size() * 2, buf->length + len));
+    }
+
+    memcpy(buf->storage.data() + buf->length, data, len);
+    buf->length += len;
+}
+
+// Hands out the free buffer that fits size most closely, a new buffer is only
+// made when none are free
+tpMessage messagePool::acquire(int size)
+{
+    pooledBuffer *buf = 0;
+
+    lock.lock();
+    int best = -1;
+    for (int i = 0; i < freeBuffers.length(); i++) {
+        int capacity = freeBuffers.at(i)->storage.size();
+        if (capacity >= size && (best < 0 || capacity < freeBuffers.at(best)->storage.size())) {
+            best = i;
+        }
+    }
+    if (best < 0 && !freeBuffers.empty()) {
+        best = 0; // none big enough, grow one
+    }
+    if (best >= 0) {
+        buf = freeBuffers.takeAt(best);
+    }
+    lock.unlock();
+
+    if (!buf) {
+        buf = new pooledBuffer;
+        buf->ref = 0;
+    }
+    if (buf->storage.size() < size || buf->storage.size() < minSize) {
+        buf->storage.resize(qMax(size, int(minSize)));
+    }
+    buf->length = 0;
+
+    return tpMessage(buf);
+}
+
+void messagePool::release(pooledBuffer *buf)
+{
+    lock.lock();
+    if (freeBuffers.length() < maxFree) {
+        freeBuffers.append(buf);
+        buf = 0;
+    }
+    lock.unlock();
+
+    delete buf;
+}
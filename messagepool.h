@@ -0,0 +1,73 @@
+/*
+Copyright 2013 Jared Wiltshire
+
+This file is part of VAG Blocks.
+
+VAG Blocks is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+VAG Blocks is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with VAG Blocks.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MESSAGEPOOL_H
+#define MESSAGEPOOL_H
+
+#include <QByteArray>
+#include <QAtomicInt>
+#include <QMutex>
+#include <QList>
+#include <QMetaType>
+
+typedef struct {
+    QAtomicInt ref;
+    QByteArray storage; // sized to the capacity, only the first length bytes are used
+    int length;
+} pooledBuffer;
+
+// Handle to a reassembled TP2.0 message. Copies share the same buffer, which goes
+// back to the pool when the last handle is destroyed. Only the owner filling the
+// message may append to it, after that it's read only.
+class tpMessage
+{
+public:
+    tpMessage();
+    tpMessage(const tpMessage &other);
+    ~tpMessage();
+    tpMessage &operator=(const tpMessage &other);
+    bool isNull() const;
+    int length() const;
+    quint8 at(int i) const;
+    const char *constData() const;
+    QByteArray bytes(int from = 0) const;
+    void append(const char *data, int len);
+private:
+    friend class messagePool;
+    explicit tpMessage(pooledBuffer *buf);
+    pooledBuffer *buf;
+};
+
+Q_DECLARE_METATYPE(tpMessage)
+
+class messagePool
+{
+public:
+    static tpMessage acquire(int size);
+private:
+    friend class tpMessage;
+    static void release(pooledBuffer *buf);
+
+    static QMutex lock;
+    static QList<pooledBuffer*> freeBuffers;
+    static const int minSize = 256;
+    static const int maxFree = 16;
+};
+
+#endif // MESSAGEPOOL_H
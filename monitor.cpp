@@ -19,44 +19,93 @@ along with VAG Blocks.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "monitor.h"
 
+#include "util.h"
+
 #include <QCoreApplication>
 
 monitor::monitor(elm327 *elm, QObject *parent) :
     QObject(parent),
     elm(elm),
+    decoder(0),
+    windowTime(0),
+    windowFilterID(0),
+    windowFilterMask(0),
+    windowRestoreID(0),
     filename("canLog.txt"),
     outFile(0),
     monitoring(false)
 {
 }
 
+// decoder must not be changed while monitoring
+void monitor::setDecoder(const dbc *decoder)
+{
+    this->decoder = decoder;
+}
+
+// timestamps on decoded frames are taken from this clock so they line up with the
+// owner's timestamps on polled data
+void monitor::setClock(const QElapsedTimer &clock)
+{
+    this->clock = clock;
+}
+
+// must not be changed while a window is running
+void monitor::setWindow(int msecs, int filterID, int filterMask, int restoreID)
+{
+    windowTime = msecs;
+    windowFilterID = filterID;
+    windowFilterMask = filterMask;
+    windowRestoreID = restoreID;
+}
+
+bool monitor::getMonitoring() const
+{
+    return monitoring;
+}
+
 void monitor::start()
 {
     outFile = new QFile(filename, this);
     outFile->open(QIODevice::WriteOnly);
     out.setDevice(outFile);
 
+    if (decoder) {
+        values.fill(0, decoder->getNumSignals());
+    }
+
     QString line;
+    int status;
     monitoring = true;
     int timeoutCount = 0;
 
-    elm->write(QString("ATMA"));
+    // clear the receive filter left behind by the TP2.0 channel
+    QMetaObject::invokeMethod(elm, "write", Qt::QueuedConnection, Q_ARG(QString, "AT CRA"));
+    elm->getResponseStatus(status);
+
+    QMetaObject::invokeMethod(elm, "write", Qt::QueuedConnection, Q_ARG(QString, "ATMA"));
 
-    while (monitoring || timeoutCount >= 5) {
+    // read until the prompt is returned after stop() or the adapter goes quiet
+    while (timeoutCount < 5) {
         line = elm->getLine();
         if (line == "") {
             timeoutCount++;
+            sendBatch();
+            continue;
         }
+        timeoutCount = 0;
 
         if (line == ">") {
-            monitoring = false;
+            break;
         }
 
-        out << line << endl;
-
-        //QCoreApplication::processEvents();
+        out << line << '\n';
+        processLine(line);
     }
 
+    monitoring = false;
+    sendBatch();
+
     out.flush();
     out.setDevice(0);
     outFile->close();
@@ -66,8 +115,95 @@ void monitor::start()
     emit done();
 }
 
+// Monitors only the IDs passing the window filter for the window time, then puts
+// the receive filter back to the restore ID so an open TP2.0 channel can carry on.
+// Unlike start() nothing is written to the capture file.
+void monitor::window()
+{
+    int status;
+    bool promptSeen = false;
+
+    if (decoder && values.size() != decoder->getNumSignals()) {
+        values.fill(0, decoder->getNumSignals());
+    }
+
+    QMetaObject::invokeMethod(elm, "write", Qt::QueuedConnection, Q_ARG(QString, "AT CF " + toHex(windowFilterID, 3)));
+    elm->getResponseStatus(status);
+    QMetaObject::invokeMethod(elm, "write", Qt::QueuedConnection, Q_ARG(QString, "AT CM " + toHex(windowFilterMask, 3)));
+    elm->getResponseStatus(status);
+
+    QElapsedTimer windowTimer;
+    windowTimer.start();
+    QMetaObject::invokeMethod(elm, "write", Qt::QueuedConnection, Q_ARG(QString, "ATMA"));
+
+    int remaining;
+    while ((remaining = windowTime - windowTimer.elapsed()) > 0) {
+        QString line = elm->getLine(remaining);
+        if (line == ">") { // adapter stopped by itself, eg. buffer full
+            promptSeen = true;
+            break;
+        }
+        processLine(line);
+    }
+
+    if (!promptSeen) {
+        QMetaObject::invokeMethod(elm, "write", Qt::QueuedConnection, Q_ARG(QString, "."));
+        for (int timeoutCount = 0; timeoutCount < 5;) {
+            QString line = elm->getLine();
+            if (line == "") {
+                timeoutCount++;
+                continue;
+            }
+            if (line == ">") {
+                break;
+            }
+            processLine(line);
+        }
+    }
+
+    QMetaObject::invokeMethod(elm, "write", Qt::QueuedConnection, Q_ARG(QString, "AT CRA " + toHex(windowRestoreID, 3)));
+    elm->getResponseStatus(status);
+
+    sendBatch();
+    emit windowDone();
+}
+
+void monitor::processLine(const QString &line)
+{
+    capturedFrame frame;
+    if (decoder && parseFrameLine(line, frame)) {
+        if (decoder->decode(frame.canID, frame.data, values)) {
+            const QVector<int> &frameSignals = decoder->getSignalsForID(frame.canID);
+            for (int i = 0; i < frameSignals.size(); i++) {
+                batch.values.append(values.at(frameSignals.at(i)));
+            }
+            batch.canIDs.append(frame.canID);
+            batch.times.append(clock.elapsed());
+        }
+    }
+
+    if (!batch.times.empty() && clock.elapsed() - batch.times.first() >= batchInterval) {
+        sendBatch();
+    }
+}
+
+void monitor::sendBatch()
+{
+    if (batch.canIDs.empty()) {
+        return;
+    }
+    emit broadcastData(batch);
+    batch.canIDs.clear();
+    batch.times.clear();
+    batch.values.clear();
+}
+
+// called directly from another thread, start() is blocking the monitor's thread
 void monitor::stop()
 {
+    if (!monitoring) {
+        return;
+    }
     monitoring = false;
-    elm->write(QString("."));
+    QMetaObject::invokeMethod(elm, "write", Qt::QueuedConnection, Q_ARG(QString, "."));
 }
@@ -24,27 +24,61 @@ along with VAG Blocks.  If not, see <http://www.gnu.org/licenses/>.
 #include <QFile>
 #include <QTextStream>
 
+#include <QVector>
+#include <QElapsedTimer>
+#include <QMetaType>
+
 #include "elm327.h"
+#include "dbc.h"
+
+// Frames decoded since the last broadcastData, sent together so a busy bus costs one
+// queued signal and one set of vectors per batch rather than per frame. values holds
+// each frame's signals in the order dbc::getSignalsForID gives them.
+typedef struct {
+    QVector<int> canIDs;
+    QVector<qint64> times;
+    QVector<double> values;
+} broadcastBatch;
+Q_DECLARE_METATYPE(broadcastBatch)
 
 class monitor : public QObject
 {
     Q_OBJECT
 public:
     explicit monitor(elm327* elm, QObject *parent = 0);
-    
+    void setDecoder(const dbc* decoder);
+    void setClock(const QElapsedTimer &clock);
+    void setWindow(int msecs, int filterID, int filterMask, int restoreID);
+    bool getMonitoring() const;
 signals:
     void done();
+    void windowDone();
+    void broadcastData(const broadcastBatch &batch);
 public slots:
     void start();
     void stop();
+    void window();
 private:
     elm327* elm;
+    const dbc* decoder;
+    QVector<double> values; // scratch for the decoder, indexed by signal
+    broadcastBatch batch;
+    QElapsedTimer clock;
+    // kept under kwp2000's merge horizon so a batch arrives before its samples are written
+    static const int batchInterval = 20;
+    int windowTime;
+    int windowFilterID;
+    int windowFilterMask;
+    int windowRestoreID;
+
+    void processLine(const QString &line);
+    void sendBatch();
 
     QString filename;
     QFile* outFile;
     QTextStream out;
 
-    bool monitoring;
+    volatile bool monitoring;
 };
 
 #endif // MONITOR_H
@@ -0,0 +1,174 @@
+/*
+Copyright 2013 Jared Wiltshire
+
+This file is part of VAG Blocks.
+
+VAG Blocks is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+VAG Blocks is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with VAG Blocks.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "samplestore.h"
+#include "blockdecoder.h"
+
+// The decoder's units come first so the IDs it gives can be stored as they are,
+// ID 0 is no units
+static QStringList builtinUnits()
+{
+    QStringList names;
+    for (int i = 0; i < numBlockUnits; i++) {
+        names << QString::fromUtf8(blockDecoder::unitsText(i));
+    }
+    return names;
+}
+
+static QHash<QString, int> builtinUnitIDs()
+{
+    QHash<QString, int> ids;
+    for (int i = 0; i < numBlockUnits; i++) {
+        ids.insert(QString::fromUtf8(blockDecoder::unitsText(i)), i);
+    }
+    return ids;
+}
+
+QStringList sampleStore::unitNames = builtinUnits();
+QHash<QString, int> sampleStore::unitIDs = builtinUnitIDs();
+
+sampleStore::sampleStore()
+{
+}
+
+void sampleStore::clear()
+{
+    columns.values.clear();
+    columns.kinds.clear();
+    columns.units.clear();
+    columns.times.clear();
+    refs.clear();
+    texts.clear();
+}
+
+// Adds a channel with no value yet, returns its index
+int sampleStore::append(const blockRef &ref, int units)
+{
+    columns.values.append(0);
+    columns.kinds.append(noValue);
+    columns.units.append(units);
+    columns.times.append(0);
+    refs.append(ref);
+    return refs.size() - 1;
+}
+
+int sampleStore::size() const
+{
+    return refs.size();
+}
+
+bool sampleStore::isEmpty() const
+{
+    return refs.isEmpty();
+}
+
+void sampleStore::set(int i, const typedValue &val, qint64 time)
+{
+    if (val.kind == textValue) {
+        texts.insert(i, val.text);
+    }
+    else if (columns.kinds.at(i) == textValue) {
+        texts.remove(i);
+    }
+
+    columns.values[i] = val.val;
+    columns.kinds[i] = val.kind;
+    columns.units[i] = val.units;
+    columns.times[i] = time;
+}
+
+double sampleStore::value(int i) const
+{
+    return columns.values.at(i);
+}
+
+int sampleStore::kind(int i) const
+{
+    return columns.kinds.at(i);
+}
+
+int sampleStore::units(int i) const
+{
+    return columns.units.at(i);
+}
+
+qint64 sampleStore::time(int i) const
+{
+    return columns.times.at(i);
+}
+
+const blockRef& sampleStore::ref(int i) const
+{
+    return refs.at(i);
+}
+
+// as written to the log file
+QString sampleStore::toString(int i) const
+{
+    switch (columns.kinds.at(i)) {
+    case numberValue:
+        return QString::number(columns.values.at(i), 'g', 15);
+    case rawValue:
+        return QString::number(static_cast<uint>(columns.values.at(i)));
+    case textValue:
+        return texts.value(i);
+    default:
+        return QString();
+    }
+}
+
+sampleSnapshot sampleStore::snapshot() const
+{
+    return columns;
+}
+
+int sampleStore::internUnits(const QString &units)
+{
+    QHash<QString, int>::const_iterator it = unitIDs.constFind(units);
+    if (it != unitIDs.constEnd()) {
+        return it.value();
+    }
+
+    unitNames.append(units);
+    unitIDs.insert(units, unitNames.size() - 1);
+    return unitNames.size() - 1;
+}
+
+QString sampleStore::unitsName(int id)
+{
+    if (id < 0 || id >= unitNames.size()) {
+        return unitNames.at(0);
+    }
+    return unitNames.at(id);
+}
+
+QVariant sampleStore::toVariant(const typedValue &val)
+{
+    switch (val.kind) {
+    case numberValue:
+        return val.val;
+    case rawValue:
+        return static_cast<uint>(val.val);
+    case textValue:
+        return val.text;
+    default:
+        return QVariant();
+    }
+}
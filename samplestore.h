@@ -0,0 +1,91 @@
+/*
+Copyright 2013 Jared Wiltshire
+
+This file is part of VAG Blocks.
+
+VAG Blocks is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+VAG Blocks is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with VAG Blocks.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef SAMPLESTORE_H
+#define SAMPLESTORE_H
+
+#include <QVector>
+#include <QString>
+#include <QStringList>
+#include <QHash>
+#include <QVariant>
+
+typedef struct {
+    int blockNum;
+    int pos;
+} blockRef;
+
+enum sampleKind {
+    noValue, // not read yet
+    numberValue,
+    rawValue, // undecoded or a bit field, shown in hex
+    textValue
+};
+
+typedef struct {
+    int kind;
+    double val;
+    int units; // from sampleStore::internUnits()
+    QString text; // textValue only
+} typedValue;
+
+// The store's arrays, shared. Taking one only costs a reference count, the store
+// copies an array the next time it writes to it while a snapshot still holds it.
+typedef struct {
+    QVector<double> values;
+    QVector<qint8> kinds;
+    QVector<quint16> units;
+    QVector<qint64> times; // msecs on the acquisition clock, 0 if never set
+} sampleSnapshot;
+
+// The latest value of everything in the sample, one entry per channel kept in
+// parallel arrays so writing and reading a sample doesn't allocate. Units are
+// interned and each channel holds a small ID.
+class sampleStore
+{
+public:
+    sampleStore();
+    void clear();
+    int append(const blockRef &ref, int units = 0);
+    int size() const;
+    bool isEmpty() const;
+
+    void set(int i, const typedValue &val, qint64 time);
+    double value(int i) const;
+    int kind(int i) const;
+    int units(int i) const;
+    qint64 time(int i) const;
+    const blockRef& ref(int i) const;
+    QString toString(int i) const;
+    sampleSnapshot snapshot() const;
+
+    static int internUnits(const QString &units);
+    static QString unitsName(int id);
+    static QVariant toVariant(const typedValue &val);
+private:
+    sampleSnapshot columns;
+    QVector<blockRef> refs; // first block value (or signal) feeding each channel
+    QHash<int, QString> texts; // channels holding a textValue
+
+    static QStringList unitNames;
+    static QHash<QString, int> unitIDs;
+};
+
+#endif // SAMPLESTORE_H
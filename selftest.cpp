@@ -0,0 +1,72 @@
+/*
+Copyright 2013 Jared Wiltshire
+
+This file is part of VAG Blocks.
+
+VAG Blocks is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+VAG Blocks is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with VAG Blocks.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "selftest.h"
+
+#include <QCoreApplication>
+#include <QTimer>
+#include <stdio.h>
+
+selftest::selftest(bool verbose, QObject *parent) :
+    QObject(parent),
+    transportBench(this),
+    verbose(verbose),
+    passed(true)
+{
+    connect(&transportBench, SIGNAL(log(QString, int)), this, SLOT(log(QString, int)));
+    connect(&transportBench, SIGNAL(finished(bool)), this, SLOT(benchFinished(bool)));
+}
+
+// the decoder is checked first, it doesn't need the event loop
+void selftest::run()
+{
+    QStringList report;
+    passed = blockDecoder::selfTest(report);
+    for (int i = 0; i < report.length(); i++) {
+        log("Decoder self test: " + report.at(i));
+    }
+    log(QString("Decoder self test: ") + (passed ? "PASS" : "FAIL"));
+
+    transportBench.run();
+}
+
+void selftest::log(const QString &txt, int logLevel)
+{
+    if (logLevel == stdLog || verbose) {
+        printf("%s\n", txt.toLocal8Bit().constData());
+        fflush(stdout);
+    }
+}
+
+void selftest::benchFinished(bool ok)
+{
+    passed = passed && ok;
+    QCoreApplication::exit(passed ? 0 : 1);
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+
+    selftest test(a.arguments().contains("-v"));
+    QTimer::singleShot(0, &test, SLOT(run()));
+
+    return a.exec();
+}
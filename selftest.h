@@ -0,0 +1,48 @@
+/*
+Copyright 2013 Jared Wiltshire
+
+This file is part of VAG Blocks.
+
+VAG Blocks is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+VAG Blocks is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with VAG Blocks.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef SELFTEST_H
+#define SELFTEST_H
+
+#include <QObject>
+#include <QStringList>
+
+#include "tpbench.h"
+#include "blockdecoder.h"
+
+// Runs the self tests that need no adapter or car, outside the app. The log goes to
+// stdout and the exit code is 0 only if every test passed.
+class selftest : public QObject
+{
+    Q_OBJECT
+public:
+    explicit selftest(bool verbose, QObject *parent = 0);
+public slots:
+    void run();
+private slots:
+    void log(const QString &txt, int logLevel = stdLog);
+    void benchFinished(bool passed);
+private:
+    tpbench transportBench;
+    bool verbose; // the debug messages as well
+    bool passed;
+};
+
+#endif // SELFTEST_H
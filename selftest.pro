@@ -0,0 +1,63 @@
+#-------------------------------------------------
+#
+# Self tests that run without an adapter or a car,
+# kept out of the app. See build.md, run
+# ./vagblocks-selftest (-v for the debug log).
+#
+#-------------------------------------------------
+
+QT       += core gui
+
+TARGET = vagblocks-selftest
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+
+SOURCES += selftest.cpp \
+    tpbench.cpp \
+    ecusim.cpp \
+    tp20.cpp \
+    elm327.cpp \
+    canframe.cpp \
+    messagepool.cpp \
+    blockdecoder.cpp \
+    samplestore.cpp \
+    util.cpp
+
+HEADERS  += selftest.h \
+    tpbench.h \
+    ecusim.h \
+    tp20.h \
+    elm327.h \
+    canframe.h \
+    messagepool.h \
+    blockdecoder.h \
+    samplestore.h \
+    util.h
+
+# used to disable "imp" macro in library function names for qtserialport
+static {
+    DEFINES += STATIC_BUILD
+}
+
+!win32 {
+    INCLUDEPATH += "../qtserialport/src"
+    LIBS += -L../qtserialport/src
+    LIBS += -lSerialPort
+}
+
+win32 {
+    INCLUDEPATH += "../qtserialport/src"
+    LIBS += -lSerialPort
+
+    CONFIG(release, debug|release) {
+        LIBS += -L../qtserialport/src/release
+        static {
+            # needed for qtserialport
+            LIBS += -lsetupapi -ladvapi32
+        }
+    }
+    else {
+        LIBS += -L../qtserialport/src/debug
+    }
+}
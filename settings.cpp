@@ -28,7 +28,10 @@ settings::settings(QSettings* appSettings, QWidget *parent) :
     receiveTimeValidator(1, 255, this),
     rateValidator(1, 50, this),
     keepAliveValidator(1, 10000, this),
-    historyValidator(1, 300, this)
+    historyValidator(1, 300, this),
+    monitorWindowValidator(0, 500, this),
+    monitorIntervalValidator(100, 60000, this),
+    reconnectValidator(0, 100, this)
 {
     ui->setupUi(this);
 
@@ -39,6 +42,9 @@ settings::settings(QSettings* appSettings, QWidget *parent) :
     ui->lineEdit_rate->setValidator(&rateValidator);
     ui->lineEdit_keepAliveInterval->setValidator(&keepAliveValidator);
     ui->lineEdit_history->setValidator(&historyValidator);
+    ui->lineEdit_monitorWindow->setValidator(&monitorWindowValidator);
+    ui->lineEdit_monitorInterval->setValidator(&monitorIntervalValidator);
+    ui->lineEdit_reconnectAttempts->setValidator(&reconnectValidator);
 }
 
 settings::~settings()
@@ -51,13 +57,26 @@ void settings::showEvent(QShowEvent* event)
     ui->lineEdit_slow->setText(QString::number(slow));
     ui->lineEdit_normal->setText(QString::number(norm));
     ui->lineEdit_fast->setText(QString::number(fast));
+    ui->checkBox_adaptiveTimeouts->setChecked(adaptiveTimeouts);
+    ui->checkBox_fastTiming->setChecked(fastTiming);
 
     ui->lineEdit_keepAliveInterval->setText(QString::number(keepAliveInterval));
+    ui->lineEdit_reconnectAttempts->setText(QString::number(reconnectAttempts));
 
     ui->lineEdit_rate->setText(QString::number(rate));
     ui->lineEdit_history->setText(QString::number(historySecs));
 
     ui->lineEdit_labelDir->setText(labelDir);
+
+    ui->lineEdit_dbcFile->setText(dbcFile);
+    ui->lineEdit_broadcastSignals->setText(broadcastSignals);
+    ui->lineEdit_monitorWindow->setText(QString::number(monitorWindow));
+    ui->lineEdit_monitorInterval->setText(QString::number(monitorInterval));
+
+    ui->lineEdit_extraBlocks->setText(extraBlocks);
+    ui->comboBox_periodic->setCurrentIndex(periodicMode > 0 ? periodicMode - 1 : 0);
+    ui->lineEdit_blockRates->setText(blockRates);
+    ui->lineEdit_memoryVariables->setText(memoryVariables);
 }
 
 void settings::on_buttonBox_accepted()
@@ -65,10 +84,21 @@ void settings::on_buttonBox_accepted()
     slow = ui->lineEdit_slow->text().toUInt();
     norm = ui->lineEdit_normal->text().toUInt();
     fast = ui->lineEdit_fast->text().toUInt();
+    adaptiveTimeouts = ui->checkBox_adaptiveTimeouts->isChecked();
+    fastTiming = ui->checkBox_fastTiming->isChecked();
     keepAliveInterval = ui->lineEdit_keepAliveInterval->text().toUInt();
+    reconnectAttempts = ui->lineEdit_reconnectAttempts->text().toUInt();
     rate = ui->lineEdit_rate->text().toUInt();
     historySecs = ui->lineEdit_history->text().toUInt();
     labelDir = ui->lineEdit_labelDir->text();
+    dbcFile = ui->lineEdit_dbcFile->text();
+    broadcastSignals = ui->lineEdit_broadcastSignals->text();
+    monitorWindow = ui->lineEdit_monitorWindow->text().toUInt();
+    monitorInterval = ui->lineEdit_monitorInterval->text().toUInt();
+    extraBlocks = ui->lineEdit_extraBlocks->text();
+    periodicMode = ui->comboBox_periodic->currentIndex() > 0 ? ui->comboBox_periodic->currentIndex() + 1 : 0;
+    blockRates = ui->lineEdit_blockRates->text();
+    memoryVariables = ui->lineEdit_memoryVariables->text();
 
     save();
 
@@ -97,8 +127,25 @@ void settings::load()
     slow = appSettings->value("Timeouts/slow", 40).toInt();
     norm = appSettings->value("Timeouts/norm", 24).toInt();
     fast = appSettings->value("Timeouts/fast", 16).toInt();
+    adaptiveTimeouts = appSettings->value("Timeouts/adaptive", false).toBool();
+    fastTiming = appSettings->value("Timeouts/fastTiming", true).toBool();
 
     keepAliveInterval = appSettings->value("KeepAlive/interval", 800).toInt();
+    reconnectAttempts = appSettings->value("KeepAlive/reconnectAttempts", 8).toInt();
+
+    dbcFile = appSettings->value("Broadcast/dbcFile", QString()).toString();
+    broadcastSignals = appSettings->value("Broadcast/signals", QString()).toString();
+    monitorWindow = appSettings->value("Broadcast/monitorWindow", 0).toInt();
+    monitorInterval = appSettings->value("Broadcast/monitorInterval", 1000).toInt();
+
+    extraBlocks = appSettings->value("Modules/extraBlocks", QString()).toString();
+
+    periodicMode = appSettings->value("Blocks/periodicMode", 0).toInt();
+    if (periodicMode < 2 || periodicMode > 4) {
+        periodicMode = 0;
+    }
+    blockRates = appSettings->value("Blocks/rates", QString()).toString();
+    memoryVariables = appSettings->value("Memory/variables", QString()).toString();
 }
 
 void settings::save()
@@ -111,8 +158,22 @@ void settings::save()
     appSettings->setValue("Timeouts/slow", slow);
     appSettings->setValue("Timeouts/norm", norm);
     appSettings->setValue("Timeouts/fast", fast);
+    appSettings->setValue("Timeouts/adaptive", adaptiveTimeouts);
+    appSettings->setValue("Timeouts/fastTiming", fastTiming);
 
     appSettings->setValue("KeepAlive/interval", keepAliveInterval);
+    appSettings->setValue("KeepAlive/reconnectAttempts", reconnectAttempts);
+
+    appSettings->setValue("Broadcast/dbcFile", dbcFile);
+    appSettings->setValue("Broadcast/signals", broadcastSignals);
+    appSettings->setValue("Broadcast/monitorWindow", monitorWindow);
+    appSettings->setValue("Broadcast/monitorInterval", monitorInterval);
+
+    appSettings->setValue("Modules/extraBlocks", extraBlocks);
+
+    appSettings->setValue("Blocks/periodicMode", periodicMode);
+    appSettings->setValue("Blocks/rates", blockRates);
+    appSettings->setValue("Memory/variables", memoryVariables);
 
     appSettings->sync();
 }
@@ -122,3 +183,11 @@ void settings::on_pushButton_clicked()
     QString dirStr = QFileDialog::getExistingDirectory(this, "Select a directory containing label files");
     ui->lineEdit_labelDir->setText(dirStr);
 }
+
+void settings::on_pushButton_dbcBrowse_clicked()
+{
+    QString fileStr = QFileDialog::getOpenFileName(this, "Select a DBC file", QString(), "DBC files (*.dbc)");
+    if (!fileStr.isEmpty()) {
+        ui->lineEdit_dbcFile->setText(fileStr);
+    }
+}
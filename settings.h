@@ -44,6 +44,17 @@ public:
     int rate;
     int historySecs;
     QString labelDir;
+    QString dbcFile;
+    QString broadcastSignals;
+    int monitorWindow;
+    int monitorInterval;
+    QString extraBlocks;
+    int reconnectAttempts;
+    int periodicMode; // KWP transmission mode, 0 for polling
+    QString blockRates;
+    QString memoryVariables;
+    bool adaptiveTimeouts;
+    bool fastTiming;
 
     void load();
     void save();
@@ -53,6 +64,7 @@ private slots:
     void on_buttonBox_rejected();
 
     void on_pushButton_clicked();
+    void on_pushButton_dbcBrowse_clicked();
 
 private:
     Ui::settings *ui;
@@ -62,6 +74,9 @@ private:
     QIntValidator rateValidator;
     QIntValidator keepAliveValidator;
     QIntValidator historyValidator;
+    QIntValidator monitorWindowValidator;
+    QIntValidator monitorIntervalValidator;
+    QIntValidator reconnectValidator;
 signals:
     void settingsChanged();
 };
@@ -22,223 +22,1387 @@ along with VAG Blocks.  If not, see <http://www.gnu.org/licenses/>.
 #include "util.h"
 #include <QCoreApplication>
 
+// Nothing in here blocks the thread. Requests are queued and run one at a time,
+// each is a chain of commands written to the ELM327 and the state says which
+// response is being waited for. readLines() collects the response as lines arrive
+// and hands it to handleResponse() when the prompt is seen.
+//
+// Several channels can be open at once, each keeps its own sequence numbers,
+// timing and keep alive. Requests name the channel they are for and the ELM327
+// header and filter are switched to it before the request is started.
+//
+// The queue is ordered by request class then deadline, not arrival. A keep alive
+// is due once its channel has been idle for the keep alive interval and has to be
+// sent within T1 of that. Before a request that holds the link for a while is
+// started, keep alives that would fall due during it are sent first.
+
 tp20::tp20(elm327* elm, QObject *parent) :
     QObject(parent),
     elm(elm),
     lastResponse(0),
     channelDest(-1),
-    txID(0), rxID(0),
-    txSeq(0), rxSeq(0),
+    recvCanID(0),
+    chDest(-1),
+    selectedDest(-1),
+    pacingTimer(this),
+    keepAliveTimer(this),
+    listenDest(-1),
+    keepAliveInterval(500),
     elmInitilised(false),
-    recvTimeout(-1)
+    state(stateIdle),
+    responseTimer(this),
+    channelTestPending(false),
+    deferredState(stateIdle),
+    closePrompts(0),
+    packetIndex(0),
+    sendTimeout(0),
+    rxLength(0),
+    resyncs(0),
+    timeoutResumeWith(resumeRequest),
+    recvTimeout(-1),
+    pendingTimeout(-1),
+    adaptiveTimeouts(false)
+{
+    clock.start();
+    for (int i = 0; i < numPriorities; i++) {
+        missedDeadlines[i] = 0;
+    }
+
+    // checks every channel a few times per interval so none sits idle much longer than it
+    keepAliveTimer.setInterval(keepAliveInterval / 4);
+    connect(&keepAliveTimer, SIGNAL(timeout()), this, SLOT(sendKeepAlive()));
+    keepAliveTimer.start();
+
+    responseTimer.setSingleShot(true);
+    connect(&responseTimer, SIGNAL(timeout()), this, SLOT(responseTimeout()));
+
+    pacingTimer.setSingleShot(true);
+    connect(&pacingTimer, SIGNAL(timeout()), this, SLOT(pacingDone()));
+
+    connect(elm, SIGNAL(portOpened(bool)), this, SLOT(initialiseElm(bool)));
+    connect(elm, SIGNAL(portClosed()), this, SLOT(portClosed()));
+    connect(elm, SIGNAL(lineAvailable()), this, SLOT(readLines()));
+}
+
+int tp20::getChannelDest()
+{
+    return channelDest;
+}
+
+int tp20::getRecvCanID()
+{
+    return recvCanID;
+}
+
+bool tp20::getElmInitialised()
+{
+    return elmInitilised;
+}
+
+void tp20::initialiseElm(bool open)
+{
+    reset();
+
+    if (open) {
+        tpRequest req;
+        req.type = initElmRequest;
+        enqueue(req);
+    }
+    else {
+        elmInitilised = false;
+        if (channelDest >= 0 || !channels.empty()) {
+            dropChannels();
+        }
+    }
+}
+
+void tp20::portClosed()
+{
+    reset();
+    elmInitilised = false;
+    dropChannels();
+}
+
+void tp20::openChannel(int dest, int timeout)
+{
+    tpRequest req;
+    req.type = openChannelRequest;
+    req.dest = dest;
+    req.timeout = timeout;
+    enqueue(req);
+}
+
+// Opens another channel alongside the one from openChannel(), channelStatus()
+// says whether it opened
+void tp20::addChannel(int dest, int timeout)
+{
+    tpRequest req;
+    req.type = addChannelRequest;
+    req.dest = dest;
+    req.timeout = timeout;
+    enqueue(req);
+}
+
+void tp20::sendData(const QByteArray &data, int requestedTimeout)
+{
+    sendDataTo(channelDest, data, requestedTimeout);
+}
+
+// A send at priorityClose is the last request on its channel, a close that follows
+// leaves it queued and sends the A8 after it
+void tp20::sendDataTo(int dest, const QByteArray &data, int requestedTimeout, int priority)
+{
+    tpRequest req;
+    req.type = sendDataRequest;
+    req.dest = dest;
+    req.data = data;
+    req.timeout = requestedTimeout;
+    req.retries = 0;
+    enqueue(req, priority == priorityClose ? priority :
+                 qBound(static_cast<int>(priorityListen), priority, static_cast<int>(priorityControl)));
+}
+
+// Calls method on obj (in this thread) once the requests ahead of it are done,
+// for things like the monitor that need the ELM327 to themselves. duration is the
+// caller's estimate of how many msecs method will hold the link.
+void tp20::runExclusive(QObject *obj, const QByteArray &method, int duration)
+{
+    tpRequest req;
+    req.type = exclusiveRequest;
+    req.obj = obj;
+    req.data = method;
+    req.timeout = duration;
+    enqueue(req, priorityCommand);
+}
+
+// Parameters asked for when a channel to dest is opened, eg. the best set found by
+// a sweep. Modules that haven't been set get block size 15 and T1 100ms, T3 10ms.
+void tp20::setModuleParams(int dest, int bs, int t1, int t3)
+{
+    moduleParams.insert(dest, paramRequest(bs, t1, t3));
+}
+
+// Renegotiates the parameters on the open channel, channelParams() is emitted
+// with what the module accepted
+void tp20::setParams(int bs, int t1, int t3)
+{
+    tpRequest req;
+    req.type = paramsRequest;
+    req.dest = channelDest;
+    req.data = paramRequest(bs, t1, t3);
+    enqueue(req);
+}
+
+QByteArray tp20::paramRequest(int bs, int t1, int t3)
+{
+    QByteArray ret;
+    ret.append(0xA0);
+    ret.append(qBound(1, bs, 0xF));
+    ret.append(t1);
+    ret.append(0xFF);
+    ret.append(t3);
+    ret.append(0xFF);
+    return ret;
+}
+
+// Closes every open channel. A8 is written straight away to the selected channel
+// rather than queued so it reaches the ELM327 before anything the caller does next,
+// the others are closed ahead of anything else in the queue once their header is
+// set. Pending channel requests are dropped.
+void tp20::closeChannel()
+{
+    QList<int> lastSends; // channels closed behind their last request
+    if (state != stateIdle && current.type == sendDataRequest && current.priority == priorityClose) {
+        lastSends << current.dest;
+    }
+    for (int i = 0; i < requests.length(); i++) {
+        const tpRequest &req = requests.at(i);
+        if (req.type == sendDataRequest && req.priority == priorityClose) {
+            lastSends << req.dest;
+        }
+        else if (req.type == sendDataRequest || req.type == keepAliveRequest || req.type == paramsRequest) {
+            requests.removeAt(i--);
+        }
+    }
+    channelTestPending = false;
+
+    bool opening = state != stateIdle &&
+            (current.type == openChannelRequest || current.type == addChannelRequest);
+    bool switching = state == stateSwitchSendID || state == stateSwitchRecvID;
+    int immediate = -1;
+    if (opening) {
+        immediate = current.dest;
+    }
+    else if (!switching && state != stateListen && channels.value(selectedDest).open &&
+             !lastSends.contains(selectedDest)) {
+        immediate = selectedDest; // an A8 written while monitoring would only stop the monitoring
+    }
+    listenDest = -1;
+
+    QList<int> dests = channels.keys();
+    for (int i = 0; i < dests.length(); i++) {
+        int dest = dests.at(i);
+        if (dest == immediate || !channels.value(dest).open) {
+            continue;
+        }
+        queueClose(dest);
+    }
+
+    if (channelDest >= 0 && channelDest != immediate) {
+        channelDest = -1;
+        emit channelOpened(false);
+    }
+
+    if (state == stateListen) { // the queued closes run once it has stopped
+        stopListening();
+    }
+
+    if (immediate < 0) {
+        return;
+    }
+
+    // an interrupted command still ends with a prompt of its own
+    closePrompts = (state == stateIdle || state == statePacing) ? 1 : 2;
+    pacingTimer.stop();
+
+    abortReceive();
+    writeToElmStr("A8");
+    expect(stateClose);
+    setChannelClosed(immediate);
+
+    // whatever was running is abandoned, the prompts now finish the close
+    current.type = closeChannelRequest;
+    current.dest = immediate;
+}
+
+// Marks the channel closed straight away, the A8 goes out when the request reaches
+// the front of the queue
+void tp20::queueClose(int dest)
+{
+    tpChannel &chan = channels[dest];
+    chan.open = false;
+    chan.keepAliveQueued = false;
+
+    tpRequest req;
+    req.type = closeChannelRequest;
+    req.dest = dest;
+    insertRequest(req, priorityClose, -1);
+
+    emit channelStatus(dest, false);
+    if (dest == channelDest) {
+        channelDest = -1;
+        emit channelOpened(false);
+    }
+}
+
+// Runs a few times per keep alive interval and queues a keep alive for each
+// channel that has been idle for the whole interval. Traffic from the module
+// counts, so a busy channel never needs one.
+void tp20::sendKeepAlive()
+{
+    // an exchange in progress keeps its channel open
+    int busy = (state != stateIdle && current.type == sendDataRequest) ? current.dest : -1;
+    bool queued = queueKeepAlives(0, busy);
+
+    if (queued && state == stateIdle) {
+        nextRequest();
+    }
+    else if (queued && state == stateListen) {
+        stopListening();
+    }
+}
+
+// Queues a keep alive for each open channel that will have been idle for the keep
+// alive interval within horizon msecs, other than skipDest
+bool tp20::queueKeepAlives(int horizon, int skipDest)
+{
+    bool queued = false;
+
+    QMap<int, tpChannel>::iterator it;
+    for (it = channels.begin(); it != channels.end(); ++it) {
+        tpChannel &chan = it.value();
+        if (!chan.open || chan.keepAliveQueued || chan.dest == skipDest) {
+            continue;
+        }
+
+        qint64 idle = chan.lastTraffic.elapsed();
+        if (idle + horizon < keepAliveInterval) {
+            continue;
+        }
+
+        tpRequest req;
+        req.type = keepAliveRequest;
+        req.dest = chan.dest;
+        req.timeout = 0;
+        req.obj = 0;
+        req.retries = 0;
+        chan.keepAliveQueued = true;
+        insertRequest(req, priorityKeepAlive,
+                      clock.elapsed() + keepAliveInterval - idle + static_cast<qint64>(chan.ackTimeout));
+        queued = true;
+    }
+
+    return queued;
+}
+
+// The longest a request of each class should wait in the queue, later is reported
+// as a missed deadline
+void tp20::enqueue(tpRequest req, int priority)
+{
+    static const int maxWait[numPriorities] = {-1, 500, 2000, -1, -1, -1};
+
+    insertRequest(req, priority, maxWait[priority] < 0 ? -1 : clock.elapsed() + maxWait[priority]);
+    if (state == stateIdle) {
+        nextRequest();
+    }
+    else if (state == stateListen) {
+        stopListening();
+    }
+}
+
+// After the requests of a higher class and those of the same class due sooner
+void tp20::insertRequest(tpRequest req, int priority, qint64 deadline)
+{
+    req.priority = priority;
+    req.deadline = deadline;
+    req.started = false;
+
+    int i = 0;
+    while (i < requests.length()) {
+        const tpRequest &queued = requests.at(i);
+        if (queued.priority < priority ||
+                (queued.priority == priority && deadline >= 0 && (queued.deadline < 0 || queued.deadline > deadline))) {
+            break;
+        }
+        i++;
+    }
+    requests.insert(i, req);
+}
+
+// roughly how long the link is taken up by req, in msecs
+int tp20::expectedDuration(const tpRequest &req)
+{
+    switch (req.type) {
+    case sendDataRequest:
+        return (req.timeout >= 0 ? req.timeout : slowRecvTimeout) * 2; // msecs, request and response
+    case exclusiveRequest:
+        return req.timeout; // the caller's estimate
+    default:
+        return 0;
+    }
+}
+
+void tp20::checkDeadline(const tpRequest &req)
+{
+    static const char* className[numPriorities] = {
+        "listen", "block read", "command", "control", "keep alive", "close"
+    };
+
+    if (req.deadline < 0) {
+        return;
+    }
+
+    qint64 late = clock.elapsed() - req.deadline;
+    if (late <= 0) {
+        return;
+    }
+
+    missedDeadlines[req.priority]++;
+    emit log(QString(req.type == keepAliveRequest ? "Warning: " : "Info: ") + className[req.priority] +
+             " request to " + toHex(req.dest, 2) + " started " + QString::number(late) +
+             "ms after its deadline (" + QString::number(missedDeadlines[req.priority]) + " missed)",
+             req.type == keepAliveRequest ? stdLog : debugMsgLog);
+}
+
+void tp20::nextRequest()
+{
+    while (state == stateIdle && !requests.empty()) {
+        // keep alives that would fall due while the next request holds the link go first
+        const tpRequest &next = requests.first();
+        if (!next.started) {
+            queueKeepAlives(expectedDuration(next), next.type == sendDataRequest ? next.dest : -1);
+        }
+
+        current = requests.takeFirst();
+        chDest = -1;
+        if (!current.started) {
+            checkDeadline(current);
+            current.started = true;
+        }
+
+        switch (current.type) {
+        case initElmRequest:
+            elmInfo.clear();
+            command("AT E0", stateInitFlush); // make sure there is no existing data coming from COM port
+            break;
+        case openChannelRequest:
+        case addChannelRequest:
+            if (!elmInitilised) {
+                break;
+            }
+            if (channels.value(current.dest).open) {
+                if (current.type == openChannelRequest && channelDest != current.dest) {
+                    channelDest = current.dest;
+                    emit channelOpened(true);
+                }
+                break;
+            }
+            if (!startTimeout(current.timeout, resumeRequest)) {
+                startOpen();
+            }
+            break;
+        case sendDataRequest:
+            if (current.priority == priorityClose && channels.contains(current.dest)) {
+                chDest = current.dest; // the last request on a channel being closed still goes out
+            }
+            else if (!useChannel(current.dest)) {
+                break;
+            }
+            if (current.data.length() == 0 || current.data.length() > 65535) {
+                break;
+            }
+            if (!selectChannel()) {
+                startSend(); // the timeout is set along with the first packet
+            }
+            break;
+        case keepAliveRequest:
+            if (!useChannel(current.dest)) {
+                break;
+            }
+            ch()->keepAliveQueued = false;
+            if (!selectChannel()) {
+                emit log("Sending keep alive command to " + toHex(current.dest, 2), keepAliveLog);
+                ch()->lastTraffic.start();
+                command("A3", stateKeepAlive);
+            }
+            break;
+        case paramsRequest:
+            if (!useChannel(current.dest)) {
+                break;
+            }
+            if (!selectChannel()) {
+                command(current.data, stateParams);
+            }
+            break;
+        case closeChannelRequest:
+            if (!channels.contains(current.dest)) {
+                break;
+            }
+            chDest = current.dest;
+            if (!selectChannel()) {
+                closePrompts = 1;
+                command("A8", stateClose);
+            }
+            break;
+        case exclusiveRequest: {
+            // nothing is sent on the channels meanwhile, they must not go idle for longer
+            // than the keep alive interval
+            qint64 started = clock.elapsed();
+            QMetaObject::invokeMethod(current.obj, current.data.constData(), Qt::DirectConnection);
+            selectedDest = -1; // the header and filter may have been changed
+            recvTimeout = -1; // and the receive timeout
+            qint64 took = clock.elapsed() - started;
+            bool anyOpen = false;
+            foreach (const tpChannel &chan, channels) {
+                anyOpen = anyOpen || chan.open;
+            }
+            if (anyOpen && took > keepAliveInterval) {
+                emit log("Warning: " + QString(current.data) + " held the adapter for " + QString::number(took) +
+                         "ms, longer than the keep alive interval");
+            }
+            break;
+        }
+        case listenRequest:
+            if (!useChannel(current.dest)) {
+                break;
+            }
+            if (!selectChannel()) {
+                startListen();
+            }
+            break;
+        }
+    }
+
+    // nothing to do, wait for what the module sends by itself
+    if (state == stateIdle && listenDest >= 0 && channels.value(listenDest).open) {
+        tpRequest req;
+        req.type = listenRequest;
+        req.dest = listenDest;
+        req.timeout = 0;
+        req.obj = 0;
+        req.retries = 0;
+        insertRequest(req, priorityListen, -1);
+        nextRequest();
+    }
+}
+
+// The current request's channel, 0 if it doesn't have one. It is looked up each time
+// rather than kept as a pointer into channels, which adding a channel can invalidate.
+tpChannel* tp20::ch()
+{
+    QMap<int, tpChannel>::iterator it = channels.find(chDest);
+    return it == channels.end() ? 0 : &it.value();
+}
+
+// Makes the open channel for dest the current one
+bool tp20::useChannel(int dest)
+{
+    QMap<int, tpChannel>::iterator it = channels.find(dest);
+    if (it == channels.end() || !it.value().open) {
+        return false;
+    }
+    chDest = dest;
+    return true;
+}
+
+// Points the ELM327 at ch() if another channel is selected, the request is started
+// again once the header and filter are set. Returns true if it had to switch.
+bool tp20::selectChannel()
+{
+    if (selectedDest == ch()->dest) {
+        return false;
+    }
+
+    emit log("Info: Switching to channel " + toHex(ch()->dest, 2), debugMsgLog);
+    selectedDest = -1; // until both are set
+    command("AT SH " + toHex(ch()->txID, 3), stateSwitchSendID);
+    return true;
+}
+
+void tp20::finishRequest()
+{
+    state = stateIdle;
+    nextRequest();
+}
+
+void tp20::reset()
+{
+    requests.clear();
+    responseTimer.stop();
+    pacingTimer.stop();
+    responseLines.clear();
+    abortReceive();
+    state = stateIdle;
+    chDest = -1;
+    selectedDest = -1;
+    channelTestPending = false;
+
+    QMap<int, tpChannel>::iterator it;
+    for (it = channels.begin(); it != channels.end(); ++it) {
+        it.value().keepAliveQueued = false;
+    }
+}
+
+void tp20::command(const QString &str, int newState)
+{
+    if (channelTestPending) { // reply to the module's channel test first
+        channelTestPending = false;
+        deferredCommand = str;
+        deferredState = newState;
+        writeToElmStr("A3");
+        expect(stateChannelTest);
+        return;
+    }
+
+    writeToElmStr(str);
+    expect(newState);
+}
+
+void tp20::command(const QByteArray &data, int newState)
+{
+    QString txt;
+    for (int i = 0; i < data.length(); i++) {
+        txt += toHex(static_cast<quint8>(data.at(i)), 2) + " ";
+    }
+    txt.chop(1);
+
+    command(txt, newState);
+}
+
+void tp20::expect(int newState)
+{
+    state = newState;
+    responseLines.clear();
+    responseTimer.start(responseWait());
+}
+
+// How long to wait for the next line before giving up on the ELM327. On an open
+// channel the adapter gives up after its own timeout, or T1 when an ACK is
+// missing, so there's no need to wait much longer than that.
+int tp20::responseWait()
+{
+    if (!ch() || !ch()->open || recvTimeout < 0) {
+        return 1100; // same as the default wait for a line in elm327::getLine()
+    }
+    return qMax(recvTimeout, qCeil(ch()->ackTimeout)) + 200;
+}
+
+void tp20::setChannelParams(const chanParam &param)
+{
+    ch()->bs = param.bs;
+    ch()->t1 = param.T1;
+    ch()->t3 = param.T3;
+    ch()->ackTimeout = decodeTiming(ch()->t1);
+    ch()->packetGap = decodeTiming(ch()->t3);
+}
+
+void tp20::readLines()
+{
+    QString line;
+    while (!(line = elm->getLine(0, false)).isEmpty()) {
+        if (state == stateIdle || state == statePacing) {
+            emit log("Warning: Unexpected line from ELM327 " + line, debugMsgLog);
+            continue;
+        }
+
+        responseLines << line;
+        if (state == stateListen && line != ">") { // no prompt until monitoring stops
+            listenLine(line);
+            continue;
+        }
+        if (line != ">") {
+            responseTimer.start(responseWait());
+            continue;
+        }
+
+        responseTimer.stop();
+        QStringList lines = responseLines;
+        responseLines.clear();
+        handleResponse(lines);
+    }
+}
+
+// the response is passed on without the prompt, the parse functions flag the timeout
+void tp20::responseTimeout()
+{
+    if (state == stateIdle || state == statePacing) {
+        return;
+    }
+    if (state == stateListen) {
+        stopListening();
+        return;
+    }
+
+    QStringList lines = responseLines;
+    responseLines.clear();
+    handleResponse(lines);
+}
+
+void tp20::handleResponse(const QStringList &lines)
+{
+    switch (state) {
+    case stateIdle:
+        break;
+    case stateSetTimeout:
+        if (!parseResponseStatus(lines, OK_RESPONSE)) {
+            emit log("Warning: Could not set receive timeout");
+            emit log("Error: Couldn't set timeout", debugMsgLog);
+            recvTimeout = -1; // forces it to try again next time
+            setChannelClosed(current.dest);
+            finishRequest();
+            break;
+        }
+        recvTimeout = pendingTimeout;
+        if (timeoutResumeWith == resumeRequest) {
+            requests.prepend(current);
+            finishRequest();
+        }
+        else {
+            sendPacket();
+        }
+        break;
+    case stateSwitchSendID:
+    case stateSwitchRecvID:
+        if (!parseResponseStatus(lines, OK_RESPONSE)) {
+            emit log("Error: Couldn't switch to channel " + toHex(current.dest, 2), debugMsgLog);
+            finishRequest();
+            break;
+        }
+        if (state == stateSwitchSendID) {
+            command("AT CRA " + toHex(ch()->rxID, 3), stateSwitchRecvID);
+            break;
+        }
+        selectedDest = ch()->dest;
+        requests.prepend(current);
+        finishRequest();
+        break;
+    case stateKeepAlive:
+    case stateParams:
+        if (!parseResponseCAN(lines) || !checkResponse(6)) {
+            setChannelClosed(current.dest);
+        }
+        else {
+            chanParam param = getAsCP(0);
+            if (param.opcode != 0xA1 || param.bs > 0xF) {
+                setChannelClosed(current.dest);
+            }
+            else {
+                setChannelParams(param);
+                if (state == stateParams) {
+                    emit channelParams(ch()->dest, ch()->bs, ch()->t1, ch()->t3);
+                }
+            }
+        }
+        finishRequest();
+        break;
+    case stateChannelTest:
+        parseResponseStr(lines);
+        if (ch()) {
+            ch()->lastTraffic.start();
+        }
+        command(deferredCommand, deferredState);
+        break;
+    case stateClose:
+        if (--closePrompts > 0) {
+            expect(stateClose);
+            break;
+        }
+        if (current.type == closeChannelRequest) {
+            channels.remove(current.dest);
+            chDest = -1;
+            selectedDest = -1;
+        }
+        finishRequest();
+        break;
+    default:
+        if (state <= stateInitLineFeeds) {
+            handleInit(lines);
+        }
+        else if (state <= stateOpenParams) {
+            handleOpen(lines);
+        }
+        else {
+            handleSend(lines);
+        }
+        break;
+    }
+}
+
+void tp20::handleInit(const QStringList &lines)
+{
+    switch (state) {
+    case stateInitFlush:
+        parseResponseStr(lines);
+        command("AT E0", stateInitEcho); // turn off echo
+        return;
+    case stateInitID:
+        elmInfo << parseResponseStr(lines);
+        command("AT @1", stateInitDevice);
+        return;
+    case stateInitDevice:
+        emit log("ID: " + parseResponseStr(lines));
+        emit log("Protocol: " + elmInfo.takeFirst());
+        command("ST I", stateInitSTFirmware);
+        return;
+    case stateInitSTFirmware:
+        elmInfo << parseResponseStr(lines);
+        if (elmInfo.last() == "?") {
+            command("AT PB C0 01", stateInitProtocolB);
+        }
+        else {
+            command("ST DI", stateInitSTDevice);
+        }
+        return;
+    case stateInitSTDevice:
+        elmInfo << parseResponseStr(lines);
+        command("ST MFR", stateInitSTMfr);
+        return;
+    case stateInitSTMfr:
+        elmInfo << parseResponseStr(lines);
+        command("ST SN", stateInitSTSerial);
+        return;
+    case stateInitSTSerial:
+        emit log("Manufacturer: " + elmInfo.at(2));
+        emit log("Device: " + elmInfo.at(1));
+        emit log("Firmware: " + elmInfo.at(0));
+        emit log("Serial: " + parseResponseStr(lines));
+        command("ST FAP 000,000", stateInitSTFilter); // set a pass all filter for ST devices
+        return;
+    default:
+        break;
+    }
+
+    // the rest only need an OK
+    if (!parseResponseStatus(lines, OK_RESPONSE)) {
+        elmInitialisationFailed();
+        finishRequest();
+        return;
+    }
+
+    switch (state) {
+    case stateInitEcho:
+        command("AT I", stateInitID);
+        break;
+    case stateInitSTFilter:
+        command("AT PB C0 01", stateInitProtocolB); // set user mode B to  500kbps, 11 bit ID
+        break;
+    case stateInitProtocolB:
+        command("AT SP B", stateInitSelectB); // activate user mode B
+        break;
+    case stateInitSelectB:
+        command("AT H1", stateInitHeaders); // turn on CAN ID display (headers??)
+        break;
+    case stateInitHeaders:
+        command("AT D1", stateInitDLC); // turn on DLC display
+        break;
+    case stateInitDLC:
+        command("AT L0", stateInitLineFeeds); // make sure line feeds are off
+        break;
+    case stateInitLineFeeds:
+        elmInitilised = true;
+        emit elmInitDone(true);
+        finishRequest();
+        break;
+    }
+}
+
+void tp20::startOpen()
+{
+    channels.remove(current.dest);
+
+    // each channel is answered on its own ID, 0x300 for the first
+    quint16 recvID = 0x300;
+    QMap<int, tpChannel>::const_iterator it = channels.constBegin();
+    while (it != channels.constEnd()) {
+        if (it.value().rxID == recvID) {
+            recvID++;
+            it = channels.constBegin();
+            continue;
+        }
+        ++it;
+    }
+
+    tpChannel chan;
+    chan.dest = current.dest;
+    chan.open = false;
+    chan.txID = 0;
+    chan.rxID = recvID;
+    chan.bs = 0;
+    chan.t1 = 0;
+    chan.t3 = 0;
+    chan.ackTimeout = 0;
+    chan.packetGap = 0;
+    chan.txSeq = 0;
+    chan.rxSeq = 0;
+    chan.keepAliveQueued = false;
+    chan.seqErrors = 0;
+    chan.seqRetransmits = 0;
+    chan.seqRetries = 0;
+    channels.insert(current.dest, chan);
+    chDest = current.dest;
+
+    selectedDest = -1; // the setup is done on 0x200
+    setSendCanID(0x200);
+    expect(stateOpenSendID);
+}
+
+void tp20::handleOpen(const QStringList &lines)
+{
+    bool ok;
+    if (state == stateOpenSetup || state == stateOpenParams) {
+        ok = parseResponseCAN(lines) && checkResponse(state == stateOpenSetup ? 7 : 6);
+    }
+    else {
+        ok = parseResponseStatus(lines, OK_RESPONSE);
+    }
+
+    if (!ok) {
+        setChannelClosed(current.dest);
+        finishRequest();
+        return;
+    }
+
+    switch (state) {
+    case stateOpenSendID:
+        setRecvCanID(0x200 + current.dest);
+        expect(stateOpenRecvID);
+        break;
+    case stateOpenRecvID:
+        ch()->rxSeq = 0;
+        ch()->txSeq = 0;
+        command(toHex(current.dest, 2) + " C0 00 10 " + toHex(ch()->rxID & 0xFF, 2) + " " +
+                toHex(ch()->rxID >> 8, 2) + " 01", stateOpenSetup);
+        break;
+    case stateOpenSetup: {
+        chanSetup setup = getAsCS(0);
+        quint16 recvID = (setup.rxPre << 8) + setup.rxID;
+        if (setup.opcode != 0xD0 || recvID != ch()->rxID || setup.rxV > 0 || setup.txV > 0) {
+            setChannelClosed(current.dest);
+            finishRequest();
+            return;
+        }
+        ch()->txID = (setup.txPre << 8) + setup.txID;
+        setSendCanID(ch()->txID);
+        expect(stateOpenChanSendID);
+        break;
+    }
+    case stateOpenChanSendID:
+        setRecvCanID(ch()->rxID);
+        expect(stateOpenChanRecvID);
+        break;
+    case stateOpenChanRecvID:
+        selectedDest = current.dest;
+        command(moduleParams.value(current.dest, paramRequest(0xF, 0x8A, 0x4A)), stateOpenParams);
+        break;
+    case stateOpenParams: {
+        chanParam param = getAsCP(0);
+        if (param.opcode != 0xA1 || param.bs > 0xF) {
+            setChannelClosed(current.dest);
+            finishRequest();
+            return;
+        }
+        setChannelParams(param);
+        emit log("Info: Channel " + toHex(current.dest, 2) + " T1 " + QString::number(ch()->ackTimeout) + "ms, T3 " +
+                 QString::number(ch()->packetGap) + "ms, block size " + QString::number(ch()->bs), debugMsgLog);
+
+        ch()->open = true;
+        ch()->lastTraffic.start();
+        emit channelParams(ch()->dest, ch()->bs, ch()->t1, ch()->t3);
+        emit channelStatus(ch()->dest, true);
+        if (current.type == openChannelRequest) {
+            channelDest = current.dest;
+            recvCanID = ch()->rxID;
+            emit channelOpened(true);
+        }
+        finishRequest();
+        break;
+    }
+    }
+}
+
+bool tp20::startTimeout(int msecs, int resume)
+{
+    if (msecs > 1020) {
+        msecs = 1020;
+    }
+    if (msecs < 4) {
+        msecs = 4; // AT ST 00 would restore the default
+    }
+    msecs = (msecs + 3) / 4 * 4; // what the adapter will actually use
+
+    if (recvTimeout == msecs) {
+        return false;
+    }
+
+    emit log("Info: Setting new timeout", debugMsgLog);
+
+    // each increment is 4ms
+    pendingTimeout = msecs;
+    timeoutResumeWith = resume;
+    command("AT ST " + toHex(msecs / 4), stateSetTimeout);
+    return true;
+}
+
+void tp20::startSend()
 {
-    keepAliveTimer.setInterval(500);
-    connect(&keepAliveTimer, SIGNAL(timeout()), this, SLOT(sendKeepAlive()));
-    keepAliveTimer.start();
+    quint16 len = current.data.length();
+    sendBuffer.clear();
+    sendBuffer.append(len >> 8);
+    sendBuffer.append(len & 0xFF);
+    sendBuffer.append(current.data);
+
+    packetIndex = 0;
+    resyncs = 0;
+
+    // A block end waits T1 for its ACK and the last packet the requested timeout for
+    // the response. One AT ST covering both is cheaper than switching at each block.
+    sendTimeout = requestTimeout();
+    bool blocks = ch()->bs > 0 && sendBuffer.length() > ch()->bs * 7;
+    if (blocks) {
+        sendTimeout = qMax(sendTimeout, qCeil(ch()->ackTimeout));
+    }
 
-    connect(elm, SIGNAL(portOpened(bool)), this, SLOT(initialiseElm(bool)));
-    connect(elm, SIGNAL(portClosed()), this, SLOT(portClosed()));
+    abortReceive();
+    sendPacket();
 }
 
-int tp20::getChannelDest()
+// Packets are spaced at least T3 apart
+void tp20::sendPacket()
 {
-    return channelDest;
+    QByteArray packet;
+    int bytesLeft = sendBuffer.length() - packetIndex*7;
+    bool lastPacket = bytesLeft <= 7;
+    bool blockEnd = !lastPacket && ch()->bs > 0 && packetIndex % ch()->bs == ch()->bs-1;
+
+    if (startTimeout(sendTimeout, resumePacket)) {
+        return;
+    }
+
+    if (ch()->lastPacketTime.isValid() && ch()->lastPacketTime.elapsed() < ch()->packetGap) {
+        state = statePacing;
+        responseTimer.stop();
+        pacingTimer.start(qCeil(ch()->packetGap - ch()->lastPacketTime.elapsed()));
+        return;
+    }
+    ch()->lastPacketTime.start();
+    ch()->lastTraffic.start();
+
+    if (lastPacket) { // expecting ACK, last packet 0x1X
+        packet.append(0x10 | (ch()->txSeq++ & 0x0F));
+        packet.append(sendBuffer.mid(packetIndex*7, bytesLeft));
+        command(packet, stateSendLast);
+        lastPacketClock.start();
+    }
+    else if (blockEnd) { // expecting ACK, more packets to come 0x0X
+        packet.append(0x00 | (ch()->txSeq++ & 0x0F));
+        packet.append(sendBuffer.mid(packetIndex*7, 7));
+        command(packet, stateSendBlockEnd);
+    }
+    else { // more packets to come 0x2X
+        packet.append(0x20 | (ch()->txSeq++ & 0x0F));
+        packet.append(sendBuffer.mid(packetIndex*7, 7));
+        command(packet, stateSendPacket);
+    }
 }
 
-bool tp20::getElmInitialised()
+void tp20::pacingDone()
 {
-    return elmInitilised;
+    if (state == statePacing) {
+        sendPacket();
+    }
 }
 
-void tp20::sendData(const QByteArray &data, int requestedTimeout)
+void tp20::setAdaptiveTimeouts(bool on)
+{
+    adaptiveTimeouts = on;
+}
+
+// What the last packet of the current request waits for the response
+int tp20::requestTimeout()
 {
-    if (channelDest < 0 || data.length() == 0 || data.length() > 65535) {
+    if (!adaptiveTimeouts || current.data.isEmpty()) {
+        return current.timeout;
+    }
+
+    rttEstimate estimate = estimates.value((current.dest << 8) | static_cast<quint8>(current.data.at(0)));
+    if (estimate.samples < minEstimateSamples && estimate.timeouts == 0) {
+        return current.timeout;
+    }
+    return estimate.rto;
+}
+
+// The ELM327 only returns once the timeout has passed since the last frame it got,
+// so that is taken off the time to the prompt. A timeout doubles the next one.
+void tp20::updateEstimate(bool timedOut)
+{
+    if (current.data.isEmpty()) {
         return;
     }
 
-    if (recvTimeout != requestedTimeout) {
-        emit log("Info: Setting new timeout", debugMsgLog);
-        if (!applyRecvTimeout(requestedTimeout)) {
-            emit log("Error: Couldn't set timeout", debugMsgLog);
-            setChannelClosed();
-            return;
+    int service = static_cast<quint8>(current.data.at(0));
+    rttEstimate &estimate = estimates[(current.dest << 8) | service];
+
+    if (timedOut) {
+        estimate.timeouts++;
+        estimate.rto = qMin(qMax(estimate.rto, recvTimeout) * 2, 1020);
+    }
+    else {
+        double sample = qMax(lastPacketClock.elapsed() - recvTimeout, Q_INT64_C(0));
+        if (estimate.samples == 0) {
+            estimate.srtt = sample;
+            estimate.rttvar = sample / 2;
+        }
+        else {
+            estimate.rttvar = 0.75 * estimate.rttvar + 0.25 * qAbs(estimate.srtt - sample);
+            estimate.srtt = 0.875 * estimate.srtt + 0.125 * sample;
         }
+        estimate.samples++;
+
+        // 4ms is the timeout's granularity
+        estimate.rto = qBound(static_cast<int>(minAdaptiveTimeout),
+                              qCeil(estimate.srtt + qMax(4.0, 4 * estimate.rttvar)), 1020);
+    }
+
+    emit responseTime(current.dest, service, estimate);
+}
+
+// Responses from a module in a periodic transmission mode are picked up on dest
+// whenever nothing else is queued, -1 stops listening
+void tp20::setListening(int dest)
+{
+    listenDest = dest;
+    if (dest < 0 && state == stateListen) {
+        stopListening();
     }
+    else if (dest >= 0 && state == stateIdle) {
+        nextRequest();
+    }
+}
 
-    //QCoreApplication::processEvents();
-    //QMutexLocker locker(&sendLock);
+// lines heard don't restart the response timer, it's the longest monitoring goes on
+void tp20::startListen()
+{
+    command("AT MA", stateListen);
+}
+
+// Monitoring stops as soon as a frame needs an answer, an ACK for a data frame or
+// the channel test, or when a message is complete
+void tp20::listenLine(const QString &line)
+{
+    int status;
+    QList<canFrame*>* frames = elm327::parseResponseCAN(QStringList() << line, status);
+    bool stop = false;
+    for (int i = 0; i < frames->length(); i++) {
+        const QByteArray &data = frames->at(i)->data;
+        if (data.isEmpty()) {
+            continue;
+        }
+        quint8 op = static_cast<quint8>(data.at(0)) >> 4;
+        stop = stop || op >= 0xA || (op <= 0x3 && (!(op & 0x02) || (op & 0x01)));
+    }
+    qDeleteAll(frames->begin(), frames->end());
+    delete frames;
 
-    quint16 len = data.length();
-    QByteArray lenBA;
-    lenBA.append(len >> 8);
-    lenBA.append(len & 0x0F);
+    if (stop) {
+        stopListening();
+    }
+}
 
-    QByteArray sendData(data);
-    sendData.prepend(lenBA);
+// any character stops AT MA, the lines heard so far are kept for the prompt
+void tp20::stopListening()
+{
+    QStringList heard = responseLines;
+    writeToElmStr(".");
+    expect(stateListenStop);
+    responseLines = heard;
+}
 
-    int numPackets = qCeil(sendData.length() / 7.0);
 
-    for (int i = 0; i < numPackets; i++) {
-        QByteArray packet;
-        int bytesLeft = sendData.length() - i*7;
+void tp20::handleSend(const QStringList &lines)
+{
+    switch (state) {
+    case stateListen: // the adapter stopped monitoring by itself
+    case stateListenStop: {
+        int status;
+        QList<canFrame*>* frames = elm327::parseResponseCAN(lines.mid(0, 1), status);
+        bool unsupported = status & UNKNOWN_RESPONSE;
+        qDeleteAll(frames->begin(), frames->end());
+        delete frames;
+        if (unsupported) {
+            emit log("Warning: ELM327 can't monitor, responses sent by the module will be missed");
+            listenDest = -1;
+        }
 
-        if (bytesLeft <= 7) { // expecting ACK, last packet 0x1X
-            packet.append(0x10 | (txSeq++ & 0x0F));
-            packet.append(sendData.mid(i*7, bytesLeft));
-            writeToElmBA(packet);
-            recvData();
+        parseResponseCAN(lines); // STOPPED and NO DATA are expected here
+        if (!ch() || lastResponse->empty()) {
+            finishRequest();
+            return;
+        }
+        receiveFrames();
+        break;
+    }
+    case stateSendPacket:
+        // Read in NO DATA
+        if (!parseResponseCAN(lines, false)) {
+            emit log("Error: Got premature response from TP2.0 device", debugMsgLog);
+            finishRequest();
+            return;
+        }
+        packetIndex++;
+        sendPacket();
+        break;
+    case stateSendBlockEnd:
+        // Read in ACK
+        if (!parseResponseCAN(lines)) {
+            emit log("Error: Did not get ACK from TP2.0 device", debugMsgLog);
+            finishRequest();
+            return;
         }
-        else if (i % bs == bs-1) { // expecting ACK, more packets to come 0x0X
-            packet.append(0x00 | (txSeq++ & 0x0F));
-            packet.append(sendData.mid(i*7, 7));
-            writeToElmBA(packet);
-            // Read in ACK
-            if (!getResponseCAN()) {
-                emit log("Error: Did not get ACK from TP2.0 device", debugMsgLog);
+        if (lastResponse->length() > 1 || !checkACK()) {
+            emit log("Error: Invalid ACK from TP2.0 device", debugMsgLog);
+            finishRequest();
+            return;
+        }
+        packetIndex++;
+        sendPacket();
+        break;
+    case stateSendLast:
+        // ACK followed by the start of the response
+        if (!parseResponseCAN(lines) || !checkACK() || lastResponse->length() < 2) {
+            emit log("Error: Did not get ACK and response from TP2.0 device", debugMsgLog);
+            updateEstimate(true);
+            finishRequest();
+            return;
+        }
+        updateEstimate(false);
+        lastResponse->removeFirst(); // remove ACK
+        receiveFrames();
+        break;
+    case stateRecvACK: {
+        bool dataFollowing = !rxMessage.isNull();
+        // ECU should not respond to ACK, unless more TP data
+        if (!parseResponseCAN(lines, dataFollowing)) {
+            if (ch() && lastResponse && !lastResponse->empty()) {
+                // There is an additional KWP message following
+                emit log("Warning: Got a more than one message", debugMsgLog);
+                receiveFrames();
                 return;
             }
-            if (lastResponse->length() > 1 || !checkACK()) {
-                emit log("Error: Invalid ACK from TP2.0 device", debugMsgLog);
+            emit log("Error: Error sending ACK", debugMsgLog);
+            abortReceive();
+            if (resyncs > 0 && ch()) { // the retransmit never came
+                retryRequest();
                 return;
             }
+            finishRequest();
+            return;
         }
-        else { // more packets to come 0x2X
-            packet.append(0x20 | (txSeq++ & 0x0F));
-            packet.append(sendData.mid(i*7, 7));
-            writeToElmBA(packet);
-            // Read in NO DATA
-            if (!getResponseStatus(NO_DATA_RESPONSE)) {
-                emit log("Error: Got premature response from TP2.0 device", debugMsgLog);
-                return;
-            }
+        if (dataFollowing) {
+            receiveFrames();
         }
+        else {
+            finishRequest();
+        }
+        break;
     }
-    return; // should never get to here
-}
-
-void tp20::recvData() {
-    if (!getResponseCAN()) {
-        return;
-    }
-    if (!checkACK() || lastResponse->length() < 2) {
-        return;
     }
+}
 
-    lastResponse->removeFirst(); // remove ACK
-
-    QByteArray* ret = 0;
-    bool firstPacket = true;
-    bool keepGoing = true;
-    quint16 length = 0;
-    quint16 bytesReceived = 0;
-
-    int iteration = 0;
+// Adds the data frames in lastResponse to the message being received, emits
+// response() when it is complete and ACKs the frames when asked to
+void tp20::receiveFrames()
+{
+    // frames from a gap onwards are left for resyncReceive()
+    int gap = checkSeq();
+    int lenTmp = (gap < 0) ? lastResponse->length() : gap;
+
+    for (int i = 0; i < lenTmp; i++) {
+        dataTrans dt = getAsDT(i);
+        if (dt.opcode > 0x3) {
+            emit log("Error: Invalid TP2.0 op-code", debugMsgLog);
+            abortReceive();
+            finishRequest();
+            return;
+        }
 
-    while(keepGoing) {
-        iteration++; // debug use only
+        const QByteArray &frame = lastResponse->at(i)->data;
+        int skip = 1; // op-code and sequence
 
-        if (firstPacket) {
-            bytesReceived = 0;
-            dataTransFirst dtF;
-            if (lastResponse->length() > 0 && lastResponse->at(0)->data.length() > 2) {
-                dtF = getAsDTFirst(0);
-            }
-            else {
+        if (rxMessage.isNull()) {
+            if (frame.length() <= 2) {
                 emit log("Error: Incorrectly trying to interpret packet as first packet", debugMsgLog);
+                finishRequest();
                 return;
             }
-            length = dtF.len;
-            length &= 0x7FFF; // mask off MSB, some modules seem to set this for some reason
-            lastResponse->at(0)->data.remove(1, 2); // remove the 2 length bytes
-            firstPacket = false;
-
-            ret = new QByteArray();
-        }
-
-        if (!ret) {
-            emit log("Error: TP2.0 return byte array does not exist", debugMsgLog);
-            return;
+            dataTransFirst dtF = getAsDTFirst(i);
+            rxLength = dtF.len & 0x7FFF; // mask off MSB, some modules seem to set this for some reason
+            skip = 3; // and the 2 length bytes
+            rxMessage = messagePool::acquire(rxLength);
         }
 
-        if (bytesReceived == length) {
-            emit log("Warning: Bytes received = packet length, should have returned already", debugMsgLog);
-        }
+        // copy straight from the frame into the message
+        rxMessage.append(frame.constData() + skip, frame.length() - skip);
 
-        if (bytesReceived > length) {
+        if (rxMessage.length() > rxLength) {
             emit log("Warning: Received more bytes than the message length", debugMsgLog);
         }
 
-        if (!checkSeq()) {
-            delete ret;
-            return;
+        if (dt.opcode & 0x01) { // last packet
+            if (lenTmp-1 > i) {
+                emit log("Error: This is the last TP2.0 packet but there is data following", debugMsgLog);
+                abortReceive();
+                finishRequest();
+                return;
+            }
+            if (rxMessage.length() < rxLength) {
+                emit log("Warning: Received less bytes than the TP2.0 message length", debugMsgLog);
+            }
+            tpMessage ret = rxMessage;
+            rxMessage = tpMessage();
+            emit response(current.dest, ret);
         }
 
-        int lenTmp = lastResponse->length();
-        for (int i = 0; i < lenTmp; i++) {
-            dataTrans dt = getAsDT(i);
-            if (dt.opcode > 0x3) {
-                emit log("Error: Invalid TP2.0 op-code", debugMsgLog);
-                delete ret;
+        if (!(dt.opcode & 0x02)) { // send ACK
+            if (lenTmp-1 > i) {
+                emit log("Error: Was asked to send TP2.0 ACK but this is not the last packet", debugMsgLog);
+                abortReceive();
+                finishRequest();
                 return;
             }
-            if (dt.opcode & 0x01) { // last packet
-                if (lastResponse->length()-1 > i) {
-                    emit log("Error: This is the last TP2.0 packet but there is data following", debugMsgLog);
-                    delete ret;
-                    return;
-                }
-                keepGoing = false;
-            }
+            QByteArray ack;
+            ack.append(0xB0 | (ch()->rxSeq & 0x0F));
+            command(ack, stateRecvACK);
+            return;
+        }
+    }
 
-            // add data to ret BA
-            ret->append(lastResponse->at(i)->data.mid(1));
-            bytesReceived += lastResponse->at(i)->data.length() - 1;
+    if (gap >= 0) {
+        resyncReceive(gap);
+        return;
+    }
 
-            if (!keepGoing) {
-                if (bytesReceived < length) {
-                    emit log("Warning: Received less bytes than the TP2.0 message length", debugMsgLog);
-                }
-                emit response(ret);
-                //ret = 0;
-            }
+    if (!rxMessage.isNull()) {
+        emit log("Error: TP2.0 message ended without a last packet", debugMsgLog);
+        abortReceive();
+    }
+    finishRequest();
+}
 
-            if (!(dt.opcode & 0x02)) { // send ACK
-                if (lastResponse->length()-1 > i) {
-                    emit log("Error: Was asked to send TP2.0 ACK but this is not the last packet", debugMsgLog);
-                    if (ret) {
-                        //delete ret;
-                    }
-                    return;
-                }
-                if(!sendACK(keepGoing)) {
-                    if (lastResponse->length() > 0) {
-                        // Didn't expect to get more data because we already received the last packet
-                        // There is an additional KWP message following
-                        keepGoing = true;
-                        firstPacket = true;
-                        emit log("Warning: Got a more than one message", debugMsgLog);
-                    }
-                    else {
-                        emit log("Error: Error sending ACK", debugMsgLog);
-                        if (ret) {
-                            //delete ret;
-                        }
-                        return;
-                    }
-                }
+// A frame went missing. If another message starts after the gap, receiving carries
+// on from its first frame. Otherwise, the module stops at a frame that asks for an ACK
+// and an ACK carries the sequence expected next, so answering with the missing
+// sequence has it send again from there. Without a frame to ACK the request is sent again.
+void tp20::resyncReceive(int gap)
+{
+    ch()->seqErrors++;
+    emit log("Warning: TP2.0 sequence error on channel " + toHex(ch()->dest, 2) + ", expected " +
+             QString::number(ch()->rxSeq & 0x0F) + " got " + QString::number(getAsDT(gap).seq), debugMsgLog);
+
+    // a message that starts after the gap came whole, only the broken one is dropped
+    for (int i = qMax(gap, 1); i < lastResponse->length(); i++) {
+        dataTrans prev = getAsDT(i - 1);
+        if (getAsDT(i).opcode <= 0x3 && prev.opcode <= 0x3 && (prev.opcode & 0x01)) {
+            emit log("Info: Resynchronised on the next message from " + toHex(ch()->dest, 2), debugMsgLog);
+            ch()->rxSeq = getAsDT(i).seq;
+            abortReceive();
+            while (i-- > 0) {
+                delete lastResponse->takeFirst();
             }
+            receiveFrames();
+            return;
         }
     }
+
+    int last = lastResponse->length() - 1;
+    dataTrans dt = getAsDT(last);
+    if (dt.opcode <= 0x3 && !(dt.opcode & 0x02) && resyncs < maxResyncs) {
+        resyncs++;
+        ch()->seqRetransmits++;
+        QByteArray ack;
+        ack.append(0xB0 | (ch()->rxSeq & 0x0F));
+        command(ack, stateRecvACK);
+        return;
+    }
+
+    // carry on from what the module sent last, it won't go back
+    ch()->rxSeq = dt.seq + 1;
+    abortReceive();
+    retryRequest();
 }
 
-void tp20::writeToElmStr(const QString &str)
+// Starts the current request again ahead of anything queued
+void tp20::retryRequest()
 {
-    QMetaObject::invokeMethod(elm, "write", Qt::QueuedConnection, Q_ARG(QString, str));
+    if (current.type == sendDataRequest && current.retries < maxRetries) {
+        ch()->seqRetries++;
+        current.retries++;
+        emit log("Info: Sending the request to " + toHex(current.dest, 2) + " again", debugMsgLog);
+        requests.prepend(current);
+    }
+    else {
+        emit log("Error: TP2.0 sequence error, giving up on the request", debugMsgLog);
+    }
+    finishRequest();
+}
+
+void tp20::abortReceive()
+{
+    rxMessage = tpMessage();
 }
 
-void tp20::writeToElmBA(const QByteArray &str)
+void tp20::writeToElmStr(const QString &str)
 {
-    QMetaObject::invokeMethod(elm, "write", Qt::QueuedConnection, Q_ARG(QByteArray, str));
+    QMetaObject::invokeMethod(elm, "write", Qt::QueuedConnection, Q_ARG(QString, str));
 }
 
 void tp20::setSendCanID(int id)
@@ -251,11 +1415,53 @@ void tp20::setRecvCanID(int id)
     QMetaObject::invokeMethod(elm, "setRecvCanID", Qt::QueuedConnection, Q_ARG(int, id));
 }
 
-void tp20::setChannelClosed()
+// Forgets the channel to dest, channelOpened(false) is emitted too if it was the
+// one from openChannel() or that is what failed to open
+void tp20::setChannelClosed(int dest)
+{
+    if (chDest == dest) {
+        chDest = -1;
+    }
+    if (listenDest == dest) {
+        listenDest = -1;
+    }
+    if (selectedDest == dest) {
+        selectedDest = -1;
+    }
+    if (channels.contains(dest)) {
+        const tpChannel &chan = channels[dest];
+        if (chan.seqErrors > 0) {
+            emit log("Info: Channel " + toHex(dest, 2) + " had " + QString::number(chan.seqErrors) +
+                     " sequence errors, " + QString::number(chan.seqRetransmits) + " recovered by retransmit, " +
+                     QString::number(chan.seqRetries) + " by sending the request again");
+        }
+        bool wasOpen = chan.open;
+        channels.remove(dest);
+        if (wasOpen || current.type == addChannelRequest) {
+            emit channelStatus(dest, false);
+        }
+    }
+
+    bool opening = state != stateIdle && current.type == openChannelRequest && current.dest == dest;
+    if (dest == channelDest || opening) {
+        channelDest = -1;
+        emit channelOpened(false);
+    }
+}
+
+void tp20::dropChannels()
 {
+    QList<int> dests = channels.keys();
+    channels.clear();
+    chDest = -1;
+    selectedDest = -1;
+    listenDest = -1;
+    for (int i = 0; i < dests.length(); i++) {
+        emit channelStatus(dests.at(i), false);
+    }
+
     channelDest = -1;
     emit channelOpened(false);
-    return;
 }
 
 void tp20::elmInitialisationFailed()
@@ -272,150 +1478,34 @@ void tp20::setSlowRecvTimeout(int slow)
     slowRecvTimeout = slow;
 }
 
+// called from another thread
 void tp20::setKeepAliveInterval(int time)
 {
-    keepAliveTimer.setInterval(time);
+    QMetaObject::invokeMethod(this, "updateKeepAliveInterval", Qt::QueuedConnection, Q_ARG(int, time));
 }
 
-bool tp20::applyRecvTimeout(int msecs)
+void tp20::updateKeepAliveInterval(int time)
 {
-    if (msecs > 1020) {
-        msecs = 1020;
-    }
-    if (msecs < 0) {
-        msecs = 0;
-    }
-
-    // each increment is 4ms
-    unsigned int val = msecs / 4;
-
-    writeToElmStr("AT ST " + toHex(val));
-    if (!getResponseStatus(OK_RESPONSE)) {
-        emit log("Warning: Could not set receive timeout");
-        recvTimeout = -1; // forces it to try again next time
-        return false;
-    }
-
-    recvTimeout = msecs;
-    return true;
+    keepAliveInterval = time;
+    keepAliveTimer.start(qMax(time / 4, 1));
 }
 
-bool tp20::sendACK(bool dataFollowing) {
-    QByteArray ack;
-    ack.append(0xB0 | (rxSeq & 0x0F));
-    writeToElmBA(ack);
-    if (!getResponseCAN(dataFollowing)) { // ECU should not respond to ACK, unless more TP data
-        return false;
-    }
-    return true;
+// TP2.0 timing byte, top 2 bits are the units (0.1, 1, 10 or 100 ms)
+// and the lower 6 bits are the scale
+double tp20::decodeTiming(quint8 param)
+{
+    static const double units[4] = {0.1, 1, 10, 100};
+    return units[(param >> 6) & 0x03] * (param & 0x3F);
 }
 
 bool tp20::checkACK() {
     dataTrans dt = getAsDT(0);
-    if (dt.opcode != 0xB || dt.seq != (txSeq & 0x0F)) {
+    if (dt.opcode != 0xB || dt.seq != (ch()->txSeq & 0x0F)) {
         return false;
     }
     return true;
 }
 
-void tp20::initialiseElm(bool open)
-{
-    if (open) {
-        // turn off echo
-        writeToElmStr("AT E0"); // make sure there is no existing data coming from COM port
-        getResponseStr();
-        writeToElmStr("AT E0");
-        if (!getResponseStatus(OK_RESPONSE)) {
-            elmInitialisationFailed();
-            return;
-        }
-
-        // get ID strings
-        writeToElmStr("AT I");
-        QString elmProtoVersion = getResponseStr();
-        writeToElmStr("AT @1");
-        QString devStr = getResponseStr();
-
-        emit log("ID: " + devStr);
-        emit log("Protocol: " + elmProtoVersion);
-
-        writeToElmStr("ST I");
-        QString stFirmware = getResponseStr();
-        if (stFirmware != "?") {
-            writeToElmStr("ST DI");
-            QString stDevStr = getResponseStr();
-            writeToElmStr("ST MFR");
-            QString stMfr = getResponseStr();
-            writeToElmStr("ST SN");
-            QString stSN = getResponseStr();
-
-            emit log("Manufacturer: " + stMfr);
-            emit log("Device: " + stDevStr);
-            emit log("Firmware: " + stFirmware);
-            emit log("Serial: " + stSN);
-
-            // set a pass all filter for ST devices
-            writeToElmStr("ST FAP 000,000");
-            if (!getResponseStatus(OK_RESPONSE)) {
-                elmInitialisationFailed();
-                return;
-            }
-        }
-
-        // set user mode B to  500kbps, 11 bit ID
-        writeToElmStr("AT PB C0 01");
-        if (!getResponseStatus(OK_RESPONSE)) {
-            elmInitialisationFailed();
-            return;
-        }
-
-        // activate user mode B
-        writeToElmStr("AT SP B");
-        if (!getResponseStatus(OK_RESPONSE)) {
-            elmInitialisationFailed();
-            return;
-        }
-
-        // turn on CAN ID display (headers??)
-        writeToElmStr("AT H1");
-        if (!getResponseStatus(OK_RESPONSE)) {
-            elmInitialisationFailed();
-            return;
-        }
-
-        // turn on DLC display
-        writeToElmStr("AT D1");
-        if (!getResponseStatus(OK_RESPONSE)) {
-            elmInitialisationFailed();
-            return;
-        }
-
-        // make sure line feeds are off
-        writeToElmStr("AT L0");
-        if (!getResponseStatus(OK_RESPONSE)) {
-            elmInitialisationFailed();
-            return;
-        }
-
-        elmInitilised = true;
-        emit elmInitDone(true);
-    }
-    else {
-        elmInitilised = false;
-        if (channelDest >= 0) {
-            setChannelClosed();
-        }
-        return;
-    }
-}
-
-void tp20::portClosed()
-{
-    elmInitilised = false;
-    setChannelClosed();
-    return;
-}
-
 bool tp20::checkResponse(int len)
 {
     if (!lastResponse)
@@ -480,133 +1570,34 @@ dataTransFirst tp20::getAsDTFirst(int i)
     return tmp;
 }
 
-bool tp20::checkSeq()
+// Returns the index of the first data frame in lastResponse that is out of
+// sequence, or -1 if they all follow on. A repeat of the frame before is dropped.
+// rxSeq is left at the sequence expected next.
+int tp20::checkSeq()
 {
-    if (!lastResponse) {
-        return false;
-    }
-
     for (int i = 0; i < lastResponse->length(); i++) {
         dataTrans tmp = getAsDT(i);
         if (tmp.opcode > 0x3)
             continue;
-        if (tmp.seq != (rxSeq++ & 0x0F)) {
-            return false;
+        if (tmp.seq == (ch()->rxSeq & 0x0F)) {
+            ch()->rxSeq++;
+            continue;
         }
-    }
-    return true;
-}
-
-void tp20::openChannel(int dest, int timeout)
-{
-    if (!elmInitilised) {
-        return;
-    }
-
-    if (recvTimeout != timeout) {
-        emit log("Info: Setting new timeout", debugMsgLog);
-        if (!applyRecvTimeout(timeout)) {
-            emit log("Error: Couldn't set timeout", debugMsgLog);
-            setChannelClosed();
-            return;
+        if (tmp.seq == ((ch()->rxSeq - 1) & 0x0F)) {
+            emit log("Warning: Dropped a repeated TP2.0 frame", debugMsgLog);
+            delete lastResponse->takeAt(i--);
+            continue;
         }
+        return i;
     }
-
-    setSendCanID(0x200);
-    if (!getResponseStatus(OK_RESPONSE)) {
-        setChannelClosed();
-        return;
-    }
-
-    setRecvCanID(0x200 + dest);
-    if (!getResponseStatus(OK_RESPONSE)) {
-        setChannelClosed();
-        return;
-    }
-
-    rxSeq = 0;
-    txSeq = 0;
-
-    writeToElmStr(toHex(dest, 2) + " C0 00 10 00 03 01");
-    if (!getResponseCAN() || !checkResponse(7)) {
-        setChannelClosed();
-        return;
-    }
-    chanSetup setup = getAsCS(0);
-    rxID = (setup.rxPre << 8) + setup.rxID;
-    if (setup.opcode != 0xD0 || rxID != 0x300 || setup.rxV > 0 || setup.txV > 0) {
-        setChannelClosed();
-        return;
-    }
-    txID = (setup.txPre << 8) + setup.txID;
-
-    setSendCanID(txID);
-    if (!getResponseStatus(OK_RESPONSE)) {
-        setChannelClosed();
-        return;
-    }
-
-    setRecvCanID(rxID);
-    if (!getResponseStatus(OK_RESPONSE)) {
-        setChannelClosed();
-        return;
-    }
-
-    writeToElmStr("A0 0F 8A FF 4A FF");
-    if (!getResponseCAN() || !checkResponse(6)) {
-        setChannelClosed();
-        return;
-    }
-    chanParam param = getAsCP(0);
-    if (param.opcode != 0xA1 || param.bs > 0xF) {
-        setChannelClosed();
-        return;
-    }
-    bs = param.bs;
-    t1 = param.T1;
-    t3 = param.T3;
-
-    channelDest = dest;
-    emit channelOpened(true);
-}
-
-void tp20::closeChannel()
-{
-    writeToElmStr("A8");
-    getResponseCAN();
-    setChannelClosed();
-}
-
-void tp20::sendKeepAlive()
-{
-    if (channelDest < 0)
-        return;
-
-    emit log("Sending keep alive command", keepAliveLog);
-
-    //QMutexLocker locker(&sendLock);
-
-    writeToElmStr("A3");
-    if (!getResponseCAN() || !checkResponse(6)) {
-        setChannelClosed();
-        return;
-    }
-    chanParam param = getAsCP(0);
-    if (param.opcode != 0xA1 || param.bs > 0xF) {
-        setChannelClosed();
-        return;
-    }
-
-    bs = param.bs;
-    t1 = param.T1;
-    t3 = param.T3;
+    return -1;
 }
 
-bool tp20::getResponseStatus(int expectedResult)
+bool tp20::parseResponseStatus(const QStringList &lines, int expectedResult)
 {
     int status;
 
-    bool tmp = elm->getResponseStatus(status);
+    bool tmp = elm327::parseResponseStatus(lines, status);
 
     if (status == expectedResult) {
         return tmp;
@@ -621,25 +1612,20 @@ bool tp20::getResponseStatus(int expectedResult)
 bool tp20::checkForCommands() {
     for (int i = 0; i < lastResponse->length(); i++) {
         quint8 op = lastResponse->at(i)->data.at(0);
-        if (op == 0xA3) { // channel test
+        if (op == 0xA3) { // channel test, answered before the next command
             emit log("Received channel test command, sending response", keepAliveLog);
-            writeToElmStr("A3");
-            getResponseStr();
-
-            // reset keep alive timer
-            QMetaObject::invokeMethod(&keepAliveTimer, "start", Qt::QueuedConnection);
-
+            channelTestPending = true;
             lastResponse->removeAt(i--);
         }
         else if (op == 0xA8 || op == 0xA4) { // close channel, break
-            setChannelClosed();
+            setChannelClosed(current.dest);
             return false;
         }
     }
     return true;
 }
 
-bool tp20::getResponseCAN(bool replyExpected)
+bool tp20::parseResponseCAN(const QStringList &lines, bool replyExpected)
 {
     int status;
 
@@ -649,10 +1635,13 @@ bool tp20::getResponseCAN(bool replyExpected)
         lastResponse = 0;
     }
 
-    lastResponse = elm->getResponseCAN(status);
+    lastResponse = elm327::parseResponseCAN(lines, status);
     if (!checkForCommands()) { // disconnect command must have occurred
         return false;
     }
+    if (ch() && !lastResponse->empty()) {
+        ch()->lastTraffic.start(); // any traffic from the module puts off the keep alive
+    }
     if (lastResponse->empty()) {
         status |= NO_DATA_RESPONSE; // account for removal of A3 tests
     }
@@ -670,15 +1659,14 @@ bool tp20::getResponseCAN(bool replyExpected)
     emit log("Error: Wrong response while getting CAN frame", responseErrorLog);
     emit log(decodeError(status), responseErrorLog);
 
-    //setChannelClosed();
     return false;
 }
 
-QString tp20::getResponseStr()
+QString tp20::parseResponseStr(const QStringList &lines)
 {
     int status;
 
-    QString tmp = elm->getResponseStr(status);
+    QString tmp = elm327::parseResponseStr(lines, status);
 
     if (status == 0) {
         return tmp;
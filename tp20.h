@@ -22,9 +22,12 @@ along with VAG Blocks.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <QObject>
 #include <QTimer>
+#include <QElapsedTimer>
+#include <QMap>
 
 #include "elm327.h"
 #include "canframe.h"
+#include "messagepool.h"
 #include "util.h"
 
 typedef struct {
@@ -64,46 +67,237 @@ typedef struct {
     quint16 len;
 } dataTransFirst;
 
+enum tpRequestType {
+    initElmRequest,
+    openChannelRequest,
+    sendDataRequest,
+    keepAliveRequest,
+    exclusiveRequest,
+    paramsRequest,
+    addChannelRequest,
+    closeChannelRequest,
+    listenRequest
+};
+
+// Request classes, lowest first. The queue runs the highest class first, and keep
+// alives ahead of anything that would hold the link past their deadline.
+enum tpRequestClass {
+    priorityListen,
+    priorityBlockRead,
+    priorityCommand,
+    priorityControl, // opening channels, parameters
+    priorityKeepAlive,
+    priorityClose,
+    numPriorities
+};
+
+typedef struct {
+    int type;
+    int dest;
+    int timeout; // msecs, how long an exclusiveRequest is expected to take
+    QByteArray data; // method name for exclusiveRequest
+    QObject* obj;
+    int retries; // times a sendDataRequest has been started again
+    int priority;
+    qint64 deadline; // msecs on the tp20 clock it should be started by, -1 if none
+    bool started; // it's being resumed, eg. after a channel switch
+} tpRequest;
+
+// Response time of one service on one module, smoothed as TCP does for its
+// retransmission timeout (RFC 6298)
+typedef struct {
+    double srtt; // msecs from the request to the end of the response
+    double rttvar;
+    int rto; // receive timeout it gives, msecs
+    int samples;
+    int timeouts;
+} rttEstimate;
+
+// Everything that belongs to one open channel. Only one channel can be selected
+// on the ELM327 at a time (AT SH/AT CRA), the others wait in the map.
+typedef struct {
+    int dest;
+    bool open; // false while it's being opened or waiting for its A8
+    quint16 txID;
+    quint16 rxID;
+    quint8 bs;
+    quint8 t1;
+    quint8 t3;
+    double ackTimeout; // T1 in msecs
+    double packetGap; // T3 in msecs
+    quint8 txSeq;
+    quint8 rxSeq;
+    QElapsedTimer lastPacketTime;
+    QElapsedTimer lastTraffic; // anything sent or received, for the keep alive
+    bool keepAliveQueued;
+    int seqErrors; // frames received out of sequence
+    int seqRetransmits; // recovered by ACKing the expected sequence
+    int seqRetries; // recovered by sending the request again
+} tpChannel;
+
 class tp20 : public QObject
 {
     Q_OBJECT
 public:
     tp20(elm327* elm, QObject *parent = 0);
     int getChannelDest();
+    int getRecvCanID();
     bool getElmInitialised();
     void setSlowRecvTimeout(int slow);
     void setKeepAliveInterval(int time);
+    static double decodeTiming(quint8 param);
 public slots:
     void initialiseElm(bool open);
     void portClosed();
     void openChannel(int dest, int timeout);
+    void addChannel(int dest, int timeout);
     void closeChannel();
     void sendData(const QByteArray &data, int requestedTimeout);
+    void sendDataTo(int dest, const QByteArray &data, int requestedTimeout, int priority = priorityCommand);
+    void runExclusive(QObject* obj, const QByteArray &method, int duration);
+    void setModuleParams(int dest, int bs, int t1, int t3);
+    void setParams(int bs, int t1, int t3);
+    void setListening(int dest);
+    void setAdaptiveTimeouts(bool on);
 private slots:
     void sendKeepAlive();
+    void readLines();
+    void responseTimeout();
+    void pacingDone();
+    void updateKeepAliveInterval(int time);
 signals:
     void log(const QString &txt, int logLevel = stdLog);
     void elmInitDone(bool ok);
     void channelOpened(bool ok);
-    void response(QByteArray* data);
+    void channelStatus(int dest, bool open);
+    void response(int dest, const tpMessage &msg);
+    void channelParams(int dest, int bs, int t1, int t3);
+    void responseTime(int dest, int service, const rttEstimate &estimate);
 private:
+    // each state is waiting for the response to one command written to the ELM327
+    enum tpState {
+        stateIdle,
+        stateInitFlush,
+        stateInitEcho,
+        stateInitID,
+        stateInitDevice,
+        stateInitSTFirmware,
+        stateInitSTDevice,
+        stateInitSTMfr,
+        stateInitSTSerial,
+        stateInitSTFilter,
+        stateInitProtocolB,
+        stateInitSelectB,
+        stateInitHeaders,
+        stateInitDLC,
+        stateInitLineFeeds,
+        stateSetTimeout,
+        stateOpenSendID,
+        stateOpenRecvID,
+        stateOpenSetup,
+        stateOpenChanSendID,
+        stateOpenChanRecvID,
+        stateOpenParams,
+        stateSwitchSendID,
+        stateSwitchRecvID,
+        stateSendPacket,
+        stateSendBlockEnd,
+        stateSendLast,
+        stateRecvACK,
+        stateKeepAlive,
+        stateParams,
+        stateChannelTest,
+        stateClose,
+        statePacing, // waiting out T3 before the next packet, nothing written
+        stateListen, // monitoring (AT MA) for responses the module sends by itself
+        stateListenStop
+    };
+
+    // what to carry on with once a new receive timeout has been set
+    enum timeoutResume {
+        resumeRequest, // the current request is started again
+        resumePacket
+    };
+
     elm327* elm;
     QList<canFrame*>* lastResponse;
-    int channelDest;
-    quint16 txID;
-    quint16 rxID;
-    quint8 bs;
-    quint8 t1;
-    quint8 t3;
-    quint8 txSeq;
-    quint8 rxSeq;
+    int channelDest; // the channel opened with openChannel(), sendData() goes to it
+    int recvCanID; // its receive ID, read from the other threads
+    QMap<int, tpChannel> channels;
+    int chDest; // channel of the current request, -1 if it doesn't have one
+    int selectedDest; // channel the ELM327 header and filter are set for, -1 if none
+    QTimer pacingTimer;
     QTimer keepAliveTimer;
-    QMutex sendLock;
+
+    // A module in a periodic transmission mode sends responses without being asked.
+    // When nothing else is queued the channel is monitored for them, monitoring stops
+    // to ACK a frame, to run a request or when the response timer runs out.
+    int listenDest; // -1 when not listening
+    int keepAliveInterval;
     bool elmInitilised;
 
-    bool getResponseCAN(bool replyExpected = true);
-    QString getResponseStr();
-    bool getResponseStatus(int expectedResult);
+    QList<tpRequest> requests; // highest class first, by deadline within a class
+    tpRequest current;
+    QElapsedTimer clock;
+    int missedDeadlines[numPriorities];
+    int state;
+    QStringList responseLines;
+    QTimer responseTimer;
+    bool channelTestPending;
+    QString deferredCommand;
+    int deferredState;
+    int closePrompts;
+    QStringList elmInfo;
+
+    QByteArray sendBuffer;
+    int packetIndex;
+    int sendTimeout; // msecs, the AT ST used for every packet of the current send
+    tpMessage rxMessage;
+    quint16 rxLength;
+    int resyncs; // retransmits asked for during the current request
+    static const int maxResyncs = 3;
+    static const int maxRetries = 2;
+
+    void enqueue(tpRequest req, int priority = priorityControl);
+    void insertRequest(tpRequest req, int priority, qint64 deadline);
+    bool queueKeepAlives(int horizon, int skipDest);
+    int expectedDuration(const tpRequest &req);
+    void checkDeadline(const tpRequest &req);
+    void nextRequest();
+    void finishRequest();
+    void reset();
+    void command(const QString &str, int newState);
+    void command(const QByteArray &data, int newState);
+    void expect(int newState);
+    void handleResponse(const QStringList &lines);
+    void handleInit(const QStringList &lines);
+    void handleOpen(const QStringList &lines);
+    void handleSend(const QStringList &lines);
+
+    bool startTimeout(int msecs, int resume);
+    int timeoutResumeWith;
+    void setChannelParams(const chanParam &param);
+    QMap<int, QByteArray> moduleParams; // what we ask each module for in A0
+    QByteArray paramRequest(int bs, int t1, int t3);
+    int responseWait();
+    tpChannel* ch();
+    bool useChannel(int dest);
+    bool selectChannel();
+    void queueClose(int dest);
+    void startOpen();
+    void startSend();
+    void startListen();
+    void listenLine(const QString &line);
+    void stopListening();
+    void sendPacket();
+    void receiveFrames();
+    void resyncReceive(int gap);
+    void retryRequest();
+    void abortReceive();
+
+    bool parseResponseCAN(const QStringList &lines, bool replyExpected = true);
+    QString parseResponseStr(const QStringList &lines);
+    bool parseResponseStatus(const QStringList &lines, int expectedResult);
 
     bool checkResponse(int len);
     chanSetup getAsCS(int i);
@@ -111,25 +305,34 @@ private:
     dataTrans getAsDT(int i);
     dataTransFirst getAsDTFirst(int i);
 
-    bool checkSeq();
+    int checkSeq();
     bool checkACK();
-    bool sendACK(bool dataFollowing = false);
     bool checkForCommands();
 
-    void recvData();
-
     void writeToElmStr(const QString &str);
-    void writeToElmBA(const QByteArray &str);
     void setSendCanID(int id);
     void setRecvCanID(int id);
 
-    void setChannelClosed();
+    void setChannelClosed(int dest);
+    void dropChannels();
     void elmInitialisationFailed();
     QString decodeError(int status);
 
-    bool applyRecvTimeout(int msecs);
     int recvTimeout;
+    int pendingTimeout;
     int slowRecvTimeout;
+
+    // With adaptive timeouts the wait for a response is worked out from how long the
+    // module has taken to answer the service, rather than what the caller asked for.
+    // The ELM327 waits out the timeout after the last frame of a response, so a
+    // timeout that is too long costs that much on every request.
+    bool adaptiveTimeouts;
+    QMap<int, rttEstimate> estimates; // (dest << 8) | service
+    QElapsedTimer lastPacketClock; // since the last packet of the request was written
+    static const int minAdaptiveTimeout = 8;
+    static const int minEstimateSamples = 4; // the requested timeout is used until then
+    int requestTimeout();
+    void updateEstimate(bool timedOut);
 };
 
 #endif // TP20_H
@@ -0,0 +1,382 @@
+/*
+Copyright 2013 Jared Wiltshire
+
+This file is part of VAG Blocks.
+
+VAG Blocks is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+VAG Blocks is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with VAG Blocks.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "tpbench.h"
+
+#include <QtAlgorithms>
+
+// modules the simulator has, the first is opened with openChannel()
+static const int benchDests[] = {0x01, 0x02};
+static const int numBenchDests = 2;
+
+tpbench::tpbench(QObject *parent) :
+    QObject(parent),
+    sim(0), tp(0),
+    running(false), closing(false), passed(false),
+    phase(0)
+{
+    requestTimer.setSingleShot(true);
+    connect(&requestTimer, SIGNAL(timeout()), this, SLOT(requestTimeout()));
+}
+
+bool tpbench::isRunning() const
+{
+    return running;
+}
+
+void tpbench::run()
+{
+    if (running) {
+        return;
+    }
+
+    running = true;
+    closing = false;
+    passed = true;
+    phase = 0;
+    openDests.clear();
+    outstanding.clear();
+
+    sim = new ecusim(this);
+    sim->setSeed(2013); // the same faults every run
+    for (int i = 0; i < numBenchDests; i++) {
+        sim->addModule(benchDests[i]);
+    }
+
+    tp = new tp20(sim, this);
+    connect(tp, SIGNAL(elmInitDone(bool)), this, SLOT(elmInitDone(bool)));
+    connect(tp, SIGNAL(channelStatus(int, bool)), this, SLOT(channelStatus(int, bool)));
+    connect(tp, SIGNAL(response(int, tpMessage)), this, SLOT(response(int, tpMessage)));
+    connect(tp, SIGNAL(log(QString, int)), this, SLOT(tpLog(QString, int)));
+
+    emit log("Transport self test: starting against the simulated ECU");
+    requestTimer.start(requestTimeoutMsecs * 5);
+    sim->start();
+}
+
+void tpbench::elmInitDone(bool ok)
+{
+    if (!ok) {
+        emit log("Transport self test: FAIL, could not initialise the simulated ELM327");
+        passed = false;
+        cleanup();
+        return;
+    }
+
+    tp->openChannel(benchDests[0], recvTimeout);
+    for (int i = 1; i < numBenchDests; i++) {
+        tp->addChannel(benchDests[i], recvTimeout);
+    }
+}
+
+void tpbench::channelStatus(int dest, bool open)
+{
+    if (closing) {
+        return;
+    }
+
+    if (!open) {
+        if (openDests.contains(dest)) {
+            emit log("Transport self test: channel to " + toHex(dest) + " closed during the test");
+            passed = false;
+            openDests.removeAll(dest);
+        }
+        return;
+    }
+
+    if (!openDests.contains(dest)) {
+        openDests << dest;
+    }
+    if (openDests.length() == numBenchDests && phase == 0 && !phaseClock.isValid()) {
+        requestTimer.stop();
+        startPhase();
+    }
+}
+
+// phase 0 is clean, phase 1 has every fault the simulator can inject
+void tpbench::startPhase()
+{
+    result.sent = 0;
+    result.answered = 0;
+    result.lost = 0;
+    result.late = 0;
+    result.wrong = 0;
+    result.unexpected = 0;
+    result.pending = 0;
+    result.maxOutstanding = 0;
+    result.latencies.clear();
+    outstanding.clear();
+    lost.clear();
+    result.latencies.reserve(messagesPerPhase);
+
+    if (phase == 0) {
+        result.name = "clean";
+        sim->setFaults(0, 0, 0, 0, 0);
+        sim->setInjections(0, 0);
+    }
+    else {
+        result.name = "faults";
+        sim->setFaults(2, 2, 3, 2, 150);
+        sim->setInjections(5, 3);
+    }
+    sim->resetStats();
+
+    phaseClock.start();
+    fill();
+}
+
+// Alternates the channels and mixes short block reads with a long identification
+// that needs several blocks of frames. Requests queued back to back on a channel
+// always differ, so a response can't be taken for the one after it.
+void tpbench::fill()
+{
+    while (outstanding.length() < maxOutstanding && result.sent < messagesPerPhase) {
+        int n = result.sent++;
+        benchRequest req;
+        switch (n % 4) {
+        case 1:
+            req.data.append(static_cast<char>(0x1A));
+            req.data.append(static_cast<char>(0x9B));
+            break;
+        case 3:
+            req.data.append(static_cast<char>(0x10));
+            req.data.append(static_cast<char>(0x89));
+            break;
+        default:
+            req.data.append(static_cast<char>(0x21));
+            req.data.append(static_cast<char>(1 + (n / 2) % 20));
+            break;
+        }
+        req.dest = benchDests[n % numBenchDests];
+        req.sentAt = phaseClock.nsecsElapsed() / 1000;
+        outstanding << req;
+        tp->sendDataTo(req.dest, req.data, recvTimeout);
+    }
+    result.maxOutstanding = qMax(result.maxOutstanding, outstanding.length());
+
+    if (outstanding.empty()) {
+        requestTimer.stop();
+        finishPhase();
+        return;
+    }
+    armTimer();
+}
+
+void tpbench::armTimer()
+{
+    qint64 due = outstanding.first().sentAt / 1000 + requestTimeoutMsecs;
+    requestTimer.start(static_cast<int>(qMax<qint64>(due - phaseClock.elapsed(), 0)));
+}
+
+bool tpbench::matches(const benchRequest &request, int dest, const tpMessage &msg)
+{
+    if (dest != request.dest || request.data.length() < 2 || msg.length() < 2) {
+        return false;
+    }
+    if (msg.at(0) != static_cast<quint8>(request.data.at(0)) + 0x40 || msg.at(1) != static_cast<quint8>(request.data.at(1))) {
+        return false;
+    }
+    if (msg.at(0) == 0x61) { // the simulator puts the block number in each value
+        return msg.length() == 14 && msg.at(4) == msg.at(1) && msg.at(13) == static_cast<quint8>(msg.at(1) + 3);
+    }
+    return true;
+}
+
+void tpbench::response(int dest, const tpMessage &msg)
+{
+    if (closing) {
+        return;
+    }
+
+    if (msg.length() == 3 && msg.at(0) == 0x7F && msg.at(2) == 0x78) { // response pending, wait on
+        result.pending++;
+        return;
+    }
+
+    // tp20 answers each channel's requests in order, one it gave up on has no response
+    int first = -1;
+    int found = -1;
+    for (int i = 0; i < outstanding.length() && found < 0; i++) {
+        if (outstanding.at(i).dest != dest) {
+            continue;
+        }
+        if (first < 0) {
+            first = i;
+        }
+        if (matches(outstanding.at(i), dest, msg)) {
+            found = i;
+        }
+    }
+
+    if (found < 0) {
+        bool late = false;
+        for (int i = 0; i < lost.length() && !late; i++) {
+            if (matches(lost.at(i), dest, msg)) { // tp20 got there after the bench gave up
+                lost.removeAt(i);
+                late = true;
+            }
+        }
+        if (late) {
+            result.late++;
+        }
+        else if (first < 0) {
+            result.unexpected++;
+            emit log("Transport self test: response from " + toHex(dest) + " with nothing outstanding", debugMsgLog);
+        }
+        else {
+            result.wrong++;
+            emit log("Transport self test: wrong response from " + toHex(dest) + " to " +
+                     toHex(static_cast<quint8>(outstanding.at(first).data.at(0))), debugMsgLog);
+        }
+        return;
+    }
+
+    for (int i = found - 1; i >= first; i--) {
+        if (outstanding.at(i).dest == dest) {
+            result.lost++;
+            lost << outstanding.takeAt(i);
+            found--;
+        }
+    }
+    while (lost.length() > maxLostKept) {
+        lost.removeFirst();
+    }
+
+    result.latencies << phaseClock.nsecsElapsed() / 1000 - outstanding.at(found).sentAt;
+    result.answered++;
+    outstanding.removeAt(found);
+    fill();
+}
+
+void tpbench::requestTimeout()
+{
+    if (closing) {
+        cleanup();
+        return;
+    }
+
+    if (!phaseClock.isValid()) {
+        emit log("Transport self test: FAIL, could not open channels to the simulated modules");
+        passed = false;
+        finish();
+        return;
+    }
+
+    if (outstanding.empty()) {
+        return;
+    }
+
+    result.lost++;
+    lost << outstanding.takeFirst();
+    if (lost.length() > maxLostKept) {
+        lost.removeFirst();
+    }
+    fill();
+}
+
+// only the warnings and channel summaries, the rest is in the debug log
+void tpbench::tpLog(const QString &txt, int logLevel)
+{
+    if (logLevel == stdLog && (txt.startsWith("Warning") || txt.startsWith("Error") || txt.startsWith("Info: Channel"))) {
+        emit log("Transport self test: " + txt);
+    }
+}
+
+void tpbench::finishPhase()
+{
+    result.msecs = phaseClock.elapsed();
+    const simStats &stats = sim->getStats();
+
+    QVector<qint64> sorted = result.latencies;
+    qSort(sorted);
+
+    double secs = qMax<qint64>(result.msecs, 1) / 1000.0;
+    emit log("Transport self test (" + result.name + "): " + QString::number(result.answered) + "/" +
+             QString::number(result.sent) + " answered in " + doubleToStr(secs, 1) + "s, " +
+             doubleToStr(result.answered / secs, 1) + " msgs/s");
+    if (!sorted.empty()) {
+        emit log("Transport self test (" + result.name + "): latency ms p50 " +
+                 doubleToStr(percentile(sorted, 50) / 1000.0) + " p90 " +
+                 doubleToStr(percentile(sorted, 90) / 1000.0) + " p99 " +
+                 doubleToStr(percentile(sorted, 99) / 1000.0) + " max " +
+                 doubleToStr(sorted.last() / 1000.0));
+    }
+    emit log("Transport self test (" + result.name + "): lost " + QString::number(result.lost) +
+             ", late " + QString::number(result.late) + ", wrong " + QString::number(result.wrong) +
+             ", unexpected " + QString::number(result.unexpected) + ", response pending " +
+             QString::number(result.pending) + ", up to " + QString::number(result.maxOutstanding) +
+             " requests outstanding");
+    emit log("Transport self test (" + result.name + "): injected drops " + QString::number(stats.drops) +
+             ", duplicates " + QString::number(stats.duplicates) + ", reorders " + QString::number(stats.reorders) +
+             ", delays " + QString::number(stats.delays) + " (" + QString::number(stats.timeouts) +
+             " past the adapter timeout), channel tests " + QString::number(stats.channelTests) +
+             ", module retransmits " + QString::number(stats.retransmits));
+
+    // the invariants, nothing may go missing without faults and only a few with them
+    bool ok = result.wrong == 0 && result.unexpected == 0 && stats.seqErrors == 0 &&
+            result.answered + result.lost == result.sent;
+    if (phase == 0) {
+        ok = ok && result.lost == 0 && result.late == 0;
+    }
+    else {
+        ok = ok && result.lost * 100 <= result.sent * maxLostPercent &&
+                result.late * 100 <= result.sent * maxLatePercent;
+    }
+    if (stats.seqErrors > 0) {
+        emit log("Transport self test (" + result.name + "): " + QString::number(stats.seqErrors) +
+                 " frames from the tester out of sequence");
+    }
+    emit log("Transport self test (" + result.name + "): " + (ok ? "PASS" : "FAIL"));
+    passed = passed && ok;
+
+    if (++phase < numPhases) {
+        startPhase();
+    }
+    else {
+        finish();
+    }
+}
+
+void tpbench::finish()
+{
+    emit log(QString("Transport self test: ") + (passed ? "PASS" : "FAIL"));
+    closing = true;
+    tp->closeChannel();
+    requestTimer.start(requestTimeoutMsecs); // time for the A8s to go
+}
+
+void tpbench::cleanup()
+{
+    requestTimer.stop();
+    tp->deleteLater();
+    sim->deleteLater();
+    tp = 0;
+    sim = 0;
+    phaseClock.invalidate();
+    running = false;
+    emit finished(passed);
+}
+
+// nearest rank
+qint64 tpbench::percentile(const QVector<qint64> &sorted, int p)
+{
+    int rank = (p * sorted.size() + 99) / 100;
+    return sorted.at(qBound(0, rank - 1, sorted.size() - 1));
+}
@@ -0,0 +1,109 @@
+/*
+Copyright 2013 Jared Wiltshire
+
+This file is part of VAG Blocks.
+
+VAG Blocks is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+VAG Blocks is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with VAG Blocks.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef TPBENCH_H
+#define TPBENCH_H
+
+#include <QObject>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QVector>
+
+#include "ecusim.h"
+#include "tp20.h"
+#include "util.h"
+
+typedef struct {
+    QString name;
+    int sent;
+    int answered;
+    int lost; // no response before the bench gave up on it
+    int late; // response to a request already counted as lost
+    int wrong; // response that doesn't belong to the request
+    int unexpected; // response with nothing outstanding
+    int pending; // 7F xx 78 before the real response
+    qint64 msecs;
+    int maxOutstanding; // most requests queued in tp20 at once
+    QVector<qint64> latencies; // usecs from request to response
+} benchPhase;
+
+typedef struct {
+    int dest;
+    QByteArray data;
+    qint64 sentAt; // usecs into the phase
+} benchRequest;
+
+// Runs tp20 against an ecusim, first clean and then with faults injected, checking
+// every request gets its own response exactly once and reporting messages per second
+// and latency percentiles. Up to maxOutstanding requests are queued across the
+// channels at once. Everything runs in the thread the bench is in.
+class tpbench : public QObject
+{
+    Q_OBJECT
+public:
+    explicit tpbench(QObject *parent = 0);
+    bool isRunning() const;
+signals:
+    void log(const QString &txt, int logLevel = stdLog);
+    void finished(bool passed);
+public slots:
+    void run();
+private slots:
+    void elmInitDone(bool ok);
+    void channelStatus(int dest, bool open);
+    void response(int dest, const tpMessage &msg);
+    void requestTimeout();
+    void tpLog(const QString &txt, int logLevel);
+private:
+    ecusim* sim;
+    tp20* tp;
+    bool running;
+    bool closing;
+    bool passed;
+    int phase;
+    benchPhase result;
+    QList<int> openDests;
+    QList<benchRequest> outstanding; // oldest first
+    QList<benchRequest> lost; // the last few given up on, a response to one is late
+    QElapsedTimer phaseClock;
+    QTimer requestTimer; // fires at the oldest request's deadline
+
+    static const int numPhases = 2;
+    static const int messagesPerPhase = 400;
+    static const int maxOutstanding = 4;
+    static const int maxLostKept = 8;
+    // each request can wait behind all the others, the deadline counts from when it's queued
+    static const int requestTimeoutMsecs = 1000 * maxOutstanding;
+    static const int recvTimeout = 24; // msecs, same as kwp2000 uses normally
+    // the faults phase passes with at most this many lost or late per hundred sent
+    static const int maxLostPercent = 5;
+    static const int maxLatePercent = 2;
+
+    void startPhase();
+    void fill();
+    void armTimer();
+    bool matches(const benchRequest &request, int dest, const tpMessage &msg);
+    void finishPhase();
+    void finish();
+    void cleanup();
+    static qint64 percentile(const QVector<qint64> &sorted, int p);
+};
+
+#endif // TPBENCH_H
@@ -0,0 +1,327 @@
+/*
+Copyright 2013 Jared Wiltshire
+
+This file is part of VAG Blocks.
+
+VAG Blocks is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+VAG Blocks is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with VAG Blocks.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "uds.h"
+
+uds::uds(isotp *transport, tp20 *tp, QObject *parent) :
+    QObject(parent),
+    transport(transport),
+    tp(tp),
+    maxDidsPerRequest(8),
+    nextJob(0)
+{
+    // the only identification DID with a length fixed by the standard, the part
+    // numbers and names differ between modules and are learned
+    didLengths.insert(0xF190, 17); // VIN
+
+    connect(transport, SIGNAL(response(int, QByteArray)), this, SLOT(response(int, QByteArray)));
+    connect(transport, SIGNAL(failed(int, QString)), this, SLOT(failed(int, QString)));
+}
+
+// length of the data the module sends for did, needed to read it along with others
+void uds::setDidLength(int did, int length)
+{
+    didLengths.insert(did, length);
+}
+
+// the default, modules that refuse a request as too long get their own
+void uds::setMaxDidsPerRequest(int max)
+{
+    maxDidsPerRequest = qMax(1, max);
+}
+
+// The adapter was initialised again, it may be on another car
+void uds::forgetModules()
+{
+    moduleLengths.clear();
+    moduleMaxDids.clear();
+}
+
+// -1 if it hasn't been read from this module yet
+int uds::didLength(int txID, int did) const
+{
+    int len = moduleLengths.value(txID).value(did, -1);
+    return len >= 0 ? len : didLengths.value(did, -1);
+}
+
+int uds::maxDids(int txID) const
+{
+    return moduleMaxDids.value(txID, maxDidsPerRequest);
+}
+
+// Splits dids into requests, the DIDs of known length together and each of unknown
+// length on its own. didData() is emitted once they have all been answered.
+void uds::readDIDs(int txID, int rxID, const QList<int> &dids)
+{
+    if (dids.empty()) {
+        return;
+    }
+
+    QList<int> known;
+    QList<int> unknown;
+    for (int i = 0; i < dids.length(); i++) {
+        if (didLength(txID, dids.at(i)) >= 0) {
+            known << dids.at(i);
+        }
+        else {
+            unknown << dids.at(i);
+        }
+    }
+
+    udsJob job;
+    job.txID = txID;
+    job.remaining = 0;
+    int jobNum = nextJob++;
+
+    QList<udsRead> reads;
+    udsRead read;
+    read.job = jobNum;
+    read.txID = txID;
+    read.rxID = rxID;
+    int max = maxDids(txID);
+    while (!known.empty()) {
+        read.dids.clear();
+        while (!known.empty() && read.dids.length() < max) {
+            read.dids << known.takeFirst();
+        }
+        reads << read;
+    }
+    while (!unknown.empty()) {
+        read.dids.clear();
+        read.dids << unknown.takeFirst();
+        reads << read;
+    }
+
+    job.remaining = reads.length();
+    jobs.insert(jobNum, job);
+    for (int i = 0; i < reads.length(); i++) {
+        send(reads.at(i));
+    }
+}
+
+void uds::send(const udsRead &read)
+{
+    isotpRequest req;
+    req.txID = read.txID;
+    req.rxID = read.rxID;
+    req.timeout = responseTimeout;
+    req.data.append(static_cast<char>(0x22));
+    for (int i = 0; i < read.dids.length(); i++) {
+        req.data.append(static_cast<char>(read.dids.at(i) >> 8));
+        req.data.append(static_cast<char>(read.dids.at(i) & 0xFF));
+    }
+
+    outstanding << read;
+    transport->queueRequest(req);
+
+    // isotp needs the ELM327 to itself, tp20 runs it once it's idle
+    QMetaObject::invokeMethod(tp, "runExclusive", Qt::QueuedConnection,
+                              Q_ARG(QObject*, transport),
+                              Q_ARG(QByteArray, "run"),
+                              Q_ARG(int, responseTimeout));
+}
+
+void uds::response(int rxID, const QByteArray &data)
+{
+    if (outstanding.empty() || outstanding.first().rxID != rxID) {
+        emit log("Warning: UDS response from " + toHex(rxID, 3) + " that wasn't asked for", debugMsgLog);
+        return;
+    }
+    udsRead read = outstanding.takeFirst();
+
+    if (data.length() >= 3 && static_cast<quint8>(data.at(0)) == 0x7F && static_cast<quint8>(data.at(1)) == 0x22) {
+        retry(read, data.at(2));
+    }
+    else if (data.length() >= 1 && static_cast<quint8>(data.at(0)) == 0x62) {
+        parseResponse(read, data);
+    }
+    else {
+        emit log("Error: Unexpected UDS response to ReadDataByIdentifier", debugMsgLog);
+    }
+
+    requestDone(read.job);
+}
+
+void uds::failed(int rxID, const QString &reason)
+{
+    if (outstanding.empty() || outstanding.first().rxID != rxID) {
+        return;
+    }
+    udsRead read = outstanding.takeFirst();
+
+    emit log("Error: Reading UDS identifiers from " + toHex(read.txID, 3) + " failed, " + reason);
+    if (jobs.contains(read.job)) {
+        jobs[read.job].unsupported << read.dids;
+    }
+    requestDone(read.job);
+}
+
+// each DID in read is asked for again in a request of its own, for when the
+// lengths kept for them don't fit what the module sent
+void uds::readAlone(const udsRead &read)
+{
+    if (!jobs.contains(read.job)) {
+        return;
+    }
+
+    jobs[read.job].remaining += read.dids.length();
+    for (int i = 0; i < read.dids.length(); i++) {
+        moduleLengths[read.txID].remove(read.dids.at(i));
+        udsRead single = read;
+        single.dids.clear();
+        single.dids << read.dids.at(i);
+        send(single);
+    }
+}
+
+// A module that can't take that many DIDs at once, or doesn't know one of them, says
+// so for the whole request. Halves are sent again until single DIDs are refused.
+void uds::retry(const udsRead &read, quint8 code)
+{
+    bool splittable = code == 0x13 || code == 0x14 || code == 0x31;
+    if (!splittable || read.dids.length() < 2 || !jobs.contains(read.job)) {
+        emit log("Info: UDS DID " + toHex(read.dids.first(), 4) + (read.dids.length() > 1 ? " and others" : "") +
+                 " refused, " + negativeResponse(code), debugMsgLog);
+        if (jobs.contains(read.job)) {
+            jobs[read.job].unsupported << read.dids;
+        }
+        return;
+    }
+
+    udsRead first = read;
+    udsRead second = read;
+    int half = read.dids.length() / 2;
+    first.dids = read.dids.mid(0, half);
+    second.dids = read.dids.mid(half);
+
+    if (code != 0x31) { // it was the length, don't ask this module for more than that again
+        moduleMaxDids.insert(read.txID, qMin(half, maxDids(read.txID)));
+    }
+
+    jobs[read.job].remaining += 2;
+    send(first);
+    send(second);
+}
+
+// 62 then each DID followed by its data, DIDs the module doesn't support are left
+// out of the response. A DID read on its own gets the rest of the response and its
+// length is kept. If the lengths kept don't add up the DIDs are read again one at a
+// time rather than trusting any of the values.
+void uds::parseResponse(const udsRead &read, const QByteArray &data)
+{
+    if (!jobs.contains(read.job)) {
+        return;
+    }
+
+    if (read.dids.length() == 1) {
+        int did = read.dids.first();
+        if (data.length() < 3 || ((static_cast<quint8>(data.at(1)) << 8) | static_cast<quint8>(data.at(2))) != did) {
+            jobs[read.job].unsupported << did;
+            return;
+        }
+        moduleLengths[read.txID].insert(did, data.length() - 3);
+        jobs[read.job].values.insert(did, data.mid(3));
+        return;
+    }
+
+    QMap<int, QByteArray> values;
+    QList<int> missing;
+    int pos = 1;
+    int next = 0;
+    while (pos + 2 <= data.length() && next < read.dids.length()) {
+        int did = (static_cast<quint8>(data.at(pos)) << 8) | static_cast<quint8>(data.at(pos + 1));
+        pos += 2;
+
+        while (next < read.dids.length() && read.dids.at(next) != did) {
+            missing << read.dids.at(next++);
+        }
+        if (next >= read.dids.length()) {
+            break;
+        }
+        next++;
+
+        int len = didLength(read.txID, did);
+        if (len < 0 || pos + len > data.length()) {
+            break;
+        }
+        values.insert(did, data.mid(pos, len));
+        pos += len;
+    }
+
+    if (pos != data.length()) {
+        emit log("Info: UDS data lengths from " + toHex(read.txID, 3) + " differ from the ones kept, reading " +
+                 QString::number(read.dids.length()) + " DIDs one at a time", debugMsgLog);
+        readAlone(read);
+        return;
+    }
+
+    while (next < read.dids.length()) {
+        missing << read.dids.at(next++);
+    }
+    udsJob &job = jobs[read.job];
+    job.unsupported << missing;
+    QMap<int, QByteArray>::const_iterator it;
+    for (it = values.constBegin(); it != values.constEnd(); ++it) {
+        job.values.insert(it.key(), it.value());
+    }
+}
+
+void uds::requestDone(int jobNum)
+{
+    if (!jobs.contains(jobNum) || --jobs[jobNum].remaining > 0) {
+        return;
+    }
+
+    udsJob job = jobs.take(jobNum);
+    if (!job.unsupported.empty()) {
+        QString dids;
+        for (int i = 0; i < job.unsupported.length(); i++) {
+            dids += toHex(job.unsupported.at(i), 4) + " ";
+        }
+        emit log("Info: " + toHex(job.txID, 3) + " did not return " + dids.trimmed());
+    }
+    emit didData(job.txID, job.values);
+}
+
+QString uds::negativeResponse(quint8 code)
+{
+    switch (code) {
+    case 0x10:
+        return "general reject";
+    case 0x11:
+        return "service not supported";
+    case 0x12:
+        return "sub-function not supported";
+    case 0x13:
+        return "incorrect message length or invalid format";
+    case 0x14:
+        return "response too long";
+    case 0x22:
+        return "conditions not correct";
+    case 0x31:
+        return "request out of range";
+    case 0x33:
+        return "security access denied";
+    case 0x7F:
+        return "service not supported in active session";
+    default:
+        return "negative response " + toHex(code);
+    }
+}
@@ -0,0 +1,90 @@
+/*
+Copyright 2013 Jared Wiltshire
+
+This file is part of VAG Blocks.
+
+VAG Blocks is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+VAG Blocks is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with VAG Blocks.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef UDS_H
+#define UDS_H
+
+#include <QObject>
+#include <QMap>
+#include <QList>
+
+#include "isotp.h"
+#include "tp20.h"
+#include "util.h"
+
+typedef struct {
+    int job;
+    int txID;
+    int rxID;
+    QList<int> dids;
+} udsRead;
+
+typedef struct {
+    int txID;
+    int remaining; // requests still to be answered
+    QMap<int, QByteArray> values;
+    QList<int> unsupported;
+} udsJob;
+
+// UDS client on top of isotp. ReadDataByIdentifier (0x22) asks for as many DIDs as
+// fit in one request, the response isn't self describing so each DID's data length
+// has to be known to split it up. Lengths vary by module, a DID is read on its own
+// the first time and the length it comes back with is kept for that module. A
+// request the module refuses as too long is split in half and sent again, and that
+// module isn't asked for more at once until the adapter is initialised again.
+class uds : public QObject
+{
+    Q_OBJECT
+public:
+    explicit uds(isotp* transport, tp20* tp, QObject *parent = 0);
+    void setDidLength(int did, int length);
+    void setMaxDidsPerRequest(int max);
+    static QString negativeResponse(quint8 code);
+signals:
+    void log(const QString &txt, int logLevel = stdLog);
+    void didData(int txID, const QMap<int, QByteArray> &values);
+public slots:
+    void readDIDs(int txID, int rxID, const QList<int> &dids);
+    void forgetModules();
+private slots:
+    void response(int rxID, const QByteArray &data);
+    void failed(int rxID, const QString &reason);
+private:
+    isotp* transport;
+    tp20* tp;
+    QMap<int, int> didLengths; // the same on every module
+    QMap<int, QMap<int, int> > moduleLengths; // learned, by txID then DID
+    int maxDidsPerRequest;
+    QMap<int, int> moduleMaxDids; // by txID, for modules that refused a long request
+    int nextJob;
+    QMap<int, udsJob> jobs;
+    QList<udsRead> outstanding; // in the order sent, isotp answers in order
+
+    int didLength(int txID, int did) const;
+    int maxDids(int txID) const;
+    void send(const udsRead &read);
+    void readAlone(const udsRead &read);
+    void retry(const udsRead &read, quint8 code);
+    void parseResponse(const udsRead &read, const QByteArray &data);
+    void requestDone(int job);
+    static const int responseTimeout = 200; // P2 is 50ms, leave room for the adapter
+};
+
+#endif // UDS_H
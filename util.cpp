@@ -19,6 +19,8 @@ along with VAG Blocks.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "util.h"
 
+#include <QRegExp>
+
 QString toHex(int num, int places)
 {
     return QString("%1").arg(num, places, 16, QChar('0')).toUpper();
@@ -49,3 +51,68 @@ int fromHex(QString str)
     bool ok;
     return str.toInt(&ok, 16);
 }
+
+// Accepts frames as written by the ELM327 monitor (headers and DLC on, eg "300 6 A1 0F 8A FF 4A FF")
+// and both candump formats, "(1436509052.249713) can0 300#A10F8AFF4AFF" and "can0 300 [6] A1 0F 8A FF 4A FF"
+bool parseFrameLine(const QString &line, capturedFrame &frame)
+{
+    QString dataStr;
+    int len = -1;
+    bool ok = false;
+
+    frame.time = -1;
+
+    // ELM327 format is checked first as it is the common case when called from the monitor
+    QString tmp = line;
+    tmp.remove(' ');
+    if (tmp.length() >= 4) {
+        frame.canID = tmp.mid(0, 3).toInt(&ok, 16);
+        if (ok) {
+            len = tmp.mid(3, 1).toInt(&ok, 16);
+            dataStr = tmp.mid(4);
+        }
+    }
+
+    if (!ok) {
+        static const QRegExp candumpLog("^\\((\\d+\\.\\d+)\\)\\s+\\S+\\s+([0-9A-Fa-f]{3})#([0-9A-Fa-f]*)\\s*$");
+        static const QRegExp candumpStd("^\\s*\\S+\\s+([0-9A-Fa-f]{3})\\s+\\[(\\d)\\]\\s+([0-9A-Fa-f ]*)$");
+
+        QRegExp logMatch(candumpLog);
+        QRegExp stdMatch(candumpStd);
+
+        if (logMatch.exactMatch(line)) {
+            frame.time = logMatch.cap(1).toDouble();
+            frame.canID = logMatch.cap(2).toInt(&ok, 16);
+            len = -1;
+            dataStr = logMatch.cap(3);
+        }
+        else if (stdMatch.exactMatch(line)) {
+            frame.canID = stdMatch.cap(1).toInt(&ok, 16);
+            len = stdMatch.cap(2).toInt();
+            dataStr = stdMatch.cap(3);
+        }
+        else {
+            return false;
+        }
+    }
+
+    dataStr.remove(' ');
+    if (dataStr.length() % 2) {
+        return false;
+    }
+
+    frame.data.clear();
+    for (int i = 0; i < dataStr.length() / 2; i++) {
+        quint8 byte = dataStr.mid(i*2, 2).toUShort(&ok, 16);
+        if (!ok) {
+            return false;
+        }
+        frame.data.append(byte);
+    }
+
+    if (len >= 0 && frame.data.length() != len) {
+        return false;
+    }
+
+    return frame.data.length() > 0;
+}
@@ -21,6 +21,7 @@ along with VAG Blocks.  If not, see <http://www.gnu.org/licenses/>.
 #define UTIL_H
 
 #include <QString>
+#include <QByteArray>
 
 QString toHex(int num, int places = 2);
 QString toHex(unsigned int num, int places = 2);
@@ -29,6 +30,15 @@ QString uintToBinary(unsigned int num, int places = 8);
 QString doubleToStr(double num, int prec = 2);
 int fromHex(QString str);
 
+typedef struct {
+    int index;
+    double time; // seconds, negative if the capture has no timestamps
+    int canID;
+    QByteArray data;
+} capturedFrame;
+
+bool parseFrameLine(const QString &line, capturedFrame &frame);
+
 enum {
     stdLog = 0x01,
     rxTxLog = 0x02,
@@ -27,7 +27,15 @@ SOURCES += main.cpp\
     monitor.cpp \
     clicklineedit.cpp \
     about.cpp \
-    settings.cpp
+    settings.cpp \
+    dissector.cpp \
+    dbc.cpp \
+    messagepool.cpp \
+    isotp.cpp \
+    uds.cpp \
+    samplestore.cpp \
+    blockdecoder.cpp \
+    memupload.cpp
 
 HEADERS  += mainwindow.h \
     elm327.h \
@@ -39,7 +47,15 @@ HEADERS  += mainwindow.h \
     monitor.h \
     clicklineedit.h \
     about.h \
-    settings.h
+    settings.h \
+    dissector.h \
+    dbc.h \
+    messagepool.h \
+    isotp.h \
+    uds.h \
+    samplestore.h \
+    blockdecoder.h \
+    memupload.h
 
 FORMS    += mainwindow.ui \
     serialsettings.ui \